@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Per message clock overhead, system calls vs hs_clock @file */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hs_clock.h"
+
+volatile unsigned long long g_sink;
+
+
+void hs_log(void *context, const char *plugin, int severity, const char *fmt,
+            ...)
+{
+  (void)context;
+  (void)plugin;
+  (void)severity;
+  (void)fmt;
+}
+
+
+static unsigned long long monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**
+ * One message: the loop reads the wall clock and a sampled matcher evaluation
+ * reads the fine clock twice
+ */
+static double run(long count, int coarse)
+{
+  unsigned long long start = monotonic_ns();
+  for (long i = 0; i < count; ++i) {
+    if (coarse) {
+      g_sink += hs_coarse_time();
+      unsigned long long s = hs_fine_time();
+      g_sink += hs_fine_time() - s;
+    } else {
+      g_sink += time(NULL);
+      unsigned long long s = monotonic_ns();
+      g_sink += monotonic_ns() - s;
+    }
+  }
+  return (double)(monotonic_ns() - start) / count;
+}
+
+
+int main(int argc, char *argv[])
+{
+  long count = argc > 1 ? atol(argv[1]) : 1000000;
+  unsigned resolution = argc > 2 ? (unsigned)atoi(argv[2]) : 100;
+
+  hs_init_clock(resolution);
+  run(count / 10, 0); // warm up
+  run(count / 10, 1);
+  double before = run(count, 0);
+  double after = run(count, 1);
+  hs_free_clock();
+
+  // at 1M messages/sec every message has a 1000ns budget
+  printf("%-7s %8.1f ns/message %6.2f%% of a 1M messages/sec thread\n",
+         "before", before, before / 10);
+  printf("%-7s %8.1f ns/message %6.2f%% of a 1M messages/sec thread\n",
+         "after", after, after / 10);
+  return 0;
+}
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Measures the per message clock overhead of the analysis loop before (time()
+# per message plus two clock_gettime calls per sampled matcher) and after the
+# process wide coarse clock and the TSC sampling clock, reported as the share
+# of a thread processing 1M messages/sec.
+#
+# usage: ./clock.sh [message_count] [clock_resolution_ms]
+
+COUNT=${1:-10000000}
+RESOLUTION=${2:-100}
+
+cd "$(dirname "$0")" || exit 1
+
+${CC:-cc} -std=c99 -O2 -D_POSIX_C_SOURCE=199506L -I../src -o clock_bench \
+    clock.c ../src/hs_clock.c -lpthread || exit 1
+./clock_bench "$COUNT" "$RESOLUTION"
+rm -f clock_bench
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Compares the queue compression codecs on the same dataset. The write phase
+# injects messages into the input queue, the read phase replays the resulting
+# queue through an output plugin. The CPU time and the size of the queue show
+# the trade-off between the compression work and the I/O saved.
+#
+# usage: ./compression.sh <hindsight_cli> [message_count] [payload_size]
+# The executable must be built with -DWITH_LZ4=true -DWITH_ZSTD=true. Set
+# DROP_CACHES=1 (requires root) to read cold segments.
+
+CLI=$1
+COUNT=${2:-10000000}
+SIZE=${3:-200}
+PRODUCERS=4
+
+if [ -z "$CLI" ]; then
+    echo "usage: $0 <hindsight_cli> [message_count] [payload_size]"
+    exit 1
+fi
+
+cd "$(dirname "$0")" || exit 1
+
+run() {
+    /usr/bin/time -f "%e %U %S" -o time.out "$CLI" compression.cfg 3 || exit 1
+    awk -v phase="$1" -v count="$COUNT" '{
+        printf("%-5s seconds: %6.2f messages/sec: %8.0f cpu seconds: %6.2f\n",
+               phase, $1, count / $1, $2 + $3)}' time.out
+}
+
+for codec in none lz4 zstd; do
+    echo "$codec"
+    rm -rf output_inject
+    rm -f run_inject/input/inject_*.cfg run_inject/output/counter.cfg
+    { cat inject.cfg; echo "input_queue = { compression = \"$codec\", group_commit_bytes = 256 * 1024 }"; } > compression.cfg
+
+    i=1
+    while [ $i -le $PRODUCERS ]; do
+        cat > run_inject/input/inject_$i.cfg <<CFG
+filename = "inject.lua"
+message_count = $((COUNT / PRODUCERS))
+payload_size = $SIZE
+CFG
+        i=$((i + 1))
+    done
+    run write
+    du -sb output_inject/input | awk '{printf("queue bytes: %d\n", $1)}'
+
+    # replay the queue from the beginning with no inputs running
+    rm -f run_inject/input/inject_*.cfg output_inject/hindsight.cp
+    cat > run_inject/output/counter.cfg <<CFG
+filename = "counter.lua"
+message_matcher = "TRUE"
+CFG
+    if [ "$DROP_CACHES" = 1 ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches || exit 1
+    fi
+    run read
+done
+rm -f run_inject/output/counter.cfg compression.cfg time.out
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Measures the analysis message matcher dispatch index with 10, 100 and 1000
+# analysis plugins. The write phase injects the messages once, each read phase
+# replays the queue through the analysis plugins with analysis_dispatch off
+# and on. Every plugin matches on a Type equality and only one of them matches
+# the injected messages, the others are skipped by the index.
+#
+# usage: ./dispatch.sh <hindsight_cli> [message_count]
+
+CLI=$1
+COUNT=${2:-1000000}
+
+if [ -z "$CLI" ]; then
+    echo "usage: $0 <hindsight_cli> [message_count]"
+    exit 1
+fi
+
+cd "$(dirname "$0")" || exit 1
+
+run() {
+    /usr/bin/time -f "%e %U %S" -o time.out "$CLI" dispatch.cfg 3 || exit 1
+    awk -v phase="$1" -v count="$COUNT" '{
+        printf("%-22s seconds: %6.2f messages/sec: %8.0f cpu seconds: %6.2f\n",
+               phase, $1, count / $1, $2 + $3)}' time.out
+}
+
+rm -rf output_inject
+rm -f run_inject/input/inject.cfg run_inject/analysis/dispatch_*.cfg
+cp inject.cfg dispatch.cfg
+cat > run_inject/input/inject.cfg <<CFG
+filename = "inject.lua"
+message_count = $COUNT
+CFG
+run write
+rm -f run_inject/input/inject.cfg
+
+cp run/analysis/counter.lua run_inject/analysis/counter.lua
+for plugins in 10 100 1000; do
+    rm -f run_inject/analysis/dispatch_*.cfg
+    i=1
+    while [ $i -le $plugins ]; do
+        type="inject_$i"
+        [ $i -eq 1 ] && type="inject"
+        cat > run_inject/analysis/dispatch_$i.cfg <<CFG
+filename = "counter.lua"
+message_matcher = "Type == '$type' && Severity < 7"
+ticker_interval = 0
+CFG
+        i=$((i + 1))
+    done
+    for dispatch in false true; do
+        { cat inject.cfg; echo "analysis_dispatch = $dispatch"; } > dispatch.cfg
+        rm -rf output_inject/hindsight.cp output_inject/analysis
+        run "plugins: $plugins dispatch: $dispatch"
+    done
+done
+rm -f run_inject/analysis/dispatch_*.cfg run_inject/analysis/counter.lua
+rm -f dispatch.cfg time.out
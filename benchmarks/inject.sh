@@ -0,0 +1,30 @@
+#!/bin/sh
+# Measures input queue write throughput as the number of concurrent input
+# plugins (producers) grows.
+#
+# usage: ./inject.sh [message_count] [payload_size]
+# HINDSIGHT_CLI can be set to the path of the hindsight_cli executable.
+
+HINDSIGHT_CLI=${HINDSIGHT_CLI:-hindsight_cli}
+COUNT=${1:-1000000}
+SIZE=${2:-200}
+
+cd "$(dirname "$0")" || exit 1
+for n in 1 2 4 8 16 32 64; do
+    rm -rf output_inject
+    rm -f run_inject/input/inject_*.cfg
+    i=1
+    while [ $i -le $n ]; do
+        cat > run_inject/input/inject_$i.cfg <<CFG
+filename = "inject.lua"
+message_count = $((COUNT / n))
+payload_size = $SIZE
+CFG
+        i=$((i + 1))
+    done
+    start=$(date +%s.%N)
+    $HINDSIGHT_CLI inject.cfg 3 || exit 1
+    end=$(date +%s.%N)
+    echo "$n $start $end $COUNT" | awk '{t = $3 - $2; printf("producers: %2d seconds: %6.2f messages/sec: %.0f\n", $1, t, $4 / t)}'
+done
+rm -f run_inject/input/inject_*.cfg
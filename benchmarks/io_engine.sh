@@ -0,0 +1,62 @@
+#!/bin/sh
+# Compares the stdio/writev and io_uring queue I/O engines on the same
+# dataset. The write phase injects messages into the input queue, the read
+# phase replays the resulting queue through an output plugin.
+#
+# usage: ./io_engine.sh <stdio hindsight_cli> <io_uring hindsight_cli> [message_count] [payload_size]
+# The second executable must be built with -DWITH_IO_URING=true. Set
+# DROP_CACHES=1 (requires root) to read cold segments.
+
+STDIO_CLI=$1
+URING_CLI=$2
+COUNT=${3:-10000000}
+SIZE=${4:-200}
+PRODUCERS=4
+
+if [ -z "$STDIO_CLI" ] || [ -z "$URING_CLI" ]; then
+    echo "usage: $0 <stdio hindsight_cli> <io_uring hindsight_cli> [message_count] [payload_size]"
+    exit 1
+fi
+
+cd "$(dirname "$0")" || exit 1
+
+elapsed() {
+    echo "$1 $2 $3 $4" | awk '{t = $3 - $2; printf("%-7s seconds: %6.2f messages/sec: %.0f\n", $1, t, $4 / t)}'
+}
+
+for engine in stdio io_uring; do
+    if [ $engine = stdio ]; then cli=$STDIO_CLI; else cli=$URING_CLI; fi
+    echo "$engine"
+    rm -rf output_inject
+    rm -f run_inject/input/inject_*.cfg run_inject/output/counter.cfg
+
+    i=1
+    while [ $i -le $PRODUCERS ]; do
+        cat > run_inject/input/inject_$i.cfg <<CFG
+filename = "inject.lua"
+message_count = $((COUNT / PRODUCERS))
+payload_size = $SIZE
+CFG
+        i=$((i + 1))
+    done
+    start=$(date +%s.%N)
+    $cli inject.cfg 3 || exit 1
+    end=$(date +%s.%N)
+    elapsed write "$start" "$end" "$COUNT"
+
+    # replay the queue from the beginning with no inputs running
+    rm -f run_inject/input/inject_*.cfg output_inject/hindsight.cp
+    cat > run_inject/output/counter.cfg <<CFG
+filename = "counter.lua"
+message_matcher = "TRUE"
+CFG
+    if [ "$DROP_CACHES" = 1 ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches || exit 1
+    fi
+    start=$(date +%s.%N)
+    $cli inject.cfg 3 || exit 1
+    end=$(date +%s.%N)
+    elapsed read "$start" "$end" "$COUNT"
+done
+rm -f run_inject/output/counter.cfg
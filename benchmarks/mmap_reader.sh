@@ -0,0 +1,60 @@
+#!/bin/sh
+# Compares the copying queue reader with the mmap reader (messages parsed in
+# place) on the same 1GiB input queue segment. The write phase injects the
+# messages once, each read phase replays the queue through an output plugin
+# (and the analysis thread) from the beginning.
+#
+# usage: ./mmap_reader.sh <hindsight_cli> [message_count] [payload_size]
+# The defaults produce a single segment of about 1GiB. Set DROP_CACHES=1
+# (requires root) to read cold segments.
+
+CLI=$1
+COUNT=${2:-4000000}
+SIZE=${3:-200}
+PRODUCERS=4
+
+if [ -z "$CLI" ]; then
+    echo "usage: $0 <hindsight_cli> [message_count] [payload_size]"
+    exit 1
+fi
+
+cd "$(dirname "$0")" || exit 1
+
+run() {
+    /usr/bin/time -f "%e %U %S" -o time.out "$CLI" mmap_reader.cfg 3 || exit 1
+    awk -v phase="$1" -v count="$COUNT" '{
+        printf("%-5s seconds: %6.2f messages/sec: %8.0f cpu seconds: %6.2f\n",
+               phase, $1, count / $1, $2 + $3)}' time.out
+}
+
+rm -rf output_inject
+rm -f run_inject/input/inject_*.cfg run_inject/output/counter.cfg
+cp inject.cfg mmap_reader.cfg
+i=1
+while [ $i -le $PRODUCERS ]; do
+    cat > run_inject/input/inject_$i.cfg <<CFG
+filename = "inject.lua"
+message_count = $((COUNT / PRODUCERS))
+payload_size = $SIZE
+CFG
+    i=$((i + 1))
+done
+run write
+du -sb output_inject/input | awk '{printf("queue bytes: %d\n", $1)}'
+rm -f run_inject/input/inject_*.cfg
+
+cat > run_inject/output/counter.cfg <<CFG
+filename = "counter.lua"
+message_matcher = "TRUE"
+CFG
+for reader in false true; do
+    echo "mmap_readers = $reader"
+    { cat inject.cfg; echo "input_queue = { mmap_readers = $reader }"; } > mmap_reader.cfg
+    rm -f output_inject/hindsight.cp
+    if [ "$DROP_CACHES" = 1 ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches || exit 1
+    fi
+    run read
+done
+rm -f run_inject/output/counter.cfg mmap_reader.cfg time.out
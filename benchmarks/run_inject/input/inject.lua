@@ -0,0 +1,20 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+local cnt = read_config("message_count") or 1000000
+
+local msg = {
+Timestamp   = nil,
+Type        = "inject",
+Hostname    = "benchmark",
+Payload     = string.rep("x", read_config("payload_size") or 200),
+Fields      = nil
+}
+
+function process_message()
+    for i = 1, cnt do
+        inject_message(msg, i)
+    end
+    return 0, tostring(cnt)
+end
@@ -21,13 +21,16 @@
 #include <unistd.h>
 
 #include "hs_analysis_plugins.h"
+#include "hs_catalog.h"
 #include "hs_checkpoint_writer.h"
+#include "hs_clock.h"
 #include "hs_config.h"
 #include "hs_input.h"
 #include "hs_input_plugins.h"
 #include "hs_logger.h"
 #include "hs_output_plugins.h"
 #include "hs_sslutil.h"
+#include "hs_util.h"
 
 
 static const char g_module[] = "hindsight";
@@ -151,9 +154,13 @@ int main(int argc, char *argv[])
     }
   }
 
+  hs_init_clock(cfg.clock_resolution);
+  hs_init_catalog();
+
   hs_checkpoint_reader cpr;
   hs_init_checkpoint_reader(&cpr, cfg.output_path);
-  hs_cleanup_checkpoints(&cpr, cfg.run_path, cfg.analysis_threads);
+  hs_cleanup_checkpoints(&cpr, cfg.run_path, cfg.analysis_threads,
+                         cfg.input_shards);
 
   hs_log(NULL, g_module, 6, "starting");
   sigset_t signal_set;
@@ -168,20 +175,31 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
-  hs_output input_queue;
-  hs_init_output(&input_queue, cfg.output_path, hs_input_dir);
+  hs_output *input_queue = calloc(cfg.input_shards, sizeof(hs_output));
+  if (!input_queue) {
+    hs_log(NULL, g_module, 0, "input_queue malloc failed");
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < cfg.input_shards; ++i) {
+    char subdir[HS_MAX_PATH];
+    if (hs_get_shard_dir(i, cfg.input_shards, subdir, sizeof(subdir))) {
+      hs_log(NULL, g_module, 0, "input queue shard name too long");
+      return EXIT_FAILURE;
+    }
+    hs_init_output(&input_queue[i], &cfg, &cfg.iqc, subdir);
+  }
 
   hs_input_plugins ips;
-  hs_init_input_plugins(&ips, &cfg, &cpr, &input_queue);
+  hs_init_input_plugins(&ips, &cfg, &cpr, input_queue);
   hs_load_input_startup(&ips);
 
   hs_analysis_plugins aps;
-  hs_init_analysis_plugins(&aps, &cfg, &cpr);
+  hs_init_analysis_plugins(&aps, &cfg, &cpr, input_queue);
   hs_load_analysis_startup(&aps);
   hs_start_analysis_threads(&aps);
 
   hs_output_plugins ops;
-  hs_init_output_plugins(&ops, &cfg, &cpr, &input_queue);
+  hs_init_output_plugins(&ops, &cfg, &cpr, input_queue, &aps.output);
   hs_load_output_startup(&ops);
 
   hs_checkpoint_writer cpw;
@@ -264,6 +282,7 @@ int main(int argc, char *argv[])
 
   hs_stop_output_plugins(&ops);
   hs_wait_output_plugins(&ops);
+  hs_sync_queues(&cpw);
   hs_write_checkpoints(&cpw, &cpr);
   if (ops.terminated) {
     rv |= 8;
@@ -279,15 +298,21 @@ int main(int argc, char *argv[])
   hs_wait_analysis_plugins(&aps);
   hs_wait_output_plugins(&ops);
 
+  hs_sync_queues(&cpw);
   hs_write_checkpoints(&cpw, &cpr);
 #endif
 
   hs_free_input_plugins(&ips);
   hs_free_analysis_plugins(&aps);
   hs_free_output_plugins(&ops);
-  hs_free_output(&input_queue);
+  for (int i = 0; i < cfg.input_shards; ++i) {
+    hs_free_output(&input_queue[i]);
+  }
+  free(input_queue);
   hs_free_checkpoint_writer(&cpw);
   hs_free_checkpoint_reader(&cpr);
+  hs_free_catalog();
+  hs_free_clock();
   hs_free_config(&cfg);
 
   pthread_join(sig_thread, NULL);
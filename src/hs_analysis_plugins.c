@@ -13,7 +13,6 @@
 #include <errno.h>
 #include <luasandbox.h>
 #include <luasandbox/lauxlib.h>
-#include <luasandbox/util/protobuf.h>
 #include <luasandbox_output.h>
 #include <pthread.h>
 #include <signal.h>
@@ -23,6 +22,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "hs_clock.h"
+#include "hs_dispatch.h"
 #include "hs_input.h"
 #include "hs_output.h"
 #include "hs_util.h"
@@ -30,71 +31,220 @@
 static const char g_module[] = "analysis_plugins";
 
 
-static int inject_message(void *parent, const char *pb, size_t pb_len)
+static hs_analysis_partitions* create_partitions(const hs_sandbox_config *sbc)
 {
-  static time_t last_bp_check = 0;
-  static bool backpressure = false;
-  static char header[14];
-
-  hs_analysis_plugin *p = parent;
-  if (p->im_limit == 0) return LSB_HEKA_IM_LIMIT;
-  --p->im_limit;
-  bool bp;
-  pthread_mutex_lock(&p->at->plugins->output.lock);
-  int len = lsb_pb_output_varint(header + 3, pb_len);
-  int tlen = 4 + len + pb_len;
-  header[0] = 0x1e;
-  header[1] = (char)(len + 1);
-  header[2] = 0x08;
-  header[3 + len] = 0x1f;
-  if (fwrite(header, 4 + len, 1, p->at->plugins->output.fh) == 1
-      && fwrite(pb, pb_len, 1, p->at->plugins->output.fh) == 1) {
-    p->at->plugins->output.cp.offset += tlen;
-    if (p->at->plugins->output.cp.offset >= p->at->plugins->cfg->output_size) {
-      ++p->at->plugins->output.cp.id;
-      hs_open_output_file(&p->at->plugins->output);
-      if (p->at->plugins->cfg->backpressure
-          && p->at->plugins->output.cp.id - p->at->plugins->output.min_cp_id
-          > p->at->plugins->cfg->backpressure) {
-        backpressure = true;
-        hs_log(NULL, g_module, 4, "applying backpressure (checkpoint)");
-      }
-      if (!backpressure && p->at->plugins->cfg->backpressure_df) {
-        unsigned df = hs_disk_free_ob(p->at->plugins->output.path,
-                                      p->at->plugins->cfg->output_size);
-        if (df <= p->at->plugins->cfg->backpressure_df) {
-          backpressure = true;
-          hs_log(NULL, g_module, 4, "applying backpressure (disk)");
-        }
-      }
+  char header = 0;
+  const char *key = sbc->partition_key;
+  size_t len = strlen(key);
+  static const char *headers[] = { "Type", "Logger", "Hostname", "Payload",
+    "EnvVersion", "Uuid", "Severity", "Pid" };
+  for (size_t i = 0; i < sizeof(headers) / sizeof(*headers); ++i) {
+    if (strcmp(key, headers[i]) == 0) {
+      header = i == 7 ? 'I' : headers[i][0];
+      break;
     }
-    if (backpressure && last_bp_check < time(NULL)) {
-      last_bp_check = time(NULL);
-      bool release_dfbp = true;
-      if (p->at->plugins->cfg->backpressure_df) {
-        unsigned df = hs_disk_free_ob(p->at->plugins->output.path,
-                                      p->at->plugins->cfg->output_size);
-        release_dfbp = (df > p->at->plugins->cfg->backpressure_df);
-      }
-      // even if we triggered on disk space continue to backpressure
-      // until the queue is caught up too
-      if (p->at->plugins->output.cp.id == p->at->plugins->output.min_cp_id
-          && release_dfbp) {
-        backpressure = false;
-        hs_log(NULL, g_module, 4, "releasing backpressure");
-      }
+  }
+  if (!header && len > 8 && strncmp(key, "Fields[", 7) == 0
+      && key[len - 1] == ']') {
+    header = 'F';
+  }
+  if (!header) {
+    hs_log(NULL, g_module, 3, "%s invalid partition_key: %s", sbc->cfg_name,
+           key);
+    return NULL;
+  }
+
+  hs_analysis_partitions *ap = calloc(1, sizeof(hs_analysis_partitions));
+  if (!ap) {
+    hs_log(NULL, g_module, 0, "partitions calloc failed");
+    exit(EXIT_FAILURE);
+  }
+  if (header == 'F') {
+    char *field = malloc(len - 7);
+    if (!field) {
+      hs_log(NULL, g_module, 0, "partition field malloc failed");
+      exit(EXIT_FAILURE);
     }
-  } else {
-    hs_log(NULL, g_module, 0, "inject_message fwrite failed: %s",
-           strerror(ferror(p->at->plugins->output.fh)));
+    memcpy(field, key + 7, len - 8);
+    field[len - 8] = 0;
+    ap->field.s = field;
+    ap->field.len = len - 8;
+  }
+  if (pthread_mutex_init(&ap->lock, NULL)) {
+    perror("partitions pthread_mutex_init failed");
+    exit(EXIT_FAILURE);
+  }
+  if (pthread_cond_init(&ap->finished_cond, NULL)) {
+    perror("partitions pthread_cond_init failed");
+    exit(EXIT_FAILURE);
+  }
+  if (lsb_init_heka_message(&ap->msg, 8)) {
+    hs_log(NULL, g_module, 0, "failed to initialize the partial message");
     exit(EXIT_FAILURE);
   }
-  bp = backpressure;
-  pthread_mutex_unlock(&p->at->plugins->output.lock);
+  ap->header = header;
+  ap->cnt = sbc->parallelism;
+  ap->merge = sbc->partition_merge;
+  ap->refs = 1; // the loader's
+  return ap;
+}
+
 
-  if (bp) {
-    usleep(100000); // throttle to 10 messages per second
+static void free_partials(hs_analysis_partitions *ap)
+{
+  for (int i = 0; i < ap->partials_cnt; ++i) {
+    free(ap->partials[i]);
   }
+  free(ap->partials);
+  free(ap->partials_len);
+  ap->partials = NULL;
+  ap->partials_len = NULL;
+  ap->partials_cnt = 0;
+  ap->partials_cap = 0;
+}
+
+
+static void release_partitions(hs_analysis_partitions *ap)
+{
+  if (!ap || __atomic_sub_fetch(&ap->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+  free_partials(ap);
+  lsb_free_heka_message(&ap->msg);
+  free((char *)ap->field.s);
+  pthread_cond_destroy(&ap->finished_cond);
+  pthread_mutex_destroy(&ap->lock);
+  free(ap);
+}
+
+
+/**
+ * Counts an instance other than 0 as past its final timer event, instance 0
+ * waits for all of them before its own at shutdown
+ */
+static void finish_partition(hs_analysis_plugin *p)
+{
+  if (!p->partitions || p->partition == 0 || p->finished) return;
+
+  p->finished = true;
+  pthread_mutex_lock(&p->partitions->lock);
+  ++p->partitions->finished;
+  pthread_cond_broadcast(&p->partitions->finished_cond);
+  pthread_mutex_unlock(&p->partitions->lock);
+}
+
+
+/**
+ * Instance 0 is gone (terminated or unloaded), nothing will merge the other
+ * instances' output anymore
+ */
+static void orphan_partitions(hs_analysis_plugin *p)
+{
+  hs_analysis_partitions *ap = p->partitions;
+  if (!ap || p->partition != 0 || !ap->merge) return;
+
+  pthread_mutex_lock(&ap->lock);
+  ap->orphaned = true;
+  free_partials(ap);
+  if (ap->finished < ap->cnt - 1) {
+    hs_log(NULL, p->name, 4, "the timer event output of the other instances "
+           "is dropped until the plugin is reloaded");
+  }
+  pthread_mutex_unlock(&ap->lock);
+}
+
+
+static void add_partial(hs_analysis_partitions *ap, const char *pb, size_t len)
+{
+  pthread_mutex_lock(&ap->lock);
+  if (ap->orphaned) {
+    pthread_mutex_unlock(&ap->lock);
+    return;
+  }
+
+  char *partial = malloc(len);
+  if (!partial) {
+    hs_log(NULL, g_module, 0, "partial malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(partial, pb, len);
+  if (ap->partials_cnt == ap->partials_cap) {
+    int cap = ap->partials_cap ? ap->partials_cap * 2 : 8;
+    char **tmp = realloc(ap->partials, sizeof(char *) * cap);
+    size_t *tmp_len = tmp ? realloc(ap->partials_len, sizeof(size_t) * cap)
+        : NULL;
+    if (!tmp || !tmp_len) {
+      hs_log(NULL, g_module, 0, "partials realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    ap->partials = tmp;
+    ap->partials_len = tmp_len;
+    ap->partials_cap = cap;
+  }
+  ap->partials[ap->partials_cnt] = partial;
+  ap->partials_len[ap->partials_cnt++] = len;
+  pthread_mutex_unlock(&ap->lock);
+}
+
+
+/**
+ * Hashes the partition key of a message (a missing key hashes as empty)
+ */
+static unsigned partition_hash(const hs_analysis_partitions *ap,
+                               const lsb_heka_message *m)
+{
+  lsb_const_string s = { .s = NULL, .len = 0 };
+  lsb_read_value v;
+  double d;
+  switch (ap->header) {
+  case 'T': s = m->type; break;
+  case 'L': s = m->logger; break;
+  case 'H': s = m->hostname; break;
+  case 'P': s = m->payload; break;
+  case 'E': s = m->env_version; break;
+  case 'U': s = m->uuid; break;
+  case 'S': d = m->severity; s.s = (const char *)&d; s.len = sizeof(d); break;
+  case 'I': d = m->pid; s.s = (const char *)&d; s.len = sizeof(d); break;
+  default:
+    if (!lsb_read_heka_field(m, (lsb_const_string *)&ap->field, 0, 0, &v)) {
+      break;
+    }
+    if (v.type == LSB_READ_STRING) {
+      s = v.u.s;
+    } else if (v.type != LSB_READ_NIL) {
+      d = v.u.d;
+      s.s = (const char *)&d;
+      s.len = sizeof(d);
+    }
+    break;
+  }
+
+  unsigned h = 2166136261u; // FNV-1a
+  for (size_t i = 0; s.s && i < s.len; ++i) {
+    h = (h ^ (unsigned char)s.s[i]) * 16777619u;
+  }
+  return h;
+}
+
+
+static bool in_partition(const hs_analysis_plugin *p, const lsb_heka_message *m)
+{
+  return partition_hash(p->partitions, m) % p->partitions->cnt
+      == p->partition;
+}
+
+
+static int inject_message(void *parent, const char *pb, size_t pb_len)
+{
+  hs_analysis_plugin *p = parent;
+  if (p->im_limit == 0) return LSB_HEKA_IM_LIMIT;
+  --p->im_limit;
+  if (p->merging) {
+    add_partial(p->partitions, pb, pb_len);
+    return LSB_HEKA_IM_SUCCESS;
+  }
+  size_t len = hs_output_message(&p->at->plugins->output, &p->at->ring, pb,
+                                 pb_len);
+  hs_throttle_output(&p->at->plugins->output, &p->at->ring, len);
   return LSB_HEKA_IM_SUCCESS;
 }
 
@@ -108,6 +258,11 @@ static void destroy_analysis_plugin(hs_analysis_plugin *p)
     free(msg);
   }
   lsb_destroy_message_matcher(p->mm);
+  hs_free_dispatch_keys(&p->keys);
+  free(p->skip_cp);
+  finish_partition(p);
+  orphan_partitions(p);
+  release_partitions(p->partitions);
   free(p->name);
   free(p);
 }
@@ -132,6 +287,7 @@ create_analysis_plugin(const hs_config *cfg, hs_sandbox_config *sbc)
 
   p->pm_im_limit = sbc->pm_im_limit;
   p->te_im_limit = sbc->te_im_limit;
+  p->bp_weight = sbc->backpressure_weight;
   p->shutdown_terminate = sbc->shutdown_terminate;
   p->ticker_interval = sbc->ticker_interval;
   p->pm_sample = true;
@@ -151,6 +307,7 @@ create_analysis_plugin(const hs_config *cfg, hs_sandbox_config *sbc)
     destroy_analysis_plugin(p);
     return NULL;
   }
+  hs_parse_dispatch_keys(&p->keys, sbc->message_matcher);
 
   size_t len = strlen(sbc->cfg_name) + 1;
   p->name = malloc(len);
@@ -207,8 +364,6 @@ create_analysis_plugin(const hs_config *cfg, hs_sandbox_config *sbc)
                                       inject_message);
   }
   lsb_free_output_buffer(&ob);
-  free(sbc->cfg_lua);
-  sbc->cfg_lua = NULL;
   free(state_file);
   if (!p->hsb) {
     hs_log(NULL, g_module, 3, "%s lsb_heka_create_analysis failed",
@@ -223,13 +378,33 @@ create_analysis_plugin(const hs_config *cfg, hs_sandbox_config *sbc)
 }
 
 
-static void remove_plugin(hs_analysis_thread *at, int idx)
+/**
+ * The plugins of a thread share its ring, it is weighted by the most important
+ * one. The caller must hold at->list_lock.
+ */
+static void update_ring_weight(hs_analysis_thread *at)
+{
+  unsigned weight = 1;
+  for (int i = 0; i < at->list_cap; ++i) {
+    if (at->list[i] && at->list[i]->bp_weight > weight) {
+      weight = at->list[i]->bp_weight;
+    }
+  }
+  __atomic_store_n(&at->ring.weight, weight, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Takes a plugin out of the thread's list without destroying it. The caller
+ * must hold at->list_lock.
+ */
+static hs_analysis_plugin* detach_plugin(hs_analysis_thread *at, int idx)
 {
-  hs_log(NULL, at->list[idx]->name, 6, "removing from thread: %d", at->tid);
   hs_analysis_plugin *p = at->list[idx];
   at->list[idx] = NULL;
-  destroy_analysis_plugin(p);
-  p = NULL;
+  hs_remove_dispatch(&at->dispatch, idx, &p->keys);
+  hs_cancel_timer(&at->timers, idx);
+  if (at->migrate == p) at->migrate = NULL;
   --at->list_cnt;
   if (at->utilization > 5) {
     at->utilization -= 5;
@@ -237,24 +412,24 @@ static void remove_plugin(hs_analysis_thread *at, int idx)
     at->utilization = 0;
   }
   at->max_mps = 0; // invalidate the measure and switch back to the estimate
+  update_ring_weight(at);
+  return p;
 }
 
 
-static void remove_from_analysis_plugins(hs_analysis_thread *at,
-                                         const char *name)
+static void remove_plugin(hs_analysis_thread *at, int idx)
 {
-  const size_t tlen = strlen(hs_analysis_dir) + 1;
-  pthread_mutex_lock(&at->list_lock);
-  for (int i = 0; i < at->list_cap; ++i) {
-    if (!at->list[i]) continue;
+  hs_log(NULL, at->list[idx]->name, 6, "removing from thread: %d", at->tid);
+  destroy_analysis_plugin(detach_plugin(at, idx));
+}
 
-    char *pos = at->list[i]->name + tlen;
-    if (strstr(name, pos) && strlen(pos) == strlen(name) - HS_EXT_LEN) {
-      remove_plugin(at, i);
-      break;
-    }
-  }
-  pthread_mutex_unlock(&at->list_lock);
+
+static bool is_plugin(const hs_analysis_plugin *p, const char *name)
+{
+  const char *pos = p->name + strlen(hs_analysis_dir) + 1;
+  // all the instances of a partitioned plugin share the base name
+  size_t len = p->partitions ? strcspn(pos, "#") : strlen(pos);
+  return strlen(name) - HS_EXT_LEN == len && strncmp(name, pos, len) == 0;
 }
 
 
@@ -262,6 +437,10 @@ static void add_plugin(hs_analysis_thread *at, hs_analysis_plugin *p, int idx)
 {
   hs_log(NULL, p->name, 6, "adding to thread: %d", at->tid);
   at->list[idx] = p;
+  hs_add_dispatch(&at->dispatch, idx, &p->keys);
+  if (p->ticker_interval) {
+    hs_schedule_timer(&at->timers, idx, p->ticker_expires);
+  }
   if (UINT8_MAX - at->utilization > 5) {
     at->utilization += 5;
   } else {
@@ -271,16 +450,15 @@ static void add_plugin(hs_analysis_thread *at, hs_analysis_plugin *p, int idx)
 }
 
 
-static void add_to_analysis_plugins(const hs_sandbox_config *cfg,
-                                    hs_analysis_plugins *plugins,
-                                    hs_analysis_plugin *p)
+/**
+ * Adds a plugin to the first free slot of the thread's list. The caller must
+ * hold at->list_lock.
+ *
+ * @return int Slot of the plugin
+ */
+static int insert_plugin(hs_analysis_thread *at, hs_analysis_plugin *p)
 {
   int idx = -1;
-  int thread = cfg->thread % plugins->cfg->analysis_threads;
-  hs_analysis_thread *at = &plugins->list[thread];
-  p->at = at;
-
-  pthread_mutex_lock(&at->list_lock);
   // todo shrink it down if there are a lot of empty slots
   for (int i = 0; i < at->list_cap; ++i) {
     if (!at->list[i]) {
@@ -306,10 +484,152 @@ static void add_to_analysis_plugins(const hs_sandbox_config *cfg,
     }
   }
   at->max_mps = 0; // invalidate the measure and switch back to the estimate
+  update_ring_weight(at);
+  return idx;
+}
+
+
+/**
+ * Applies the list change requested by the loader. The caller must hold
+ * at->list_lock.
+ */
+static void change_list(hs_analysis_thread *at)
+{
+  if (at->unload) {
+    for (int i = 0; i < at->list_cap; ++i) {
+      if (at->list[i] && is_plugin(at->list[i], at->unload)) {
+        remove_plugin(at, i);
+      }
+    }
+    if (at->adopt && is_plugin(at->adopt, at->unload)) { // in transit
+      hs_log(NULL, at->adopt->name, 6, "removing from thread: %d", at->tid);
+      destroy_analysis_plugin(at->adopt);
+      at->adopt = NULL;
+    }
+    at->unload = NULL;
+  }
+  if (at->load) {
+    insert_plugin(at, at->load);
+    at->load = NULL;
+  }
+  __atomic_store_n(&at->list_change, false, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&at->list_cond);
+}
+
+
+/**
+ * Changes the thread's plugin list. A running thread is the only writer of its
+ * list (the message loop reads it without locking) so the change is handed to
+ * it and this waits until it has been applied, a removed plugin has saved its
+ * state when this returns.
+ */
+static void request_list_change(hs_analysis_thread *at, hs_analysis_plugin *p,
+                                const char *name)
+{
+  pthread_mutex_lock(&at->list_lock);
+  at->load = p;
+  at->unload = name;
+  if (at->running) {
+    __atomic_store_n(&at->list_change, true, __ATOMIC_RELEASE);
+    hs_notify_waiter(&at->waiter);
+    while (at->list_change) {
+      pthread_cond_wait(&at->list_cond, &at->list_lock);
+    }
+  } else {
+    change_list(at);
+  }
   pthread_mutex_unlock(&at->list_lock);
 }
 
 
+/**
+ * Applies a pending list change on the thread between two messages, deferred
+ * while another thread is reading the list
+ */
+static void apply_list_change(hs_analysis_thread *at)
+{
+  if (!__atomic_load_n(&at->list_change, __ATOMIC_ACQUIRE)) return;
+  if (pthread_mutex_trylock(&at->list_lock)) return;
+  if (at->list_change) change_list(at);
+  pthread_mutex_unlock(&at->list_lock);
+}
+
+
+static void remove_from_analysis_plugins(hs_analysis_thread *at,
+                                         const char *name)
+{
+  request_list_change(at, NULL, name);
+}
+
+
+static void add_to_analysis_plugins(const hs_sandbox_config *cfg,
+                                    hs_analysis_plugins *plugins,
+                                    hs_analysis_plugin *p)
+{
+  int thread = cfg->thread % plugins->cfg->analysis_threads;
+  hs_analysis_thread *at = &plugins->list[thread];
+  p->at = at;
+  request_list_change(at, p, NULL);
+}
+
+
+static bool load_analysis_plugin(hs_analysis_plugins *plugins,
+                                 hs_sandbox_config *sbc, bool pinned)
+{
+  if (sbc->parallelism <= 1) {
+    hs_analysis_plugin *p = create_analysis_plugin(plugins->cfg, sbc);
+    if (!p) return false;
+    p->pinned = pinned;
+    add_to_analysis_plugins(sbc, plugins, p);
+    return true;
+  }
+
+  hs_analysis_partitions *ap = create_partitions(sbc);
+  if (!ap) return false;
+
+  unsigned n = sbc->parallelism;
+  if (n > (unsigned)plugins->thread_cnt) {
+    hs_log(NULL, g_module, 4, "%s parallelism %u exceeds the %d analysis "
+           "threads", sbc->cfg_name, n, plugins->thread_cnt);
+  }
+  hs_analysis_plugin *instances[n];
+  char *cfg_name = sbc->cfg_name;
+  unsigned thread = sbc->thread;
+  size_t len = strlen(cfg_name) + 12;
+  char name[len];
+  bool ok = true;
+  for (unsigned i = 0; i < n; ++i) {
+    snprintf(name, len, "%s#%u", cfg_name, i);
+    sbc->cfg_name = i ? name : cfg_name; // the first keeps the plugin's name
+    sbc->partition = i;
+    sbc->thread = thread + i;
+    instances[i] = create_analysis_plugin(plugins->cfg, sbc);
+    if (!instances[i]) {
+      ok = false;
+      for (unsigned j = 0; j < i; ++j) {
+        destroy_analysis_plugin(instances[j]);
+      }
+      break;
+    }
+    __atomic_add_fetch(&ap->refs, 1, __ATOMIC_ACQ_REL);
+    instances[i]->partitions = ap;
+    instances[i]->partition = i;
+    instances[i]->pinned = true; // the copies must stay on different threads
+  }
+  if (ok) {
+    for (unsigned i = 0; i < n; ++i) {
+      sbc->thread = thread + i;
+      add_to_analysis_plugins(sbc, plugins, instances[i]);
+    }
+  }
+  sbc->cfg_name = cfg_name;
+  sbc->partition = 0;
+  sbc->thread = thread;
+  release_partitions(ap);
+  return ok;
+}
+
+
 static void init_analysis_thread(hs_analysis_plugins *plugins, int tid)
 {
   hs_analysis_thread *at = &plugins->list[tid];
@@ -319,10 +639,16 @@ static void init_analysis_thread(hs_analysis_plugins *plugins, int tid)
     perror("list_lock pthread_mutex_init failed");
     exit(EXIT_FAILURE);
   }
+  if (pthread_cond_init(&at->list_cond, NULL)) {
+    perror("list_cond pthread_cond_init failed");
+    exit(EXIT_FAILURE);
+  }
   if (pthread_mutex_init(&at->cp_lock, NULL)) {
     perror("cp_lock pthread_mutex_init failed");
     exit(EXIT_FAILURE);
   }
+  hs_init_dispatch(&at->dispatch);
+  hs_init_timers(&at->timers);
 
   char name[255];
   int n = snprintf(name, sizeof name, "%s%d", hs_analysis_dir, tid);
@@ -332,31 +658,98 @@ static void init_analysis_thread(hs_analysis_plugins *plugins, int tid)
     exit(EXIT_FAILURE);
   }
 
-  hs_init_input(&at->input, plugins->cfg->max_message_size,
-                plugins->cfg->output_path, name);
+  int shards = plugins->cfg->input_shards;
+  at->input = calloc(shards, sizeof(hs_input));
+  at->cp = calloc(shards, sizeof(hs_checkpoint));
+  if (!at->input || !at->cp) {
+    hs_log(NULL, g_module, 0, "input shard memory allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < shards; ++i) {
+    char subdir[HS_MAX_PATH];
+    if (hs_get_shard_dir(i, shards, subdir, sizeof(subdir))) {
+      hs_log(NULL, g_module, 0, "input queue shard name too long");
+      exit(EXIT_FAILURE);
+    }
+    // with the shared reader the thread's readers only name its checkpoints,
+    // they are never read (mapped so no readahead ring is set up)
+    hs_init_input(&at->input[i], plugins->cfg->max_message_size,
+                  plugins->cfg->output_path, subdir, name,
+                  plugins->cfg->iqc.mmap_readers
+                  || plugins->cfg->analysis_shared_reader);
+  }
+  hs_init_waiter(&at->waiter);
+  at->prefetch = NULL;
+  at->consumer = tid;
+  // the injection ring is needed with or without the shared reader
+  if (hs_init_ring(&at->ring, HS_OUTPUT_RING_SIZE)) {
+    hs_log(NULL, g_module, 0, "ring memory allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  hs_add_output_ring(&plugins->output, &at->ring);
+  if (plugins->cfg->analysis_shared_reader) return; // see init_shared_reader
+
+  hs_waiter *w = &at->waiter;
+  if (plugins->cfg->analysis_prefetch) {
+    at->prefetch = malloc(sizeof(hs_prefetch));
+    if (!at->prefetch) {
+      hs_log(NULL, g_module, 0, "prefetch memory allocation failed");
+      exit(EXIT_FAILURE);
+    }
+    at->consumer = 0;
+    hs_init_prefetch(at->prefetch, plugins->cfg->analysis_prefetch, at->input,
+                     shards, plugins->cfg, plugins->cpr, &w, 1);
+    w = &at->prefetch->waiter; // the stage reads the queues
+  }
+  for (int i = 0; i < shards; ++i) {
+    hs_add_output_waiter(&plugins->input[i], w);
+  }
 }
 
 
 static void free_analysis_thread(hs_analysis_thread *at)
 {
+  if (at->prefetch != at->plugins->prefetch) {
+    for (int i = 0; i < at->plugins->cfg->input_shards; ++i) {
+      hs_remove_output_waiter(&at->plugins->input[i], &at->prefetch->waiter);
+    }
+    hs_free_prefetch(at->prefetch);
+    free(at->prefetch);
+  } else if (!at->prefetch) {
+    for (int i = 0; i < at->plugins->cfg->input_shards; ++i) {
+      hs_remove_output_waiter(&at->plugins->input[i], &at->waiter);
+    }
+  }
+  at->prefetch = NULL;
+  hs_remove_output_ring(&at->plugins->output, &at->ring);
+  hs_free_ring(&at->ring);
   pthread_mutex_destroy(&at->cp_lock);
   pthread_mutex_destroy(&at->list_lock);
-  at->plugins = NULL;
+  pthread_cond_destroy(&at->list_cond);
   for (int i = 0; i < at->list_cap; ++i) {
     if (!at->list[i]) continue;
     remove_plugin(at, i);
   }
+  destroy_analysis_plugin(at->adopt); // handed over after the thread exited
+  at->adopt = NULL;
   free(at->list);
   at->list = NULL;
+  hs_free_dispatch(&at->dispatch);
+  hs_free_timers(&at->timers);
   at->msg = NULL;
-  at->cp.id = 0;
-  at->cp.offset = 0;
   at->current_t = 0;
   at->list_cap = 0;
   at->list_cnt = 0;
   at->tid = 0;
 
-  hs_free_input(&at->input);
+  for (int i = 0; i < at->plugins->cfg->input_shards; ++i) {
+    hs_free_input(&at->input[i]);
+  }
+  free(at->input);
+  at->input = NULL;
+  free(at->cp);
+  at->cp = NULL;
+  at->plugins = NULL;
 }
 
 
@@ -372,73 +765,446 @@ static void terminate_sandbox(hs_analysis_thread *at, int i)
     hs_log(NULL, at->list[i]->name, 6, "shutting down on terminate");
     kill(getpid(), SIGTERM);
   }
+  pthread_mutex_lock(&at->list_lock);
   remove_plugin(at, i);
+  pthread_mutex_unlock(&at->list_lock);
+}
+
+
+static bool processed(const hs_checkpoint *cp, const hs_checkpoint *at_cp)
+{
+  return cp->id < at_cp->id
+      || (cp->id == at_cp->id && cp->offset <= at_cp->offset);
+}
+
+
+/**
+ * Tests if a migrated plugin already processed the message on its previous
+ * thread
+ */
+static bool seen(hs_analysis_plugin *p, const hs_checkpoint *cp, int shard)
+{
+  if (!p->skip_cp || !cp) return false;
+
+  hs_checkpoint *skip = &p->skip_cp[shard];
+  if (processed(cp, skip)) return true;
+  skip->id = 0; // past it, nothing more to skip on this shard
+  skip->offset = 0;
+  return false;
 }
 
 
-static void analyze_message(hs_analysis_thread *at, bool sample)
+/**
+ * Publishes the sampled statistics (seqlock, the stats pass never blocks the
+ * thread)
+ *
+ * @param p Analysis plugin
+ * @param mm_ns Message matcher time or -1 to leave the matcher stats as is
+ */
+static void write_stats(hs_analysis_plugin *p, long long mm_ns)
+{
+  unsigned seq = p->stats_seq;
+  __atomic_store_n(&p->stats_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  if (mm_ns >= 0) lsb_update_running_stats(&p->mms, mm_ns);
+  p->stats = lsb_heka_get_stats(p->hsb);
+  __atomic_store_n(&p->stats_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+static int process_message(hs_analysis_plugin *p, lsb_heka_message *msg)
+{
+  p->im_limit = p->pm_im_limit;
+  __atomic_add_fetch(&p->pm_delta_cnt, 1, __ATOMIC_RELAXED);
+  int ret = lsb_heka_pm_analysis(p->hsb, msg, p->pm_sample);
+  p->pm_sample = false;
+  if (ret < 0) {
+    const char *err = lsb_heka_get_error(p->hsb);
+    if (strlen(err) > 0) {
+      hs_log(NULL, p->name, 4, "received: %d msg: %s", ret, err);
+    }
+  }
+  return ret;
+}
+
+
+/**
+ * Feeds the messages injected by the other copies of a partitioned plugin
+ * during their last timer_event to the first copy's process_message
+ */
+static int merge_partials(hs_analysis_plugin *p)
+{
+  hs_analysis_partitions *ap = p->partitions;
+  pthread_mutex_lock(&ap->lock);
+  char **partials = ap->partials;
+  size_t *partials_len = ap->partials_len;
+  int cnt = ap->partials_cnt;
+  ap->partials = NULL;
+  ap->partials_len = NULL;
+  ap->partials_cnt = 0;
+  ap->partials_cap = 0;
+  pthread_mutex_unlock(&ap->lock);
+
+  int ret = 0;
+  for (int i = 0; i < cnt; ++i) {
+    if (ret <= 0) {
+      lsb_clear_heka_message(&ap->msg);
+      if (lsb_decode_heka_message(&ap->msg, partials[i], partials_len[i],
+                                  NULL)) {
+        ret = process_message(p, &ap->msg);
+      }
+    }
+    free(partials[i]);
+  }
+  free(partials);
+  free(partials_len);
+  return ret;
+}
+
+
+/**
+ * Runs the timer_event of every plugin that is due, earliest first
+ *
+ * @param at Analysis thread
+ * @param sample Sample the sandbox statistics
+ */
+static void fire_timers(hs_analysis_thread *at, bool sample)
+{
+  int i;
+  while ((i = hs_due_timer(&at->timers, at->current_t)) >= 0) {
+    hs_analysis_plugin *p = at->list[i];
+    int ret = 0;
+    if (p->partitions && p->partitions->merge) {
+      if (p->partition == 0) {
+        ret = merge_partials(p);
+      } else {
+        p->merging = true; // the output goes to the first copy
+      }
+    }
+    p->im_limit = p->te_im_limit;
+    if (ret <= 0) ret = lsb_heka_timer_event(p->hsb, at->current_t, false);
+    p->merging = false;
+
+    // keep the schedule instead of drifting by the time it fired late
+    p->ticker_expires += p->ticker_interval;
+    if (p->ticker_expires <= at->current_t) {
+      p->ticker_expires = at->current_t + p->ticker_interval;
+    }
+    hs_schedule_timer(&at->timers, i, p->ticker_expires);
+
+    if (sample) write_stats(p, -1);
+    if (ret > 0) terminate_sandbox(at, i);
+  }
+}
+
+
+/**
+ * Runs the message through the thread's plugins and the timer events that are
+ * due
+ *
+ * @param at Analysis thread
+ * @param sample Sample the matcher timing and the sandbox statistics
+ * @param cp Queue position after the message (NULL for the idle message)
+ * @param shard Input queue shard of the message
+ */
+static void analyze_message(hs_analysis_thread *at, bool sample,
+                            const hs_checkpoint *cp, int shard)
 {
   hs_analysis_plugin *p = NULL;
   int ret;
 
-  pthread_mutex_lock(&at->list_lock);
-  for (int i = 0; i < at->list_cap; ++i) {
+  // the thread is the only writer of its list, no lock needed to read it
+  bool dispatch = at->plugins->cfg->analysis_dispatch && at->msg->raw.s;
+  if (dispatch) hs_select_dispatch(&at->dispatch, at->msg);
+  // the idle message only has to visit the plugins to flag the sample
+  for (int i = 0; (at->msg->raw.s || sample) && i < at->list_cap; ++i) {
     if (!at->list[i]) continue;
     p = at->list[i];
 
     ret = 0;
+    long long mm_ns = -1;
     if (at->msg->raw.s) { // non idle/empty message
       bool matched;
-      if (sample) {
-        unsigned long long start = lsb_get_time();
+      if ((dispatch && !hs_dispatch_selected(&at->dispatch, i))
+          || seen(p, cp, shard)
+          || (p->partitions && !in_partition(p, at->msg))) {
+        // the matcher cannot be true (or the plugin processed the message on
+        // the thread it migrated from, or another copy of a partitioned
+        // plugin owns it), it costs nothing for this message
+        matched = false;
+        if (sample) {
+          mm_ns = 0;
+          p->pm_sample = true;
+        }
+      } else if (sample) {
+        unsigned long long start = hs_fine_time();
         matched = lsb_eval_message_matcher(p->mm, at->msg);
-        lsb_update_running_stats(&p->mms, lsb_get_time() - start);
+        mm_ns = (long long)(hs_fine_time() - start);
         p->pm_sample = true;
       } else {
         matched = lsb_eval_message_matcher(p->mm, at->msg);
       }
 
-      if (matched) {
-        p->im_limit = p->pm_im_limit;
-        ++p->pm_delta_cnt;
-        ret = lsb_heka_pm_analysis(p->hsb, at->msg, p->pm_sample);
-        p->pm_sample = false;
-        if (ret < 0) {
-          const char *err = lsb_heka_get_error(p->hsb);
-          if (strlen(err) > 0) {
-            hs_log(NULL, p->name, 4, "received: %d msg: %s", ret, err);
-          }
-        }
-      }
+      if (matched) ret = process_message(p, at->msg);
     } else {
-      if (sample) p->pm_sample = true;
+      p->pm_sample = true;
     }
 
-    if (ret <= 0 && p->ticker_interval && at->current_t >= p->ticker_expires) {
+    if (sample) write_stats(p, mm_ns);
+    if (ret > 0) terminate_sandbox(at, i);
+  }
+  fire_timers(at, sample);
+}
+
+
+/**
+ * Waits (bounded, the instances may be on other threads) until the other
+ * instances of a merged partitioned plugin have injected their final output
+ */
+static void wait_for_partitions(hs_analysis_plugin *p)
+{
+  hs_analysis_partitions *ap = p->partitions;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += HS_MERGE_WAIT;
+
+  pthread_mutex_lock(&ap->lock);
+  while (ap->finished < ap->cnt - 1) {
+    if (pthread_cond_timedwait(&ap->finished_cond, &ap->lock, &ts)
+        == ETIMEDOUT) {
+      hs_log(NULL, p->name, 3, "merging the final output of %u of %u "
+             "instances", ap->finished, ap->cnt - 1);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ap->lock);
+}
+
+
+/**
+ * Runs the final timer event of every plugin. The instances of a merged
+ * partitioned plugin inject into the partials first, instance 0 merges them
+ * before its own final timer event.
+ */
+static void shutdown_timer_event(hs_analysis_thread *at)
+{
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < at->list_cap; ++i) {
+      hs_analysis_plugin *p = at->list[i];
+      if (!p) continue;
+      bool merged = p->partitions && p->partitions->merge;
+      bool first = merged && p->partition == 0;
+      if (first != (pass == 1)) continue; // instance 0 goes last
+
+      int ret = 0;
+      if (first) {
+        wait_for_partitions(p);
+        ret = merge_partials(p);
+      } else if (merged) {
+        p->merging = true; // the output goes to the first copy
+      }
       p->im_limit = p->te_im_limit;
-      ret = lsb_heka_timer_event(p->hsb, at->current_t, false);
-      p->ticker_expires = at->current_t + p->ticker_interval;
+      if (ret <= 0) ret = lsb_heka_timer_event(p->hsb, at->current_t, true);
+      p->merging = false;
+      finish_partition(p);
+      if (ret) terminate_sandbox(at, i);
     }
+  }
+}
 
-    if (sample) p->stats = lsb_heka_get_stats(p->hsb);
-    if (ret > 0) terminate_sandbox(at, i);
+
+
+/**
+ * Records the plugin's new thread in its runtime configuration so a restart
+ * keeps the placement (the last assignment wins)
+ */
+static void save_thread(const hs_config *cfg, const hs_analysis_plugin *p,
+                        int tid)
+{
+  char fqfn[HS_MAX_PATH];
+  int ret = snprintf(fqfn, sizeof(fqfn), "%s/%s%s", cfg->output_path, p->name,
+                     hs_rtc_ext);
+  if (ret < 0 || ret > (int)sizeof(fqfn) - 1) {
+    hs_log(NULL, p->name, 3, "failed to construct the rtc path");
+    return;
   }
-  pthread_mutex_unlock(&at->list_lock);
+  FILE *fh = fopen(fqfn, "ae");
+  if (!fh) {
+    hs_log(NULL, p->name, 3, "failed to record the thread in %s errno: %d",
+           fqfn, errno);
+    return;
+  }
+  fprintf(fh, "\n-- migrated\nthread = %d\n", tid);
+  fclose(fh);
 }
 
 
-static void shutdown_timer_event(hs_analysis_thread *at)
+/**
+ * Feeds a plugin migrating from a thread that is behind this one the messages
+ * this thread has already passed. The plugin is in the list at idx, the
+ * thread's own processing is paused until it has caught up.
+ */
+static void catch_up_plugin(hs_analysis_thread *at, int idx)
 {
+  const hs_config *cfg = at->plugins->cfg;
+  int shards = cfg->input_shards;
+  hs_analysis_plugin *p = at->list[idx];
+  hs_checkpoint end[shards];
+  bool active[shards];
+  hs_input *input = calloc(shards, sizeof(hs_input));
+  if (!input) {
+    hs_log(NULL, g_module, 0, "catch up reader allocation failed");
+    exit(EXIT_FAILURE);
+  }
+
+  bool catching_up = false;
+  pthread_mutex_lock(&at->cp_lock);
+  memcpy(end, at->cp, sizeof(end));
+  pthread_mutex_unlock(&at->cp_lock);
+  for (int i = 0; i < shards; ++i) {
+    // where this thread is behind the duplicates are skipped in
+    // analyze_message instead
+    active[i] = !processed(&end[i], &p->skip_cp[i]);
+    // mapped so the short lived reader does not set up a readahead ring
+    hs_init_input(&input[i], cfg->max_message_size, cfg->output_path,
+                  at->input[i].subdir, at->input[i].name, true);
+    if (!active[i]) continue;
+    input[i].cp = p->skip_cp[i];
+    p->skip_cp[i].id = 0;
+    p->skip_cp[i].offset = 0;
+    catching_up = true;
+  }
+
+  long long cnt = 0;
+  int rr = 0;
+  int idle = 0;
+  time_t t = time(NULL);
+  while (catching_up && idle < 10) {
+    bool progress = false;
+    for (int i = 0; i < shards; ++i) {
+      if (!active[i]) continue;
+      switch (hs_poll_input(&input[i], cfg, at->plugins->cpr, t)) {
+      case HS_INPUT_MESSAGE:
+      case HS_INPUT_DATA:
+        progress = true;
+        break;
+      case HS_INPUT_RESET:
+        active[i] = false;
+        break;
+      default:
+        break;
+      }
+    }
+
+    hs_input *hsi = hs_select_input(input, shards, cfg->input_read_order, &rr);
+    if (hsi) {
+      int i = (int)(hsi - input);
+      hs_checkpoint cp;
+      hs_consume_input(hsi, &cp);
+      if (processed(&cp, &end[i])) {
+        if (at->list[idx] != p) break; // terminated
+        int ret = 0;
+        if (lsb_eval_message_matcher(p->mm, &hsi->msg)) {
+          ret = process_message(p, &hsi->msg);
+        }
+        if (ret > 0) terminate_sandbox(at, idx);
+        ++cnt;
+      }
+      if (!processed(&cp, &end[i])
+          || (cp.id == end[i].id && cp.offset == end[i].offset)) {
+        active[i] = false; // the thread delivers the rest
+      }
+      idle = 0;
+    } else if (!progress) {
+      ++idle;
+      ++t; // the data is already in the queue, do not wait for the file checks
+    }
+    catching_up = false;
+    for (int i = 0; i < shards; ++i) {
+      catching_up |= active[i];
+    }
+  }
+  if (catching_up) {
+    hs_log(NULL, p->name, 3, "catch up on thread %d stopped short of the "
+           "thread checkpoint", at->tid);
+  }
+  hs_log(NULL, p->name, 7, "caught up %lld messages on thread %d", cnt,
+         at->tid);
+  for (int i = 0; i < shards; ++i) {
+    hs_free_input(&input[i]);
+  }
+  free(input);
+}
+
+
+/**
+ * Hands the plugin selected by the rebalancing over to its new thread, on the
+ * source thread between two messages
+ */
+static void hand_off_plugin(hs_analysis_thread *at)
+{
+  if (!__atomic_load_n(&at->migrate, __ATOMIC_ACQUIRE)) return;
+
   pthread_mutex_lock(&at->list_lock);
-  for (int i = 0; i < at->list_cap; ++i) {
-    if (!at->list[i]) continue;
+  hs_analysis_plugin *p = at->migrate;
+  hs_analysis_thread *to = at->migrate_to;
+  int idx = -1;
+  for (int i = 0; p && i < at->list_cap; ++i) {
+    if (at->list[i] == p) {
+      idx = i;
+      break;
+    }
+  }
+  at->migrate = NULL;
+  if (idx == -1) {
+    pthread_mutex_unlock(&at->list_lock);
+    return;
+  }
+  hs_log(NULL, p->name, 6, "migrating from thread: %d to: %d", at->tid,
+         to->tid);
+  detach_plugin(at, idx);
+  pthread_mutex_unlock(&at->list_lock);
 
-    at->list[i]->im_limit = at->list[i]->te_im_limit;
-    if (lsb_heka_timer_event(at->list[i]->hsb, at->current_t, true)) {
-      terminate_sandbox(at, i);
+  // the plugin has processed everything up to this thread's checkpoints
+  int shards = at->plugins->cfg->input_shards;
+  if (!p->skip_cp) {
+    p->skip_cp = malloc(sizeof(hs_checkpoint) * shards);
+    if (!p->skip_cp) {
+      hs_log(NULL, g_module, 0, "skip_cp malloc failed");
+      exit(EXIT_FAILURE);
     }
   }
+  pthread_mutex_lock(&at->cp_lock);
+  memcpy(p->skip_cp, at->cp, sizeof(hs_checkpoint) * shards);
+  pthread_mutex_unlock(&at->cp_lock);
+
+  pthread_mutex_lock(&to->list_lock);
+  __atomic_store_n(&to->adopt, p, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&to->list_lock);
+  hs_notify_waiter(&to->waiter);
+}
+
+
+/**
+ * Resumes a plugin handed over by another thread at the position it stopped
+ */
+static void adopt_plugin(hs_analysis_thread *at)
+{
+  if (!__atomic_load_n(&at->adopt, __ATOMIC_ACQUIRE)) return;
+
+  pthread_mutex_lock(&at->list_lock);
+  hs_analysis_plugin *p = at->adopt;
+  at->adopt = NULL;
+  int idx = -1;
+  if (p) {
+    p->at = at;
+    idx = insert_plugin(at, p);
+  }
   pthread_mutex_unlock(&at->list_lock);
+  if (idx == -1) return;
+
+  save_thread(at->plugins->cfg, p, at->tid);
+  catch_up_plugin(at, idx);
 }
 
 
@@ -447,154 +1213,235 @@ static void* input_thread(void *arg)
   hs_analysis_thread *at = (hs_analysis_thread *)arg;
   hs_log(NULL, g_module, 6, "starting thread: %d", at->tid);
 
-  lsb_heka_message msg;
-  lsb_init_heka_message(&msg, 8);
+  lsb_heka_message idle;
+  lsb_init_heka_message(&idle, 8);
 
-  size_t discarded_bytes;
-  size_t bytes_read = 0;
-  lsb_logger logger = { .context = NULL, .cb = hs_log };
+  const hs_config *cfg = at->plugins->cfg;
+  int shards = cfg->input_shards;
+  hs_prefetch *pf = at->prefetch;
+  bool own_pf = pf && pf != at->plugins->prefetch;
+  if (own_pf) hs_start_prefetch(pf);
+  pthread_mutex_lock(&at->list_lock);
+  at->running = true; // the list changes are applied by this thread from now
+  pthread_mutex_unlock(&at->list_lock);
   bool stop = false;
   bool sample = false;
-  bool next = false;
 #ifdef HINDSIGHT_CLI
   long long cli_ns = 0;
   bool input_stop = false;
   while (!(stop && input_stop)) {
 #else
-  int iwait_cnt = 0;
   while (!stop) {
 #endif
     pthread_mutex_lock(&at->cp_lock);
     stop = at->stop;
     sample = at->sample;
     pthread_mutex_unlock(&at->cp_lock);
-
-    if (at->input.fh) {
-      if (lsb_find_heka_message(&msg, &at->input.ib, true, &discarded_bytes,
-                                &logger)) {
-        at->msg = &msg;
-#ifdef HINDSIGHT_CLI
-        if (at->msg->timestamp > cli_ns) {
-          cli_ns = at->msg->timestamp;
-          at->current_t = cli_ns / 1000000000LL;
-        }
-#else
-        at->current_t = time(NULL);
-#endif
-        analyze_message(at, sample);
-
-        // advance the checkpoint
+    apply_list_change(at);
+    hand_off_plugin(at);
+    adopt_plugin(at);
+
+    int seq = hs_waiter_seq(&at->waiter);
+    bool active = false;
+    time_t t = hs_coarse_time();
+    hs_checkpoint cp;
+    int shard = -1;
+    hs_prefetch_slot *slot = NULL;
+    if (pf) {
+      bool idle;
+      slot = hs_peek_prefetch(pf, at->consumer, &idle);
+      active = !idle;
+      if (slot && slot->reset) {
         pthread_mutex_lock(&at->cp_lock);
-        ++at->mm_delta_cnt;
-        at->cp.id = at->input.cp.id;
-        at->cp.offset = at->input.cp.offset -
-            (at->input.ib.readpos - at->input.ib.scanpos);
-        if (sample) at->sample = false;
+        at->cp[slot->shard] = slot->cp;
         pthread_mutex_unlock(&at->cp_lock);
-      } else {
-        bytes_read = hs_read_file(&at->input);
-#ifdef HINDSIGHT_CLI
-        next = false;
-        if (!bytes_read
-            && (at->input.cp.offset >= at->plugins->cfg->output_size)) {
-          next = hs_open_file(&at->input, hs_input_dir, at->input.cp.id + 1);
-        }
-        if (!bytes_read && !next && stop) {
-          input_stop = true;
-        }
-#else
-        // When the read gets to the end it will always check once for the next
-        // available file just incase the output_size was increased on the last
-        // restart.
-        if (!bytes_read && (at->input.cp.offset >= at->plugins->cfg->output_size
-                            || next)) {
-          next = hs_open_file(&at->input, hs_input_dir, at->input.cp.id + 1);
-          if (!next) {
-            if (++iwait_cnt > 60
-                || at->input.cp.offset < at->plugins->cfg->output_size) {
-              size_t next_id = hs_find_next_id(at->plugins->cfg->output_path,
-                                               hs_input_dir,
-                                               at->input.cp.id);
-              if (next_id > at->input.cp.id + 1) {
-                hs_log(NULL, g_module, 3,
-                       "tid: %d the input checkpoint skipped %zu missing files",
-                       at->tid, next_id - at->input.cp.id - 1);
-                next = hs_open_file(&at->input, hs_input_dir, next_id);
-                if (!next) {
-                  hs_log(NULL, g_module, 2,
-                         "unable to open input queue file: %zu", next_id);
-                }
-              }
-              iwait_cnt = 0;
-            }
-          }
+        hs_release_prefetch(pf, at->consumer);
+        continue;
+      }
+      if (slot && processed(&slot->cp, &at->cp[slot->shard])) {
+        // a shared reader starts at the slowest thread's checkpoint
+        hs_release_prefetch(pf, at->consumer);
+        continue;
+      }
+      if (slot) {
+        cp = slot->cp;
+        shard = slot->shard;
+        at->msg = &slot->msg;
+      }
+    } else {
+      for (int i = 0; i < shards; ++i) {
+        switch (hs_poll_input(&at->input[i], cfg, at->plugins->cpr, t)) {
+        case HS_INPUT_MESSAGE:
+        case HS_INPUT_DATA:
+          active = true;
+          break;
+        case HS_INPUT_RESET:
+          pthread_mutex_lock(&at->cp_lock);
+          at->cp[i] = at->input[i].cp;
+          pthread_mutex_unlock(&at->cp_lock);
+          break;
+        default:
+          break;
         }
-#endif
       }
-    } else { // still waiting on the first file
+
+      hs_input *hsi = hs_select_input(at->input, shards,
+                                      cfg->input_read_order, &at->rr);
+      if (hsi) {
+        hs_consume_input(hsi, &cp);
+        shard = (int)(hsi - at->input);
+        at->msg = &hsi->msg;
+      }
+    }
+
+    if (at->msg) {
 #ifdef HINDSIGHT_CLI
-      next = hs_open_file(&at->input, hs_input_dir, at->input.cp.id);
-      if (!next && stop) {
-        input_stop = true;
+      if (at->msg->timestamp > cli_ns) {
+        cli_ns = at->msg->timestamp;
+        at->current_t = cli_ns / 1000000000LL;
       }
 #else
-      if (++iwait_cnt > 60) { // the internal state is bad (manual prune?)
-        hs_lookup_input_checkpoint(at->plugins->cpr,
-                                   hs_input_dir,
-                                   NULL, // restart from the end
-                                   at->plugins->cfg->output_path,
-                                   &at->input.cp);
-        pthread_mutex_lock(&at->cp_lock);
-        at->cp.id = at->input.cp.id = at->input.cp.id;
-        at->cp.offset = at->input.cp.offset = at->input.cp.offset;
-        pthread_mutex_unlock(&at->cp_lock);
-        hs_log(NULL, g_module, 3, "tid: %d the input checkpoint was reset",
-               at->tid);
-        iwait_cnt = 0;
-      }
-      next = hs_open_file(&at->input, hs_input_dir, at->input.cp.id);
-      if (next) iwait_cnt = 0;
+      at->current_t = t;
 #endif
-    }
-
-    if (bytes_read || at->msg) {
+      analyze_message(at, sample, &cp, shard);
       at->msg = NULL;
-    } else {
+      if (slot) hs_release_prefetch(pf, at->consumer);
+
+      // advance the checkpoint
+      pthread_mutex_lock(&at->cp_lock);
+      ++at->mm_delta_cnt;
+      at->cp[shard] = cp;
+      if (sample) at->sample = false;
+      pthread_mutex_unlock(&at->cp_lock);
+    } else if (!active) {
+#ifdef HINDSIGHT_CLI
+      if (stop) input_stop = true;
+#endif
       // trigger any pending timer events
-      lsb_clear_heka_message(&msg); // create an idle/empty message
-      at->msg = &msg;
+      lsb_clear_heka_message(&idle); // create an idle/empty message
+      at->msg = &idle;
 #ifdef HINDSIGHT_CLI
       at->current_t = cli_ns / 1000000000LL;
 #else
-      at->current_t = time(NULL);
+      at->current_t = hs_coarse_time();
 #endif
-      analyze_message(at, sample);
+      analyze_message(at, sample, NULL, -1);
       if (sample) {
         pthread_mutex_lock(&at->cp_lock);
         at->sample = false;
         pthread_mutex_unlock(&at->cp_lock);
       }
       at->msg = NULL;
-      sleep(1);
+      // until new input arrives or the next timer tick
+      hs_wait(&at->waiter, seq, hs_coarse_time() + 1);
+    } else if (pf) {
+      hs_wait(&at->waiter, seq, hs_coarse_time() + 1); // the next slot is in progress
     }
   }
+  if (own_pf) hs_stop_prefetch(pf);
+  adopt_plugin(at); // handed over while stopping
+  pthread_mutex_lock(&at->list_lock);
+  if (at->list_change) change_list(at);
+  pthread_mutex_unlock(&at->list_lock);
   shutdown_timer_event(at);
-  lsb_free_heka_message(&msg);
+  pthread_mutex_lock(&at->list_lock);
+  if (at->list_change) change_list(at);
+  at->running = false;
+  pthread_mutex_unlock(&at->list_lock);
+  lsb_free_heka_message(&idle);
   hs_log(NULL, g_module, 6, "exiting thread: %d", at->tid);
   pthread_exit(NULL);
 }
 
 
+/**
+ * One reader and decoder for all the analysis threads, each thread consumes
+ * every slot of the shared ring with its own cursor
+ */
+static void init_shared_reader(hs_analysis_plugins *plugins)
+{
+  const hs_config *cfg = plugins->cfg;
+  int shards = cfg->input_shards;
+  plugins->reader = calloc(shards, sizeof(hs_input));
+  plugins->prefetch = malloc(sizeof(hs_prefetch));
+  hs_waiter **waiters = malloc(sizeof(hs_waiter *) * plugins->thread_cnt);
+  if (!plugins->reader || !plugins->prefetch || !waiters) {
+    hs_log(NULL, g_module, 0, "shared reader memory allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < shards; ++i) {
+    char subdir[HS_MAX_PATH];
+    if (hs_get_shard_dir(i, shards, subdir, sizeof(subdir))) {
+      hs_log(NULL, g_module, 0, "input queue shard name too long");
+      exit(EXIT_FAILURE);
+    }
+    hs_init_input(&plugins->reader[i], cfg->max_message_size,
+                  cfg->output_path, subdir, hs_analysis_dir,
+                  cfg->iqc.mmap_readers);
+  }
+  for (int i = 0; i < plugins->thread_cnt; ++i) {
+    waiters[i] = &plugins->list[i].waiter;
+    plugins->list[i].prefetch = plugins->prefetch;
+  }
+  hs_init_prefetch(plugins->prefetch,
+                   cfg->analysis_prefetch ? cfg->analysis_prefetch
+                   : HS_PREFETCH_SIZE, plugins->reader, shards, cfg,
+                   plugins->cpr, waiters, plugins->thread_cnt);
+  free(waiters);
+  for (int i = 0; i < shards; ++i) {
+    hs_add_output_waiter(&plugins->input[i], &plugins->prefetch->waiter);
+  }
+}
+
+
+static void free_shared_reader(hs_analysis_plugins *plugins)
+{
+  if (!plugins->prefetch) return;
+
+  for (int i = 0; i < plugins->cfg->input_shards; ++i) {
+    hs_remove_output_waiter(&plugins->input[i], &plugins->prefetch->waiter);
+  }
+  hs_free_prefetch(plugins->prefetch);
+  free(plugins->prefetch);
+  plugins->prefetch = NULL;
+  for (int i = 0; i < plugins->cfg->input_shards; ++i) {
+    hs_free_input(&plugins->reader[i]);
+  }
+  free(plugins->reader);
+  plugins->reader = NULL;
+}
+
+
+void hs_read_analysis_stats(hs_analysis_plugin *p, lsb_heka_stats *stats,
+                            lsb_running_stats *mms)
+{
+  unsigned seq;
+  do {
+    seq = __atomic_load_n(&p->stats_seq, __ATOMIC_ACQUIRE);
+    *stats = p->stats;
+    *mms = p->mms;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1)
+           || seq != __atomic_load_n(&p->stats_seq, __ATOMIC_RELAXED));
+}
+
+
 void hs_init_analysis_plugins(hs_analysis_plugins *plugins,
                               hs_config *cfg,
-                              hs_checkpoint_reader *cpr)
+                              hs_checkpoint_reader *cpr,
+                              hs_output *input)
 
 {
-  hs_init_output(&plugins->output, cfg->output_path, hs_analysis_dir);
+  hs_init_output(&plugins->output, cfg, &cfg->aqc, hs_analysis_dir);
+  hs_start_output_writer(&plugins->output);
 
   plugins->thread_cnt = cfg->analysis_threads;
   plugins->cfg = cfg;
   plugins->cpr = cpr;
+  plugins->input = input;
+  plugins->reader = NULL;
+  plugins->prefetch = NULL;
+  plugins->rebalance_wait = HS_REBALANCE_WAIT; // let the measures settle
 
 #ifdef HINDSIGHT_CLI
   plugins->terminated = false;
@@ -608,6 +1455,7 @@ void hs_init_analysis_plugins(hs_analysis_plugins *plugins,
   for (unsigned i = 0; i < cfg->analysis_threads; ++i) {
     init_analysis_thread(plugins, i);
   }
+  if (cfg->analysis_shared_reader) init_shared_reader(plugins);
   plugins->threads = calloc(cfg->analysis_threads, sizeof(pthread_t *));
   if (!plugins->threads) {
     hs_log(NULL, g_module, 0, "plugins->threads malloc failed");
@@ -623,6 +1471,7 @@ void hs_stop_analysis_plugins(hs_analysis_plugins *plugins)
     pthread_mutex_lock(&at->cp_lock);
     at->stop = true;
     pthread_mutex_unlock(&at->cp_lock);
+    hs_notify_waiter(&at->waiter);
   }
 }
 
@@ -640,6 +1489,7 @@ void hs_wait_analysis_plugins(hs_analysis_plugins *plugins)
     }
 #endif
   }
+  if (plugins->prefetch) hs_stop_prefetch(plugins->prefetch);
   free(plugins->threads);
   plugins->threads = NULL;
 }
@@ -652,6 +1502,7 @@ void hs_free_analysis_plugins(hs_analysis_plugins *plugins)
   }
   free(plugins->list);
   plugins->list = NULL;
+  free_shared_reader(plugins);
 
   hs_free_output(&plugins->output);
 
@@ -825,6 +1676,7 @@ void hs_load_analysis_startup(hs_analysis_plugins *plugins)
   while ((entry = readdir(dp))) {
     hs_sandbox_config sbc;
     if (hs_load_sandbox_config(dir, entry->d_name, &sbc, &cfg->apd, 'a')) {
+      bool pinned = sbc.thread != UINT_MAX;
       if (sbc.thread == UINT_MAX) {
         sbc.thread = get_previous_tid(cfg->output_path, entry->d_name);
         if (sbc.thread == UINT_MAX) {
@@ -842,10 +1694,7 @@ void hs_load_analysis_startup(hs_analysis_plugins *plugins)
           ++plugins_per_thread[sbc.thread % threads];
         }
       }
-      hs_analysis_plugin *p = create_analysis_plugin(cfg, &sbc);
-      if (p) {
-        add_to_analysis_plugins(&sbc, plugins, p);
-      } else {
+      if (!load_analysis_plugin(plugins, &sbc, pinned)) {
 #ifdef HINDSIGHT_CLI
         plugins->terminated = true;
 #endif
@@ -971,26 +1820,26 @@ void hs_load_analysis_dynamic(hs_analysis_plugins *plugins, const char *name)
     }
     return;
   }
-  int tidx = tid % plugins->thread_cnt;
-
   switch (hs_process_load_cfg(lpath, rpath, name)) {
   case 0: // remove
-    remove_from_analysis_plugins(&plugins->list[tidx], name);
+    for (int i = 0; i < plugins->thread_cnt; ++i) { // partitioned copies
+      remove_from_analysis_plugins(&plugins->list[i], name);
+    }
     break;
   case 1: // load
     {
       if (!dynamic) {
-        remove_from_analysis_plugins(&plugins->list[tidx], name);
+        for (int i = 0; i < plugins->thread_cnt; ++i) {
+          remove_from_analysis_plugins(&plugins->list[i], name);
+        }
       }
       hs_sandbox_config sbc;
       if (hs_load_sandbox_config(rpath, name, &sbc, &cfg->apd, 'a')) {
+        bool pinned = sbc.thread != UINT_MAX;
         if (sbc.thread == UINT_MAX) {
           sbc.thread = tid;
         }
-        hs_analysis_plugin *p = create_analysis_plugin(cfg, &sbc);
-        if (p) {
-          add_to_analysis_plugins(&sbc, plugins, p);
-        } else {
+        if (!load_analysis_plugin(plugins, &sbc, pinned)) {
 #ifdef HINDSIGHT_CLI
           plugins->terminated = true;
 #endif
@@ -1012,17 +1861,81 @@ void hs_start_analysis_threads(hs_analysis_plugins *plugins)
 {
   for (int i = 0; i < plugins->thread_cnt; ++i) {
     hs_analysis_thread *at = &plugins->list[i];
-    hs_lookup_input_checkpoint(at->plugins->cpr,
-                               hs_input_dir,
-                               at->input.name,
-                               at->plugins->cfg->output_path,
-                               &at->input.cp);
-    at->cp.id = at->input.cp.id;
-    at->cp.offset = at->input.cp.offset;
+    for (int j = 0; j < plugins->cfg->input_shards; ++j) {
+      hs_lookup_input_checkpoint(plugins->cpr,
+                                 at->input[j].subdir,
+                                 at->input[j].name,
+                                 plugins->cfg->output_path,
+                                 &at->input[j].cp);
+      at->cp[j] = at->input[j].cp;
+      // the shared reader starts at the slowest thread
+      if (plugins->reader && (i == 0 || processed(&at->cp[j],
+                                                  &plugins->reader[j].cp))) {
+        plugins->reader[j].cp = at->cp[j];
+      }
+    }
+  }
+  if (plugins->prefetch) hs_start_prefetch(plugins->prefetch);
+
+  for (int i = 0; i < plugins->thread_cnt; ++i) {
     if (pthread_create(&plugins->threads[i], NULL, input_thread,
-                       (void *)at)) {
+                       (void *)&plugins->list[i])) {
       perror("hs_start_analysis_threads pthread_create failed");
       exit(EXIT_FAILURE);
     }
   }
 }
+
+
+void hs_rebalance_analysis_plugins(hs_analysis_plugins *plugins)
+{
+  uint8_t threshold = plugins->cfg->analysis_rebalance;
+  if (!threshold || plugins->thread_cnt < 2) return;
+  if (plugins->rebalance_wait > 0) {
+    --plugins->rebalance_wait;
+    return;
+  }
+
+  hs_analysis_thread *hot = NULL;
+  hs_analysis_thread *cold = NULL;
+  for (int i = 0; i < plugins->thread_cnt; ++i) {
+    hs_analysis_thread *at = &plugins->list[i];
+    pthread_mutex_lock(&at->list_lock);
+    bool busy = at->migrate || at->adopt;
+    uint8_t util = at->utilization;
+    pthread_mutex_unlock(&at->list_lock);
+    if (busy) return; // one migration at a time
+
+    if (!hot || util > hot->utilization) hot = at;
+    if (!cold || util < cold->utilization) cold = at;
+  }
+  int gap = hot->utilization - cold->utilization;
+  if (gap < threshold) return;
+
+  // move the plugin that brings the two threads closest to even, it must be
+  // smaller than the gap or the imbalance is only reversed
+  hs_analysis_plugin *p = NULL;
+  int best = gap;
+  pthread_mutex_lock(&hot->list_lock);
+  for (int i = 0; hot->list_cnt > 1 && i < hot->list_cap; ++i) {
+    hs_analysis_plugin *c = hot->list[i];
+    if (!c || c->pinned) continue;
+
+    int util = c->utilization * hot->utilization / 100;
+    if (util == 0 || util >= gap) continue;
+    int diff = abs(gap - 2 * util);
+    if (diff < best) {
+      best = diff;
+      p = c;
+    }
+  }
+  if (p) {
+    hs_log(NULL, p->name, 6, "rebalancing from thread: %d (%d%%) to: %d (%d%%)",
+           hot->tid, hot->utilization, cold->tid, cold->utilization);
+    hot->migrate_to = cold;
+    __atomic_store_n(&hot->migrate, p, __ATOMIC_RELEASE);
+    plugins->rebalance_wait = HS_REBALANCE_WAIT;
+  }
+  pthread_mutex_unlock(&hot->list_lock);
+  if (p) hs_notify_waiter(&hot->waiter);
+}
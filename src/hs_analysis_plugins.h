@@ -20,28 +20,67 @@
 #include <time.h>
 
 #include "hs_config.h"
+#include "hs_dispatch.h"
 #include "hs_input.h"
 #include "hs_logger.h"
 #include "hs_output.h"
+#include "hs_prefetch.h"
+#include "hs_ring.h"
+#include "hs_timers.h"
 
+#define HS_REBALANCE_WAIT 10 // stats intervals between two migrations
+#define HS_MERGE_WAIT 5 // seconds instance 0 waits for the final partials
+
+typedef struct hs_analysis_partitions hs_analysis_partitions;
 typedef struct hs_analysis_plugin hs_analysis_plugin;
 typedef struct hs_analysis_plugins hs_analysis_plugins;
 typedef struct hs_analysis_thread hs_analysis_thread;
 
+// State shared by the instances of a hash partitioned plugin
+struct hs_analysis_partitions {
+  pthread_mutex_t   lock;         // partials, finished and orphaned
+  pthread_cond_t    finished_cond;
+  char              **partials;   // injected by the other instances' timer
+                                  // events, merged by instance 0
+  size_t            *partials_len;
+  int               partials_cnt;
+  int               partials_cap;
+  lsb_heka_message  msg;          // partial being merged (instance 0 thread)
+  lsb_const_string  field;        // key field name when header is 'F'
+  char              header;       // key header (see partition_hash)
+  unsigned          cnt;          // number of instances
+  unsigned          finished;     // other instances past their final timer
+                                  // event (or gone)
+  int               refs;
+  bool              merge;
+  bool              orphaned;     // instance 0 is gone, partials are dropped
+};
+
 struct hs_analysis_plugin {
   char                *name;
   lsb_heka_sandbox    *hsb;
   lsb_message_matcher *mm;
+  hs_dispatch_keys    keys; // equalities the matcher requires (dispatch index)
   hs_analysis_thread  *at;
+  hs_checkpoint       *skip_cp; // per shard, already processed before migrating
+                                // (NULL if it never migrated)
+  hs_analysis_partitions *partitions; // NULL unless parallelism > 1
+  unsigned            partition;   // instance number
   lsb_running_stats   mms;
   lsb_heka_stats      stats;
+  unsigned            stats_seq;   // odd while mms/stats are being written
   int                 ticker_interval;
-  int                 pm_delta_cnt;
+  int                 pm_delta_cnt; // atomic, reset by the stats pass
   bool                shutdown_terminate;
   bool                pm_sample;
+  bool                pinned;      // thread set in the cfg, never migrated
+  bool                merging;     // timer event output goes to instance 0
+  bool                finished;    // counted in partitions->finished
+  uint8_t             utilization; // share of the thread's time (percent)
   unsigned            im_limit;
   unsigned            pm_im_limit;
   unsigned            te_im_limit;
+  unsigned            bp_weight;
   time_t              ticker_expires;
   hs_log_context      ctx;
 };
@@ -53,6 +92,10 @@ struct hs_analysis_plugins {
   hs_checkpoint_reader  *cpr;
   int                   thread_cnt;
   hs_output             output;
+  hs_output             *input; // input queue shards
+  hs_input              *reader;   // shared reader, one per shard (or NULL)
+  hs_prefetch           *prefetch; // shared decode stage (or NULL)
+  int                   rebalance_wait; // stats intervals until the next move
 #ifdef HINDSIGHT_CLI
   bool      terminated;
 #endif
@@ -63,12 +106,28 @@ struct hs_analysis_thread {
   hs_analysis_plugin  **list;
   lsb_heka_message    *msg;
 
-  pthread_mutex_t list_lock;
+  pthread_mutex_t list_lock; // held by the thread while it changes the list and
+                             // by the other threads reading it
+  pthread_cond_t  list_cond; // signaled when a list change has been applied
   pthread_mutex_t cp_lock;
-  hs_checkpoint   cp;
+  hs_checkpoint   *cp; // one per input queue shard
   time_t          current_t;
 
-  hs_input  input;
+  hs_input  *input;    // one per input queue shard
+  hs_ring   ring;
+  hs_dispatch dispatch; // plugin list slots by matcher keys
+  hs_timers timers;    // plugin list slots by ticker_expires
+  hs_waiter waiter;    // woken by the input queue writers (or the prefetch)
+  hs_prefetch *prefetch; // decode-ahead stage, own or shared (or NULL)
+  hs_analysis_plugin *migrate;    // to hand off between two messages
+  hs_analysis_thread *migrate_to;
+  hs_analysis_plugin *adopt;      // handed off by another thread
+  hs_analysis_plugin *load;       // list change requested by the loader
+  const char         *unload;
+  bool      list_change; // load/unload pending
+  bool      running;     // the thread owns the list (applies the changes)
+  int       consumer;  // cursor in the prefetch ring
+  int       rr;        // round robin input shard
   int       list_cap;
   int       list_cnt;
   int       tid;
@@ -82,9 +141,21 @@ struct hs_analysis_thread {
 #endif
 };
 
+/**
+ * Reads a consistent copy of the plugin statistics without blocking its
+ * analysis thread
+ *
+ * @param p Analysis plugin
+ * @param stats Sandbox statistics
+ * @param mms Message matcher statistics
+ */
+void hs_read_analysis_stats(hs_analysis_plugin *p, lsb_heka_stats *stats,
+                            lsb_running_stats *mms);
+
 void hs_init_analysis_plugins(hs_analysis_plugins *plugins,
                               hs_config *cfg,
-                              hs_checkpoint_reader *cpr);
+                              hs_checkpoint_reader *cpr,
+                              hs_output *input);
 
 void hs_free_analysis_plugins(hs_analysis_plugins *plugins);
 
@@ -100,4 +171,12 @@ void hs_stop_analysis_plugins(hs_analysis_plugins *plugins);
 
 void hs_wait_analysis_plugins(hs_analysis_plugins *plugins);
 
+/**
+ * Moves a plugin from the most to the least utilized thread when they are
+ * analysis_rebalance points apart, called after each utilization update
+ *
+ * @param plugins Analysis plugins
+ */
+void hs_rebalance_analysis_plugins(hs_analysis_plugins *plugins);
+
 #endif
@@ -0,0 +1,287 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight queue file catalog implementation @file */
+
+#include "hs_catalog.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "hs_logger.h"
+#include "hs_util.h"
+
+typedef struct hs_catalog_queue
+{
+  struct hs_catalog_queue *next;
+  char                    *dir;
+  int                     wd;   // -1 while the directory is not watched
+  bool                    failed; // the last watch attempt failed (logged)
+  unsigned long long      *ids; // sorted, the valid ids start at off
+  size_t                  off;  // pruning removes from the front
+  size_t                  cnt;
+  size_t                  cap;
+} hs_catalog_queue;
+
+static const char g_module[] = "catalog";
+
+static pthread_mutex_t g_lock;
+static int g_fd = -1;
+static hs_catalog_queue *g_queues;
+
+
+static int cmp_id(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+
+static size_t lower_bound(const hs_catalog_queue *q, unsigned long long id)
+{
+  const unsigned long long *ids = q->ids + q->off;
+  size_t lo = 0, hi = q->cnt;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ids[mid] < id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+
+static void make_room(hs_catalog_queue *q)
+{
+  if (q->off + q->cnt < q->cap) return;
+
+  if (q->off) {
+    memmove(q->ids, q->ids + q->off, sizeof(*q->ids) * q->cnt);
+    q->off = 0;
+    return;
+  }
+  size_t n = q->cap ? q->cap * 2 : 64;
+  unsigned long long *tmp = realloc(q->ids, sizeof(*q->ids) * n);
+  if (!tmp) {
+    hs_log(NULL, g_module, 0, "ids realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  q->ids = tmp;
+  q->cap = n;
+}
+
+
+static void insert_id(hs_catalog_queue *q, unsigned long long id)
+{
+  size_t i = lower_bound(q, id);
+  if (i < q->cnt && q->ids[q->off + i] == id) return;
+
+  make_room(q);
+  unsigned long long *ids = q->ids + q->off;
+  memmove(ids + i + 1, ids + i, sizeof(*ids) * (q->cnt - i));
+  ids[i] = id;
+  ++q->cnt;
+}
+
+
+static void remove_id(hs_catalog_queue *q, unsigned long long id)
+{
+  size_t i = lower_bound(q, id);
+  if (i == q->cnt || q->ids[q->off + i] != id) return;
+
+  if (i == 0) {
+    ++q->off;
+  } else {
+    unsigned long long *ids = q->ids + q->off;
+    memmove(ids + i, ids + i + 1, sizeof(*ids) * (q->cnt - i - 1));
+  }
+  if (--q->cnt == 0) q->off = 0;
+}
+
+
+static bool scan_queue(hs_catalog_queue *q)
+{
+  q->off = 0;
+  q->cnt = 0;
+  DIR *dp = opendir(q->dir);
+  if (!dp) return false;
+
+  unsigned long long id;
+  struct dirent *entry;
+  while ((entry = readdir(dp))) {
+    if (!hs_extract_id(entry->d_name, &id)) continue;
+    make_room(q);
+    q->ids[q->cnt++] = id;
+  }
+  closedir(dp);
+  qsort(q->ids, q->cnt, sizeof(*q->ids), cmp_id);
+  return true;
+}
+
+
+static void unwatch_queue(hs_catalog_queue *q)
+{
+  if (q->wd == -1) return;
+  inotify_rm_watch(g_fd, q->wd);
+  q->wd = -1;
+  hs_log(NULL, g_module, 3, "%s is no longer cataloged", q->dir);
+}
+
+
+/**
+ * Starts watching a queue directory, retried on every lookup until it succeeds
+ * (the directory may not exist yet or may have been removed and recreated)
+ */
+static void watch_queue(hs_catalog_queue *q)
+{
+  // watch before the scan so no change can fall in between (an id seen twice
+  // is only inserted once)
+  q->wd = inotify_add_watch(g_fd, q->dir, IN_CREATE | IN_MOVED_TO | IN_DELETE
+                            | IN_MOVED_FROM | IN_ONLYDIR);
+  if (q->wd == -1) {
+    if (!q->failed) {
+      hs_log(NULL, g_module, 4, "%s cannot be watched (%s), it will be "
+             "scanned until it can", q->dir, strerror(errno));
+      q->failed = true;
+    }
+    return;
+  }
+  if (!scan_queue(q)) {
+    unwatch_queue(q);
+    return;
+  }
+  q->failed = false;
+  hs_log(NULL, g_module, 7, "%s cataloged %zu files", q->dir, q->cnt);
+}
+
+
+static void read_events(void)
+{
+  const struct inotify_event *event;
+  char buf[sizeof(struct inotify_event) + FILENAME_MAX + 1]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  for (;;) {
+    ssize_t len = read(g_fd, buf, sizeof(buf));
+    if (len == -1 && errno == EINTR) continue;
+    if (len <= 0) break; // EAGAIN, nothing has changed
+
+    for (char *ptr = buf; ptr < buf + len;
+         ptr += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event *)ptr;
+      if (event->mask & IN_Q_OVERFLOW) {
+        hs_log(NULL, g_module, 4, "inotify queue overflow, rescanning");
+        for (hs_catalog_queue *q = g_queues; q; q = q->next) {
+          if (q->wd != -1 && !scan_queue(q)) unwatch_queue(q);
+        }
+        continue;
+      }
+
+      hs_catalog_queue *q = g_queues;
+      for (; q && q->wd != event->wd; q = q->next);
+      if (!q) continue;
+
+      unsigned long long id;
+      if (event->mask & IN_IGNORED) { // the directory was removed
+        q->wd = -1; // watched again by the next lookup once it is recreated
+        hs_log(NULL, g_module, 3, "%s is no longer cataloged", q->dir);
+      } else if (event->len && hs_extract_id(event->name, &id)) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          insert_id(q, id);
+        } else {
+          remove_id(q, id);
+        }
+      }
+    }
+  }
+}
+
+
+static hs_catalog_queue* find_queue(const char *dir)
+{
+  hs_catalog_queue *q = g_queues;
+  for (; q && strcmp(q->dir, dir) != 0; q = q->next);
+  if (q) {
+    if (q->wd == -1) watch_queue(q);
+    return q;
+  }
+
+  q = calloc(1, sizeof(hs_catalog_queue));
+  if (!q || !(q->dir = malloc(strlen(dir) + 1))) {
+    hs_log(NULL, g_module, 0, "queue allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(q->dir, dir);
+  watch_queue(q);
+  q->next = g_queues;
+  g_queues = q;
+  return q;
+}
+
+
+void hs_init_catalog(void)
+{
+  g_queues = NULL;
+  g_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (g_fd == -1) {
+    hs_log(NULL, g_module, 3, "inotify_init failed, the queue directories will"
+           " be scanned");
+    return;
+  }
+  if (pthread_mutex_init(&g_lock, NULL)) {
+    perror("catalog pthread_mutex_init failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+void hs_free_catalog(void)
+{
+  if (g_fd == -1) return;
+
+  while (g_queues) {
+    hs_catalog_queue *q = g_queues;
+    g_queues = q->next;
+    free(q->ids);
+    free(q->dir);
+    free(q);
+  }
+  close(g_fd);
+  g_fd = -1;
+  pthread_mutex_destroy(&g_lock);
+}
+
+
+bool hs_lookup_catalog(const char *dir, unsigned long long id,
+                       hs_catalog_ids *ids)
+{
+  if (g_fd == -1) return false;
+
+  pthread_mutex_lock(&g_lock);
+  read_events();
+  hs_catalog_queue *q = find_queue(dir);
+  bool cataloged = q->wd != -1;
+  if (cataloged) {
+    const unsigned long long *p = q->ids + q->off;
+    ids->cnt = q->cnt;
+    ids->first = q->cnt ? p[0] : 0;
+    ids->last = q->cnt ? p[q->cnt - 1] : 0;
+    size_t i = lower_bound(q, id);
+    if (i < q->cnt && p[i] == id) ++i;
+    ids->next = i < q->cnt ? p[i] : 0;
+  }
+  pthread_mutex_unlock(&g_lock);
+  return cataloged;
+}
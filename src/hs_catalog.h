@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Hindsight queue file catalog shared by all readers @file */
+
+#ifndef hs_catalog_h_
+#define hs_catalog_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct hs_catalog_ids
+{
+  size_t             cnt;   // number of queue files
+  unsigned long long first; // lowest id (0 if there are no files)
+  unsigned long long last;  // highest id (0 if there are no files)
+  unsigned long long next;  // lowest id greater than the one requested (0 if
+                            // there is none)
+} hs_catalog_ids;
+
+/**
+ * Initializes the process wide catalog, the queue directories are added as
+ * they are looked up and kept current with inotify
+ *
+ */
+void hs_init_catalog(void);
+
+/**
+ * Frees the catalog
+ *
+ */
+void hs_free_catalog(void);
+
+/**
+ * Looks up the queue file ids of a directory
+ *
+ * @param dir Fully qualified queue directory
+ * @param id Reference id for the next lookup
+ * @param ids Result
+ *
+ * @return bool False if the directory is not cataloged (the catalog was not
+ *         initialized or the directory cannot be watched), the caller scans
+ *         the directory itself
+ */
+bool hs_lookup_catalog(const char *dir, unsigned long long id,
+                       hs_catalog_ids *ids);
+
+#endif
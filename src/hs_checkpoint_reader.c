@@ -8,7 +8,6 @@
 
 #include "hs_checkpoint_reader.h"
 
-#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -17,6 +16,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "hs_catalog.h"
 #include "hs_config.h"
 #include "hs_logger.h"
 #include "hs_util.h"
@@ -24,21 +24,11 @@
 
 static const char g_module[] = "checkpoint_reader";
 
-static bool extract_id(const char *fn, unsigned long long *id)
-{
-  size_t l = strlen(fn);
-  size_t i = 0;
-  for (; i < l && isdigit(fn[i]); ++i);
-  if (i > 0 && i + 4 == l && strncmp(fn + i, ".log", 4) == 0) {
-    *id = strtoull(fn, NULL, 10);
-    return true;
-  }
-  return false;
-}
-
-
 static size_t find_first_id(const char *path)
 {
+  hs_catalog_ids ids;
+  if (hs_lookup_catalog(path, 0, &ids)) return ids.first;
+
   struct dirent *entry;
   errno = 0;
   DIR *dp = opendir(path);
@@ -50,7 +40,7 @@ static size_t find_first_id(const char *path)
 
   unsigned long long file_id = ULLONG_MAX, current_id = 0;
   while ((entry = readdir(dp))) {
-    if (extract_id(entry->d_name, &current_id)) {
+    if (hs_extract_id(entry->d_name, &current_id)) {
       if (current_id < file_id) {
         file_id = current_id;
       }
@@ -79,6 +69,9 @@ size_t hs_find_next_id(const char *path, const char *subdir, size_t start_id)
     exit(EXIT_FAILURE);
   }
 
+  hs_catalog_ids ids;
+  if (hs_lookup_catalog(fqfn, start_id, &ids)) return ids.next;
+
   struct dirent *entry;
   errno = 0;
   DIR *dp = opendir(fqfn);
@@ -89,7 +82,7 @@ size_t hs_find_next_id(const char *path, const char *subdir, size_t start_id)
 
   unsigned long long file_id = ULLONG_MAX, current_id = 0;
   while ((entry = readdir(dp))) {
-    if (extract_id(entry->d_name, &current_id)) {
+    if (hs_extract_id(entry->d_name, &current_id)) {
       if (current_id > start_id && current_id < file_id) {
         file_id = current_id;
       }
@@ -230,7 +223,7 @@ void hs_update_checkpoint(hs_checkpoint_reader *cpr,
 }
 
 
-void hs_lookup_input_checkpoint(hs_checkpoint_reader *cpr,
+bool hs_lookup_input_checkpoint(hs_checkpoint_reader *cpr,
                                 const char *subdir,
                                 const char *key,
                                 const char *path,
@@ -272,6 +265,7 @@ void hs_lookup_input_checkpoint(hs_checkpoint_reader *cpr,
       }
     }
   }
+  return pos != NULL;
 }
 
 
@@ -338,8 +332,11 @@ void hs_remove_checkpoint(hs_checkpoint_reader *cpr,
 
 void hs_cleanup_checkpoints(hs_checkpoint_reader *cpr,
                             const char *run_path,
-                            uint8_t analysis_threads)
+                            uint8_t analysis_threads,
+                            uint8_t input_shards)
 {
+  size_t dlen = strlen(hs_input_dir);
+  unsigned shard;
   const char *key;
   const char *subkey;
   uint8_t analysis_thread;
@@ -354,6 +351,22 @@ void hs_cleanup_checkpoints(hs_checkpoint_reader *cpr,
       key = lua_tostring(cpr->values, -2);
       subkey = strstr(key, "->");
       subkey = subkey ? subkey + strlen("->") : key;
+      if (strncmp(key, hs_input_dir, dlen) == 0 && key[dlen] == '/') {
+        if (input_shards == 1
+            || sscanf(key + dlen + 1, "%u", &shard) != 1
+            || shard >= input_shards) {
+          // input queue shard does not exist anymore
+          remove_checkpoint(cpr, key);
+          lua_pop(cpr->values, 1);
+          continue;
+        }
+      } else if (input_shards > 1 && strncmp(key, hs_input_dir, dlen) == 0
+                 && (key[dlen] == 0 || key[dlen] == '-')) {
+        // the unsharded input queue is no longer read
+        remove_checkpoint(cpr, key);
+        lua_pop(cpr->values, 1);
+        continue;
+      }
       if (sscanf(subkey, "analysis%" SCNu8, &analysis_thread) == 1) {
         if (analysis_thread >= analysis_threads) {
           // analysis thread does not exist anymore
@@ -41,7 +41,7 @@ typedef struct hs_checkpoint {
 
 typedef struct hs_checkpoint_pair
 {
-  hs_checkpoint input;
+  hs_checkpoint *input; // one per input queue shard
   hs_checkpoint analysis;
 } hs_checkpoint_pair;
 
@@ -67,7 +67,7 @@ void hs_update_checkpoint(hs_checkpoint_reader *cpr,
                           const char *key,
                           hs_ip_checkpoint *cp);
 
-void hs_lookup_input_checkpoint(hs_checkpoint_reader *cpr,
+bool hs_lookup_input_checkpoint(hs_checkpoint_reader *cpr,
                                 const char *subdir,
                                 const char *key,
                                 const char *path,
@@ -83,8 +83,18 @@ int hs_output_checkpoints(hs_checkpoint_reader *cpr, FILE *fh);
 void hs_remove_checkpoint(hs_checkpoint_reader *cpr,
                           const char *key);
 
+/**
+ * Removes the checkpoints of analysis threads, plugins and input queue shards
+ * that no longer exist
+ *
+ * @param cpr Checkpoint reader
+ * @param run_path Sandbox run path
+ * @param analysis_threads Number of analysis threads
+ * @param input_shards Number of input queue shards
+ */
 void hs_cleanup_checkpoints(hs_checkpoint_reader *cpr,
                             const char *run_path,
-                            uint8_t analysis_threads);
+                            uint8_t analysis_threads,
+                            uint8_t input_shards);
 
 #endif
@@ -12,6 +12,7 @@
 #include <luasandbox/lauxlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "hs_analysis_plugins.h"
 #include "hs_input_plugins.h"
@@ -26,8 +27,9 @@ static const int  sample_sec = 6; // sample measurements 10 times a minute
 struct checkpoint_info {
   FILE *ptsv;
   FILE *utsv;
-  unsigned long long  min_input_id;
-  unsigned long long  min_analysis_id;
+  FILE *qtsv;
+  hs_checkpoint       min_input[HS_MAX_INPUT_SHARDS]; // slowest readers
+  hs_checkpoint       min_analysis;
   hs_checkpoint       cp;
   int                 input_delta_cnt;
   int                 sample_cnt;
@@ -64,10 +66,17 @@ void hs_init_checkpoint_writer(hs_checkpoint_writer *cpw,
   cpw->output_plugins = op;
   allocate_filename(path, "hindsight.cp", &cpw->cp_path);
   allocate_filename(path, "hindsight.cp.tmp", &cpw->cp_path_tmp);
+  allocate_filename(path, "hindsight.cp.pending", &cpw->cp_path_pending);
   allocate_filename(path, "utilization.tsv", &cpw->utsv_path);
   allocate_filename(path, "utilization.tsv.tmp", &cpw->utsv_path_tmp);
   allocate_filename(path, "plugins.tsv", &cpw->ptsv_path);
   allocate_filename(path, "plugins.tsv.tmp", &cpw->ptsv_path_tmp);
+  allocate_filename(path, "queues.tsv", &cpw->qtsv_path);
+  allocate_filename(path, "queues.tsv.tmp", &cpw->qtsv_path_tmp);
+  cpw->pending = false;
+  cpw->sync = ip->cfg->iqc.sync != 'n' || ip->cfg->aqc.sync != 'n';
+  cpw->samples = NULL;
+  cpw->samples_cap = 0;
 }
 
 
@@ -81,6 +90,8 @@ void hs_free_checkpoint_writer(hs_checkpoint_writer *cpw)
   cpw->cp_path = NULL;
   free(cpw->cp_path_tmp);
   cpw->cp_path_tmp = NULL;
+  free(cpw->cp_path_pending);
+  cpw->cp_path_pending = NULL;
 
   free(cpw->utsv_path);
   cpw->utsv_path = NULL;
@@ -91,6 +102,15 @@ void hs_free_checkpoint_writer(hs_checkpoint_writer *cpw)
   cpw->ptsv_path = NULL;
   free(cpw->ptsv_path_tmp);
   cpw->ptsv_path_tmp = NULL;
+
+  free(cpw->qtsv_path);
+  cpw->qtsv_path = NULL;
+  free(cpw->qtsv_path_tmp);
+  cpw->qtsv_path_tmp = NULL;
+
+  free(cpw->samples);
+  cpw->samples = NULL;
+  cpw->samples_cap = 0;
 }
 
 
@@ -111,6 +131,14 @@ static int round_percentage(long long n, long long d)
 }
 
 
+static void update_min(hs_checkpoint *min, const hs_checkpoint *cp)
+{
+  if (cp->id < min->id || (cp->id == min->id && cp->offset < min->offset)) {
+    *min = *cp;
+  }
+}
+
+
 static void input_stats(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr,
                         struct checkpoint_info *cpi)
 {
@@ -138,7 +166,7 @@ static void input_stats(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr,
                 // no message matcher p->stats
                 p->stats.pm_avg, p->stats.pm_sd,
                 p->stats.te_avg, p->stats.te_sd);
-        fprintf(cpi->utsv, "%s\t%d\t-1\t-1\t-1\t-1\n", p->name,
+        fprintf(cpi->utsv, "%s\t%d\t-1\t-1\t-1\t-1\t-1\t-1\n", p->name,
                 p->im_delta_cnt);
         cpi->input_delta_cnt += p->im_delta_cnt;
         p->im_delta_cnt = 0;
@@ -150,14 +178,20 @@ static void input_stats(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr,
   }
   pthread_mutex_unlock(&cpw->input_plugins->list_lock);
 
-  pthread_mutex_lock(&cpw->input_plugins->output->lock);
-  if (fflush(cpw->input_plugins->output->fh)) {
-    hs_log(NULL, g_module, 0, "input queue fflush failed");
-    exit(EXIT_FAILURE);
+  char subdir[HS_MAX_PATH];
+  int shards = cpw->input_plugins->cfg->input_shards;
+  for (int i = 0; i < shards; ++i) {
+    hs_output *output = &cpw->input_plugins->output[i];
+    if (hs_get_shard_dir(i, shards, subdir, sizeof(subdir))) {
+      hs_log(NULL, g_module, 0, "input queue shard name too long");
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&output->lock);
+    hs_flush_output(output);
+    cpi->cp = output->cp;
+    pthread_mutex_unlock(&output->lock);
+    hs_update_input_checkpoint(cpr, subdir, NULL, &cpi->cp);
   }
-  cpi->cp = cpw->input_plugins->output->cp;
-  pthread_mutex_unlock(&cpw->input_plugins->output->lock);
-  hs_update_input_checkpoint(cpr, hs_input_dir, NULL, &cpi->cp);
 }
 
 
@@ -177,56 +211,86 @@ static int get_max_mps(long long tt, int amps, int max_mps)
 }
 
 
+static hs_analysis_sample* get_samples(hs_checkpoint_writer *cpw, int cnt)
+{
+  if (cnt > cpw->samples_cap) {
+    hs_analysis_sample *tmp = realloc(cpw->samples,
+                                      sizeof(hs_analysis_sample) * cnt);
+    if (!tmp) {
+      hs_log(NULL, g_module, 0, "analysis samples realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    cpw->samples = tmp;
+    cpw->samples_cap = cnt;
+  }
+  return cpw->samples;
+}
+
+
 static void analysis_stats(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr,
                            struct checkpoint_info *cpi)
 {
   for (int i = 0; i < cpw->analysis_plugins->thread_cnt; ++i) {
     hs_analysis_thread *at = &cpw->analysis_plugins->list[i];
+    int shards = cpw->analysis_plugins->cfg->input_shards;
+    for (int j = 0; j < shards; ++j) {
+      pthread_mutex_lock(&at->cp_lock);
+      cpi->cp = at->cp[j];
+      pthread_mutex_unlock(&at->cp_lock);
+      update_min(&cpi->min_input[j], &cpi->cp);
+      hs_update_input_checkpoint(cpr, at->input[j].subdir, at->input[j].name,
+                                 &cpi->cp);
+    }
     pthread_mutex_lock(&at->cp_lock);
-    cpi->cp = at->cp;
     if (!at->sample) {
       at->sample = cpi->sample;
     }
     pthread_mutex_unlock(&at->cp_lock);
-    if (cpi->cp.id < cpi->min_input_id) {
-      cpi->min_input_id = cpi->cp.id;
-    }
-    hs_update_input_checkpoint(cpr, hs_input_dir, at->input.name, &cpi->cp);
 
     pthread_mutex_lock(&cpw->analysis_plugins->output.lock);
-    if (fflush(cpw->analysis_plugins->output.fh)) {
-      hs_log(NULL, g_module, 0, "analysis queue fflush failed");
-      exit(EXIT_FAILURE);
-    }
+    hs_flush_output(&cpw->analysis_plugins->output);
     cpi->cp = cpw->analysis_plugins->output.cp;
     pthread_mutex_unlock(&cpw->analysis_plugins->output.lock);
     hs_update_input_checkpoint(cpr, hs_analysis_dir, NULL, &cpi->cp);
 
+    // the list lock only excludes list changes, the thread keeps processing
+    // messages; the counters are swapped out and the statistics read without
+    // blocking it
+    pthread_mutex_lock(&at->cp_lock);
+    int mm_delta_cnt = at->mm_delta_cnt;
+    at->mm_delta_cnt = 0;
+    pthread_mutex_unlock(&at->cp_lock);
+
     hs_analysis_plugin *p;
     if (cpi->ptsv && cpi->utsv) {
       long long mmt = 0;
       long long pmt = 0;
       long long tet = 0;
       pthread_mutex_lock(&at->list_lock);
+      hs_analysis_sample *samples = get_samples(cpw, at->list_cap);
       for (int i = 0; i < at->list_cap; ++i) {
         p = at->list[i];
         if (!p) continue;
-        mmt += p->mms.mean * at->mm_delta_cnt;
-        pmt += p->stats.pm_avg * p->pm_delta_cnt;
+        hs_analysis_sample *s = &samples[i];
+        s->pm_delta_cnt = __atomic_exchange_n(&p->pm_delta_cnt, 0,
+                                              __ATOMIC_RELAXED);
+        hs_read_analysis_stats(p, &s->stats, &s->mms);
+        mmt += s->mms.mean * mm_delta_cnt;
+        pmt += s->stats.pm_avg * s->pm_delta_cnt;
         if (p->ticker_interval > 0) {
-          tet += p->stats.te_avg * (sample_sec * 1.0 / p->ticker_interval);
+          tet += s->stats.te_avg * (sample_sec * 1.0 / p->ticker_interval);
         }
       }
 
       long long tt = mmt + pmt + tet;
-      int amps = at->mm_delta_cnt / sample_sec;
+      int amps = mm_delta_cnt / sample_sec;
       int imps = cpi->input_delta_cnt / sample_sec;
       int mps  = (imps > amps) ? imps : amps;
       at->max_mps = get_max_mps(tt, amps, at->max_mps);
       int utilization = round_percentage(mps, at->max_mps);
       at->utilization = utilization > UINT8_MAX ? UINT8_MAX : utilization;
-      fprintf(cpi->utsv, "analysis%d\t%d\t%d\t%d\t%d\t%d\n", i,
-              at->mm_delta_cnt,
+      fprintf(cpi->utsv, "analysis%d\t%d\t%d\t%d\t%d\t%d\t-1\t-1\n", i,
+              mm_delta_cnt,
               at->utilization,
               round_percentage(mmt, tt),
               round_percentage(pmt, tt),
@@ -236,6 +300,7 @@ static void analysis_stats(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr,
         p = at->list[i];
         if (!p) continue;
 
+        hs_analysis_sample *s = &samples[i];
         fprintf(cpi->ptsv, "%s\t"
                 "%llu\t%llu\t"
                 "%llu\t%llu\t"
@@ -244,46 +309,47 @@ static void analysis_stats(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr,
                 "%.0f\t%.0f\t"
                 "%.0f\t%.0f\n",
                 p->name,
-                p->stats.im_cnt, p->stats.im_bytes,
-                p->stats.pm_cnt, p->stats.pm_failures,
-                p->stats.mem_cur, p->stats.mem_max,
-                p->stats.out_max, p->stats.ins_max,
-                p->mms.mean, lsb_sd_running_stats(&p->mms),
-                p->stats.pm_avg, p->stats.pm_sd,
-                p->stats.te_avg, p->stats.te_sd);
-
-        long long mmtp = p->mms.mean * at->mm_delta_cnt;
-        long long pmtp = p->stats.pm_avg * p->pm_delta_cnt;
+                s->stats.im_cnt, s->stats.im_bytes,
+                s->stats.pm_cnt, s->stats.pm_failures,
+                s->stats.mem_cur, s->stats.mem_max,
+                s->stats.out_max, s->stats.ins_max,
+                s->mms.mean, lsb_sd_running_stats(&s->mms),
+                s->stats.pm_avg, s->stats.pm_sd,
+                s->stats.te_avg, s->stats.te_sd);
+
+        long long mmtp = s->mms.mean * mm_delta_cnt;
+        long long pmtp = s->stats.pm_avg * s->pm_delta_cnt;
         long long tetp = 0;
         if (p->ticker_interval > 0) {
-          tetp = p->stats.te_avg * (sample_sec * 1.0 / p->ticker_interval);
+          tetp = s->stats.te_avg * (sample_sec * 1.0 / p->ticker_interval);
         }
         long long ttp = mmtp + pmtp + tetp;
+        p->utilization = round_percentage(ttp, tt);
         if (tt == 0 || ttp == 0) {
-          fprintf(cpi->utsv, "%s\t0\t0\t0\t0\t0\n", p->name);
+          fprintf(cpi->utsv, "%s\t0\t0\t0\t0\t0\t-1\t-1\n", p->name);
         } else {
-          fprintf(cpi->utsv, "%s\t%d\t%d\t%d\t%d\t%d\n", p->name,
-                  p->pm_delta_cnt,
+          fprintf(cpi->utsv, "%s\t%d\t%d\t%d\t%d\t%d\t-1\t-1\n", p->name,
+                  s->pm_delta_cnt,
                   round_percentage(ttp, tt),
                   round_percentage(mmtp, ttp),
                   round_percentage(pmtp, ttp),
                   round_percentage(tetp, ttp));
         }
-        p->pm_delta_cnt = 0;
       }
-      at->mm_delta_cnt = 0;
       pthread_mutex_unlock(&at->list_lock);
     } else if (cpi->tsv_error) {
       pthread_mutex_lock(&at->list_lock);
       for (int i = 0; i < at->list_cap; ++i) {
         p = at->list[i];
         if (!p) continue;
-        p->pm_delta_cnt = 0;
+        __atomic_store_n(&p->pm_delta_cnt, 0, __ATOMIC_RELAXED);
       }
-      at->mm_delta_cnt = 0;
       pthread_mutex_unlock(&at->list_lock);
     }
   }
+  if (cpi->ptsv && cpi->utsv) {
+    hs_rebalance_analysis_plugins(cpw->analysis_plugins);
+  }
 }
 
 
@@ -301,19 +367,17 @@ static void output_stats(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr,
     int imps = 0;
     if (!p->sample) p->sample = cpi->sample;
     if (p->read_queue >= 'b') {
-      if (p->cur.input.id < cpi->min_input_id) {
-        cpi->min_input_id = p->cur.input.id;
+      for (int j = 0; j < cpw->output_plugins->cfg->input_shards; ++j) {
+        update_min(&cpi->min_input[j], &p->cur.input[j]);
+        hs_update_input_checkpoint(cpr,
+                                   p->input[j].subdir,
+                                   p->name,
+                                   &p->cp.input[j]);
       }
-      hs_update_input_checkpoint(cpr,
-                                 hs_input_dir,
-                                 p->name,
-                                 &p->cp.input);
       imps = cpi->input_delta_cnt / sample_sec;
     }
     if (p->read_queue <= 'b') {
-      if (p->cur.analysis.id < cpi->min_analysis_id) {
-        cpi->min_analysis_id = p->cur.analysis.id;
-      }
+      update_min(&cpi->min_analysis, &p->cur.analysis);
       hs_update_input_checkpoint(cpr,
                                  hs_analysis_dir,
                                  p->name,
@@ -348,7 +412,7 @@ static void output_stats(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr,
       int amps = p->mm_delta_cnt / sample_sec;
       int mps  = (imps > amps) ? imps : amps;
       p->max_mps = get_max_mps(tt, amps, p->max_mps);
-      fprintf(cpi->utsv, "%s\t%d\t%d\t%d\t%d\t%d\n", p->name,
+      fprintf(cpi->utsv, "%s\t%d\t%d\t%d\t%d\t%d\t-1\t-1\n", p->name,
               p->pm_delta_cnt,
               round_percentage(mps, p->max_mps),
               round_percentage(mmt, tt),
@@ -366,16 +430,139 @@ static void output_stats(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr,
 }
 
 
+static int queue_cnt(hs_checkpoint_writer *cpw)
+{
+  return cpw->input_plugins->cfg->input_shards + 1;
+}
+
+
+static hs_output* get_queue(hs_checkpoint_writer *cpw, int i)
+{
+  if (i < cpw->input_plugins->cfg->input_shards) {
+    return &cpw->input_plugins->output[i];
+  }
+  return &cpw->analysis_plugins->output;
+}
+
+
+static void sync_stats(hs_checkpoint_writer *cpw, struct checkpoint_info *cpi)
+{
+  for (int i = 0; i < queue_cnt(cpw); ++i) {
+    hs_output *output = get_queue(cpw, i);
+    if (!output->syncer_running) continue;
+
+    unsigned cnt;
+    long long ns, max_ns;
+    hs_output_sync_stats(output, &cnt, &ns, &max_ns);
+    if (cpi->utsv) {
+      fprintf(cpi->utsv, "%s_sync\t%u\t%d\t-1\t-1\t-1\t%lld\t%lld\n",
+              output->subdir,
+              cnt,
+              round_percentage(ns, sample_sec * 1000000000LL),
+              cnt ? ns / cnt / 1000 : 0,
+              max_ns / 1000);
+    }
+  }
+}
+
+
+static void queue_stats(hs_checkpoint_writer *cpw, struct checkpoint_info *cpi)
+{
+  for (int i = 0; i < queue_cnt(cpw); ++i) {
+    hs_output *output = get_queue(cpw, i);
+    const hs_checkpoint *min = i < cpw->input_plugins->cfg->input_shards
+        ? &cpi->min_input[i] : &cpi->min_analysis;
+    hs_update_output_readers(output, min);
+    if (!cpi->qtsv) continue;
+
+    size_t resident = hs_output_resident(output, min);
+    pthread_mutex_lock(&output->lock);
+    unsigned long long behind = 0;
+    if (min->id != ULLONG_MAX && output->cp.id > min->id) {
+      behind = output->cp.id - min->id;
+    }
+    unsigned long long min_rate = 0, max_rate = 0;
+    for (int j = 0; j < output->rings_cap; ++j) {
+      if (!output->rings[j]) continue;
+      unsigned long long rate = __atomic_load_n(&output->rings[j]->rate,
+                                                __ATOMIC_RELAXED);
+      if (!max_rate || rate < min_rate) min_rate = rate;
+      if (rate > max_rate) max_rate = rate;
+    }
+    fprintf(cpi->qtsv, "%s\t%d\t%llu\t%llu\t%d\t%llu\t%llu\t%zu\n",
+            output->subdir,
+            hs_output_backpressure(output),
+            behind,
+            output->drain_rate,
+            output->producers,
+            min_rate,
+            max_rate,
+            resident);
+    pthread_mutex_unlock(&output->lock);
+  }
+}
+
+
+static bool queues_synced(hs_checkpoint_writer *cpw, const hs_checkpoint *pos)
+{
+  for (int i = 0; i < queue_cnt(cpw); ++i) {
+    if (!hs_output_synced(get_queue(cpw, i), &pos[i])) return false;
+  }
+  return true;
+}
+
+
+/**
+ * Replaces the checkpoints once the queue data they cover is durable, until
+ * then only the oldest held back checkpoints are kept.
+ */
+static void publish_checkpoints(hs_checkpoint_writer *cpw,
+                                const hs_checkpoint *pos)
+{
+  if (cpw->pending && queues_synced(cpw, cpw->pending_pos)) {
+    rename(cpw->cp_path_pending, cpw->cp_path);
+    cpw->pending = false;
+  }
+
+  if (queues_synced(cpw, pos)) {
+    rename(cpw->cp_path_tmp, cpw->cp_path);
+    if (cpw->pending) {
+      unlink(cpw->cp_path_pending);
+      cpw->pending = false;
+    }
+  } else if (!cpw->pending) {
+    if (!rename(cpw->cp_path_tmp, cpw->cp_path_pending)) {
+      memcpy(cpw->pending_pos, pos, sizeof(hs_checkpoint) * queue_cnt(cpw));
+      cpw->pending = true;
+    }
+  }
+}
+
+
+void hs_sync_queues(hs_checkpoint_writer *cpw)
+{
+  for (int i = 0; i < queue_cnt(cpw); ++i) {
+    hs_sync_output(get_queue(cpw, i));
+  }
+}
+
+
 void hs_write_checkpoints(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr)
 {
   static struct checkpoint_info cpi = {
-    NULL, NULL, ULLONG_MAX, ULLONG_MAX,{ 0, 0 }, 0, 0, false, false };
+    NULL, NULL, NULL, { { 0, 0 } }, { ULLONG_MAX, 0 }, { 0, 0 }, 0, 0, false,
+    false };
 
   // any stat write failures are non critical and will be ignored
   cpi.utsv = NULL;
   cpi.ptsv = NULL;
-  cpi.min_input_id = ULLONG_MAX;
-  cpi.min_analysis_id = ULLONG_MAX;
+  cpi.qtsv = NULL;
+  for (int i = 0; i < HS_MAX_INPUT_SHARDS; ++i) {
+    cpi.min_input[i].id = ULLONG_MAX;
+    cpi.min_input[i].offset = 0;
+  }
+  cpi.min_analysis.id = ULLONG_MAX;
+  cpi.min_analysis.offset = 0;
   cpi.input_delta_cnt = 0;
   cpi.tsv_error = false;
 
@@ -384,7 +571,8 @@ void hs_write_checkpoints(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr)
     if (cpi.utsv) {
       fprintf(cpi.utsv, "Plugin\tMessages Processed\t"
               "%% Utilization\t%% Message Matcher\t"
-              "%% Process Message\t%% Timer Event"
+              "%% Process Message\t%% Timer Event\t"
+              "Sync Avg (us)\tSync Max (us)"
               "\n");
     }
 
@@ -400,11 +588,29 @@ void hs_write_checkpoints(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr)
               "Timer Event Avg (ns)\tTimer Event SD (ns)\n");
     }
     cpi.tsv_error = !(cpi.utsv && cpi.ptsv);
+
+    cpi.qtsv = fopen(cpw->qtsv_path_tmp, "we");
+    if (cpi.qtsv) {
+      fprintf(cpi.qtsv, "Queue\tBackpressure\tFiles Behind\t"
+              "Drain Rate (B/s)\tProducers\tMin Producer Rate (B/s)\t"
+              "Max Producer Rate (B/s)\tResident Bytes\n");
+    }
   }
   cpi.sample = (cpi.sample_cnt % sample_sec == 0);
   input_stats(cpw, cpr, &cpi);
   analysis_stats(cpw, cpr, &cpi);
   output_stats(cpw, cpr, &cpi);
+  if (cpi.utsv || cpi.tsv_error) sync_stats(cpw, &cpi);
+
+  // every checkpoint above refers to data before these queue positions
+  hs_checkpoint pos[HS_MAX_INPUT_SHARDS + 1];
+  for (int i = 0; i < queue_cnt(cpw); ++i) {
+    hs_output *output = get_queue(cpw, i);
+    pthread_mutex_lock(&output->lock);
+    pos[i] = output->cp;
+    pthread_mutex_unlock(&output->lock);
+    if (output->qcfg->sync == 'c') hs_sync_output(output);
+  }
 
   if (cpi.ptsv) {
     if (!fclose(cpi.ptsv)) rename(cpw->ptsv_path_tmp, cpw->ptsv_path);
@@ -413,13 +619,10 @@ void hs_write_checkpoints(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr)
     if (!fclose(cpi.utsv)) rename(cpw->utsv_path_tmp, cpw->utsv_path);
   }
 
-  pthread_mutex_lock(&cpw->input_plugins->output->lock);
-  cpw->input_plugins->output->min_cp_id = cpi.min_input_id;
-  pthread_mutex_unlock(&cpw->input_plugins->output->lock);
-
-  pthread_mutex_lock(&cpw->analysis_plugins->output.lock);
-  cpw->analysis_plugins->output.min_cp_id = cpi.min_analysis_id;
-  pthread_mutex_unlock(&cpw->analysis_plugins->output.lock);
+  queue_stats(cpw, &cpi);
+  if (cpi.qtsv) {
+    if (!fclose(cpi.qtsv)) rename(cpw->qtsv_path_tmp, cpw->qtsv_path);
+  }
 
   if (++cpi.sample_cnt == 60) cpi.sample_cnt = 0;
 
@@ -429,10 +632,13 @@ void hs_write_checkpoints(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr)
     exit(EXIT_FAILURE);
   }
   int rv = hs_output_checkpoints(cpr, cp);
+  if (!rv && cpw->sync) {
+    rv = fflush(cp) || fdatasync(fileno(cp));
+  }
   if (fclose(cp) || rv) {
     hs_log(NULL, g_module, 0, "checkpoint write failure");
     exit(EXIT_FAILURE);
   } else {
-    rename(cpw->cp_path_tmp, cpw->cp_path);
+    publish_checkpoints(cpw, pos);
   }
 }
@@ -17,6 +17,13 @@
 #include "hs_output_plugins.h"
 #include "hs_output.h"
 
+// Statistics sampled from one analysis plugin
+typedef struct hs_analysis_sample {
+  int pm_delta_cnt;
+  lsb_heka_stats stats;
+  lsb_running_stats mms;
+} hs_analysis_sample;
+
 typedef struct hs_checkpoint_writer {
   hs_analysis_plugins *analysis_plugins;
   hs_input_plugins *input_plugins;
@@ -24,9 +31,21 @@ typedef struct hs_checkpoint_writer {
   char *cp_path;
   char *utsv_path;
   char *ptsv_path;
+  char *qtsv_path;
   char *cp_path_tmp;
+  char *cp_path_pending;
   char *utsv_path_tmp;
   char *ptsv_path_tmp;
+  char *qtsv_path_tmp;
+
+  // checkpoints waiting for the queue data they cover to become durable, the
+  // last position is the analysis queue
+  hs_checkpoint pending_pos[HS_MAX_INPUT_SHARDS + 1];
+  bool pending;
+  bool sync; // at least one queue is synced
+
+  hs_analysis_sample *samples; // grown to the largest analysis plugin list
+  int samples_cap;
 } hs_checkpoint_writer;
 
 void hs_init_checkpoint_writer(hs_checkpoint_writer *cpw,
@@ -39,4 +58,12 @@ void hs_free_checkpoint_writer(hs_checkpoint_writer *cpw);
 
 void hs_write_checkpoints(hs_checkpoint_writer *cpw, hs_checkpoint_reader *cpr);
 
+/**
+ * Makes everything written to the queues durable so the next checkpoints are
+ * not held back by the sync policy (used at shutdown)
+ *
+ * @param cpw Checkpoint writer
+ */
+void hs_sync_queues(hs_checkpoint_writer *cpw);
+
 #endif
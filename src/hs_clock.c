@@ -0,0 +1,162 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight process wide clock implementation @file */
+
+#include "hs_clock.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hs_logger.h"
+
+static const char g_module[] = "clock";
+
+// read by every thread on every message, on a cache line of its own so the
+// updates do not invalidate anything else
+typedef struct hs_clock_line
+{
+  long long ns; // 0 when the clock thread is not running
+} __attribute__((aligned(64))) hs_clock_line;
+
+static hs_clock_line g_now;
+static pthread_t g_thread;
+static bool g_stop;
+static unsigned g_resolution_ms;
+
+static double g_ns_per_tick; // 0 when the TSC is not used
+static unsigned long long g_tsc_base;
+
+
+static long long clock_ns(clockid_t id)
+{
+  struct timespec ts;
+  if (clock_gettime(id, &ts) == -1) {
+    ts.tv_sec = time(NULL);
+    ts.tv_nsec = 0;
+  }
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+static unsigned long long read_tsc(void)
+{
+  return __builtin_ia32_rdtsc();
+}
+
+
+/**
+ * Tests if the TSC ticks at a constant rate across frequency changes and idle
+ * states, otherwise it cannot be used as a clock
+ */
+static bool invariant_tsc(void)
+{
+  FILE *fh = fopen("/proc/cpuinfo", "re");
+  if (!fh) return false;
+
+  bool constant = false;
+  bool nonstop = false;
+  char line[4096];
+  while (fgets(line, sizeof(line), fh)) {
+    if (strncmp(line, "flags", 5) != 0) continue;
+    constant = strstr(line, " constant_tsc") != NULL;
+    nonstop = strstr(line, " nonstop_tsc") != NULL;
+    break;
+  }
+  fclose(fh);
+  return constant && nonstop;
+}
+
+
+static void calibrate_tsc(void)
+{
+  if (!invariant_tsc()) {
+    hs_log(NULL, g_module, 6, "no invariant TSC, sampling with "
+           "CLOCK_MONOTONIC");
+    return;
+  }
+  struct timespec ts = { .tv_sec = 0, .tv_nsec = 20 * 1000000L };
+  long long start_ns = clock_ns(CLOCK_MONOTONIC);
+  unsigned long long start = read_tsc();
+  nanosleep(&ts, NULL);
+  long long end_ns = clock_ns(CLOCK_MONOTONIC);
+  unsigned long long end = read_tsc();
+  if (end <= start || end_ns <= start_ns) return;
+
+  g_tsc_base = start;
+  g_ns_per_tick = (double)(end_ns - start_ns) / (end - start);
+  hs_log(NULL, g_module, 7, "TSC %.0f MHz", 1000 / g_ns_per_tick);
+}
+#endif
+
+
+static void* clock_thread(void *arg)
+{
+  (void)arg;
+  struct timespec ts = { .tv_sec = g_resolution_ms / 1000,
+    .tv_nsec = (g_resolution_ms % 1000) * 1000000L };
+  while (!__atomic_load_n(&g_stop, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&g_now.ns, clock_ns(CLOCK_REALTIME), __ATOMIC_RELAXED);
+    nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+
+void hs_init_clock(unsigned resolution_ms)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  calibrate_tsc();
+#endif
+  g_resolution_ms = resolution_ms;
+  if (!resolution_ms) return;
+
+  g_stop = false;
+  __atomic_store_n(&g_now.ns, clock_ns(CLOCK_REALTIME), __ATOMIC_RELAXED);
+  if (pthread_create(&g_thread, NULL, clock_thread, NULL)) {
+    perror("clock pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+void hs_free_clock(void)
+{
+  if (!g_resolution_ms) return;
+
+  __atomic_store_n(&g_stop, true, __ATOMIC_RELEASE);
+  pthread_join(g_thread, NULL);
+  __atomic_store_n(&g_now.ns, 0, __ATOMIC_RELAXED);
+  g_resolution_ms = 0;
+}
+
+
+long long hs_coarse_time_ns(void)
+{
+  long long ns = __atomic_load_n(&g_now.ns, __ATOMIC_RELAXED);
+  return ns ? ns : clock_ns(CLOCK_REALTIME);
+}
+
+
+time_t hs_coarse_time(void)
+{
+  return hs_coarse_time_ns() / 1000000000LL;
+}
+
+
+unsigned long long hs_fine_time(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (g_ns_per_tick > 0) {
+    return (unsigned long long)((read_tsc() - g_tsc_base) * g_ns_per_tick);
+  }
+#endif
+  return clock_ns(CLOCK_MONOTONIC);
+}
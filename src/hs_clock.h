@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Hindsight process wide coarse clock and fine sampling clock @file */
+
+#ifndef hs_clock_h_
+#define hs_clock_h_
+
+#include <time.h>
+
+/**
+ * Starts the thread that publishes the wall clock
+ *
+ * @param resolution_ms Update interval in milliseconds (0 reads the system
+ *                      clock on every call)
+ */
+void hs_init_clock(unsigned resolution_ms);
+
+/**
+ * Stops the clock thread, the calls fall back to the system clock
+ *
+ */
+void hs_free_clock(void);
+
+/**
+ * Returns the wall clock as of the last update (the system clock before
+ * hs_init_clock)
+ *
+ * @return time_t Seconds since the epoch
+ */
+time_t hs_coarse_time(void);
+
+/**
+ * Returns the wall clock as of the last update (the system clock before
+ * hs_init_clock)
+ *
+ * @return long long Nanoseconds since the epoch
+ */
+long long hs_coarse_time_ns(void);
+
+/**
+ * Returns a monotonic time for measuring short durations, read from the
+ * invariant TSC when the CPU has one (CLOCK_MONOTONIC otherwise)
+ *
+ * @return unsigned long long Nanoseconds (only differences are meaningful)
+ */
+unsigned long long hs_fine_time(void);
+
+#endif
@@ -0,0 +1,124 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight queue block compression @file */
+
+#include "hs_compress.h"
+
+#include <limits.h>
+#include <string.h>
+
+#ifdef WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+
+bool hs_codec_available(char codec)
+{
+  switch (codec) {
+  case 'n':
+    return true;
+#ifdef WITH_LZ4
+  case 'l':
+    return true;
+#endif
+#ifdef WITH_ZSTD
+  case 'z':
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+
+size_t hs_compress_bound(char codec, size_t len)
+{
+  switch (codec) {
+  case 'n':
+    return len;
+#ifdef WITH_LZ4
+  case 'l':
+    if (len > (size_t)INT_MAX) return 0;
+    return (size_t)LZ4_compressBound((int)len);
+#endif
+#ifdef WITH_ZSTD
+  case 'z':
+    return ZSTD_compressBound(len);
+#endif
+  default:
+    return 0;
+  }
+}
+
+
+size_t hs_compress(char codec, const char *src, size_t len, char *dst,
+                   size_t cap)
+{
+  switch (codec) {
+  case 'n':
+    if (len > cap) return 0;
+    memcpy(dst, src, len);
+    return len;
+#ifdef WITH_LZ4
+  case 'l':
+    {
+      if (len > (size_t)INT_MAX || cap > (size_t)INT_MAX) return 0;
+      int n = LZ4_compress_default(src, dst, (int)len, (int)cap);
+      return n > 0 ? (size_t)n : 0;
+    }
+#endif
+#ifdef WITH_ZSTD
+  case 'z':
+    {
+      size_t n = ZSTD_compress(dst, cap, src, len, ZSTD_CLEVEL_DEFAULT);
+      return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+  default:
+    (void)src;
+    (void)len;
+    (void)dst;
+    (void)cap;
+    return 0;
+  }
+}
+
+
+int hs_decompress(char codec, const char *src, size_t len, char *dst,
+                  size_t raw_len)
+{
+  switch (codec) {
+  case 'n':
+    if (len != raw_len) return 1;
+    memcpy(dst, src, len);
+    return 0;
+#ifdef WITH_LZ4
+  case 'l':
+    {
+      if (len > (size_t)INT_MAX || raw_len > (size_t)INT_MAX) return 1;
+      int n = LZ4_decompress_safe(src, dst, (int)len, (int)raw_len);
+      return n < 0 || (size_t)n != raw_len;
+    }
+#endif
+#ifdef WITH_ZSTD
+  case 'z':
+    {
+      size_t n = ZSTD_decompress(dst, raw_len, src, len);
+      return ZSTD_isError(n) || n != raw_len;
+    }
+#endif
+  default:
+    (void)src;
+    (void)len;
+    (void)dst;
+    (void)raw_len;
+    return 1;
+  }
+}
@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Hindsight queue block compression @file */
+
+#ifndef hs_compress_h_
+#define hs_compress_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Returns true if support for the codec was compiled in
+ *
+ * @param codec 'l' LZ4, 'z' zstd, 'n' stored
+ *
+ * @return bool
+ */
+bool hs_codec_available(char codec);
+
+/**
+ * Returns the largest compressed size of a block
+ *
+ * @param codec Compression codec
+ * @param len Uncompressed length
+ *
+ * @return size_t Required destination capacity (0 if the codec is not
+ *         available)
+ */
+size_t hs_compress_bound(char codec, size_t len);
+
+/**
+ * Compresses a block
+ *
+ * @param codec Compression codec
+ * @param src Uncompressed data
+ * @param len Length of src
+ * @param dst Destination buffer
+ * @param cap Capacity of dst (see hs_compress_bound)
+ *
+ * @return size_t Compressed length or 0 on failure
+ */
+size_t hs_compress(char codec, const char *src, size_t len, char *dst,
+                   size_t cap);
+
+/**
+ * Decompresses a block
+ *
+ * @param codec Compression codec
+ * @param src Compressed data
+ * @param len Length of src
+ * @param dst Destination buffer
+ * @param raw_len Uncompressed length recorded for the block
+ *
+ * @return int 0 on success
+ */
+int hs_decompress(char codec, const char *src, size_t len, char *dst,
+                  size_t raw_len);
+
+#endif
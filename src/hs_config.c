@@ -12,6 +12,7 @@
 #include <luasandbox/lua.h>
 #include <luasandbox/util/util.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +32,11 @@ const char *hs_rtc_ext      = ".rtc";
 
 static const char g_module[] = "config_parser";
 static const char *g_queue_options[] = { "both", "input", "analysis", NULL };
+static const char *g_read_order_options[] = { "timestamp", "round_robin",
+  NULL };
+static const char *g_sync_options[] = { "none", "interval", "segment",
+  "checkpoint", NULL };
+static const char *g_compression_options[] = { "none", "lz4", "zstd", NULL };
 
 static const char *cfg_output_path = "output_path";
 static const char *cfg_output_size = "output_size";
@@ -41,12 +47,30 @@ static const char *cfg_threads = "analysis_threads";
 static const char *cfg_analysis_lua_path = "analysis_lua_path";
 static const char *cfg_analysis_lua_cpath = "analysis_lua_cpath";
 static const char *cfg_analysis_utilization_limit = "analysis_utilization_limit";
+static const char *cfg_analysis_rebalance = "analysis_rebalance";
 static const char *cfg_io_lua_path = "io_lua_path";
 static const char *cfg_io_lua_cpath = "io_lua_cpath";
 static const char *cfg_max_message_size = "max_message_size";
 static const char *cfg_hostname = "hostname";
 static const char *cfg_backpressure = "backpressure";
 static const char *cfg_backpressure_df = "backpressure_disk_free";
+static const char *cfg_analysis_prefetch = "analysis_prefetch";
+static const char *cfg_analysis_shared_reader = "analysis_shared_reader";
+static const char *cfg_analysis_dispatch = "analysis_dispatch";
+static const char *cfg_clock_resolution = "clock_resolution";
+
+static const char *cfg_iqc = "input_queue";
+static const char *cfg_iq_shards = "input_queue_shards";
+static const char *cfg_iq_read_order = "input_queue_read_order";
+static const char *cfg_aqc = "analysis_queue";
+static const char *cfg_q_group_commit_bytes = "group_commit_bytes";
+static const char *cfg_q_group_commit_usec = "group_commit_usec";
+static const char *cfg_q_preallocate = "preallocate";
+static const char *cfg_q_sync = "sync";
+static const char *cfg_q_sync_interval = "sync_interval_ms";
+static const char *cfg_q_compression = "compression";
+static const char *cfg_q_mmap_readers = "mmap_readers";
+static const char *cfg_q_index_interval = "index_interval";
 
 static const char *cfg_sb_ipd = "input_defaults";
 static const char *cfg_sb_apd = "analysis_defaults";
@@ -66,6 +90,11 @@ static const char *cfg_sb_rm_cp_terminate = "remove_checkpoints_on_terminate";
 static const char *cfg_sb_pm_im_limit = "process_message_inject_limit";
 static const char *cfg_sb_te_im_limit = "timer_event_inject_limit";
 static const char *cfg_sb_read_queue = "read_queue";
+static const char *cfg_sb_bp_weight = "backpressure_weight";
+static const char *cfg_sb_start_time = "start_time";
+static const char *cfg_sb_parallelism = "parallelism";
+static const char *cfg_sb_partition_key = "partition_key";
+static const char *cfg_sb_partition_merge = "partition_merge";
 
 static void init_sandbox_config(hs_sandbox_config *cfg)
 {
@@ -74,25 +103,44 @@ static void init_sandbox_config(hs_sandbox_config *cfg)
   cfg->cfg_name = NULL;
   cfg->cfg_lua = NULL;
   cfg->message_matcher = NULL;
+  cfg->partition_key = NULL;
 
   cfg->thread = UINT_MAX;
+  cfg->parallelism = 1;
+  cfg->partition = 0;
   cfg->async_buffer_size = 0;
   cfg->output_limit = 1024 * 64;
   cfg->memory_limit = 1024 * 1024 * 8;
   cfg->instruction_limit = 1000000;
   cfg->ticker_interval = 0;
+  cfg->backpressure_weight = 1;
 
   cfg->preserve_data = false;
   cfg->restricted_headers = true;
   cfg->shutdown_terminate = false;
   cfg->rm_cp_terminate = false;
+  cfg->partition_merge = false;
   cfg->read_queue = 'b';
+  cfg->start_time = 0;
 
   cfg->pm_im_limit = 0;
   cfg->te_im_limit = 10;
 }
 
 
+static void init_queue_config(hs_queue_config *cfg)
+{
+  cfg->group_commit_bytes = 0;
+  cfg->group_commit_usec = 1000;
+  cfg->sync_interval_ms = 1000;
+  cfg->sync = 'n';
+  cfg->compression = 'n';
+  cfg->preallocate = false;
+  cfg->mmap_readers = false;
+  cfg->index_interval = 0;
+}
+
+
 static void init_config(hs_config *cfg)
 {
   cfg->run_path = NULL;
@@ -113,9 +161,16 @@ static void init_config(hs_config *cfg)
   cfg->output_size = 1024 * 1024 * 64;
   cfg->analysis_threads = 1;
   cfg->analysis_utilization_limit = 95;
+  cfg->analysis_rebalance = 0;
+  cfg->input_shards = 1;
+  cfg->input_read_order = 't';
   cfg->max_message_size = 1024 * 64;
   cfg->backpressure = 0;
   cfg->backpressure_df = 4;
+  cfg->analysis_prefetch = 0;
+  cfg->analysis_shared_reader = false;
+  cfg->analysis_dispatch = true;
+  cfg->clock_resolution = 100;
   cfg->pid = (int)getpid();
   init_sandbox_config(&cfg->ipd);
   init_sandbox_config(&cfg->apd);
@@ -123,6 +178,9 @@ static void init_config(hs_config *cfg)
 
   cfg->ipd.restricted_headers = false;
   cfg->opd.restricted_headers = false;
+
+  init_queue_config(&cfg->iqc);
+  init_queue_config(&cfg->aqc);
 }
 
 
@@ -207,6 +265,32 @@ static int get_unsigned_int(lua_State *L, int idx, const char *name,
 }
 
 
+static int get_time_item(lua_State *L, int idx, const char *name,
+                         long long *val)
+{
+  lua_getfield(L, idx, name);
+  int t = lua_type(L, -1);
+  double d;
+  switch (t) {
+  case LUA_TNUMBER:
+    d = lua_tonumber(L, -1);
+    if (d < -LLONG_MAX / 1000000000LL || d > LLONG_MAX / 1000000000LL) {
+      lua_pushfstring(L, "%s is out of range", name);
+      return 1;
+    }
+    *val = (long long)d;
+    break;
+  case LUA_TNIL:
+    break; // use the default
+  default:
+    lua_pushfstring(L, "%s must be set to a number", name);
+    return 1;
+  }
+  remove_item(L, idx, name);
+  return 0;
+}
+
+
 static int get_uint8(lua_State *L, int idx, const char *name,
                      uint8_t *val)
 {
@@ -302,6 +386,13 @@ static int load_sandbox_defaults(lua_State *L,
   if (get_unsigned_int(L, 1, cfg_sb_ticker_interval, &cfg->ticker_interval)) {
     return 1;
   }
+  if (get_unsigned_int(L, 1, cfg_sb_bp_weight, &cfg->backpressure_weight)) {
+    return 1;
+  }
+  if (cfg->backpressure_weight == 0) {
+    lua_pushfstring(L, "%s.%s must be greater than 0", key, cfg_sb_bp_weight);
+    return 1;
+  }
   if (get_bool_item(L, 1, cfg_sb_preserve, &cfg->preserve_data)) return 1;
 
   if (get_bool_item(L, 1, cfg_sb_restricted_headers,
@@ -331,6 +422,7 @@ static int load_sandbox_defaults(lua_State *L,
                         g_queue_options)) {
       return 1;
     }
+    if (get_time_item(L, 1, cfg_sb_start_time, &cfg->start_time)) return 1;
   }
 
   if (check_for_unknown_options(L, 1, key)) return 1;
@@ -340,6 +432,52 @@ static int load_sandbox_defaults(lua_State *L,
 }
 
 
+static int load_queue_config(lua_State *L, const char *key,
+                             hs_queue_config *cfg)
+{
+  lua_getglobal(L, key);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0; // use the defaults
+  }
+  if (!lua_istable(L, -1)) {
+    lua_pushfstring(L, "%s must be a table", key);
+    return 1;
+  }
+  if (get_unsigned_int(L, 1, cfg_q_group_commit_bytes,
+                       &cfg->group_commit_bytes)) {
+    return 1;
+  }
+  if (get_unsigned_int(L, 1, cfg_q_group_commit_usec,
+                       &cfg->group_commit_usec)) {
+    return 1;
+  }
+  if (get_bool_item(L, 1, cfg_q_preallocate, &cfg->preallocate)) return 1;
+  if (get_option_char(L, 1, cfg_q_sync, &cfg->sync, g_sync_options)) {
+    return 1;
+  }
+  if (get_unsigned_int(L, 1, cfg_q_sync_interval, &cfg->sync_interval_ms)) {
+    return 1;
+  }
+  if (cfg->sync_interval_ms == 0) {
+    lua_pushfstring(L, "%s must be greater than 0", cfg_q_sync_interval);
+    return 1;
+  }
+  if (get_option_char(L, 1, cfg_q_compression, &cfg->compression,
+                      g_compression_options)) {
+    return 1;
+  }
+  if (get_bool_item(L, 1, cfg_q_mmap_readers, &cfg->mmap_readers)) return 1;
+  if (get_unsigned_int(L, 1, cfg_q_index_interval, &cfg->index_interval)) {
+    return 1;
+  }
+  if (check_for_unknown_options(L, 1, key)) return 1;
+
+  remove_item(L, LUA_GLOBALSINDEX, key);
+  return 0;
+}
+
+
 void hs_free_sandbox_config(hs_sandbox_config *cfg)
 {
   free(cfg->dir);
@@ -356,6 +494,9 @@ void hs_free_sandbox_config(hs_sandbox_config *cfg)
 
   free(cfg->message_matcher);
   cfg->message_matcher = NULL;
+
+  free(cfg->partition_key);
+  cfg->partition_key = NULL;
 }
 
 
@@ -460,6 +601,7 @@ bool hs_load_sandbox_config(const char *dir,
     cfg->memory_limit = dflt->memory_limit;
     cfg->instruction_limit = dflt->instruction_limit;
     cfg->ticker_interval = dflt->ticker_interval;
+    cfg->backpressure_weight = dflt->backpressure_weight;
     cfg->preserve_data = dflt->preserve_data;
     cfg->restricted_headers = dflt->restricted_headers;
     cfg->shutdown_terminate = dflt->shutdown_terminate;
@@ -467,6 +609,7 @@ bool hs_load_sandbox_config(const char *dir,
     cfg->pm_im_limit = dflt->pm_im_limit;
     cfg->te_im_limit = dflt->te_im_limit;
     cfg->read_queue = dflt->read_queue;
+    cfg->start_time = dflt->start_time;
   }
 
   int ret = 0;
@@ -510,6 +653,14 @@ bool hs_load_sandbox_config(const char *dir,
                          &cfg->ticker_interval);
   if (ret) goto cleanup;
 
+  ret = get_unsigned_int(L, LUA_GLOBALSINDEX, cfg_sb_bp_weight,
+                         &cfg->backpressure_weight);
+  if (!ret && cfg->backpressure_weight == 0) {
+    lua_pushfstring(L, "%s must be greater than 0", cfg_sb_bp_weight);
+    ret = 1;
+  }
+  if (ret) goto cleanup;
+
   ret = get_string_item(L, LUA_GLOBALSINDEX, cfg_sb_filename, &cfg->filename,
                         NULL);
   if (!ret) {
@@ -551,6 +702,25 @@ bool hs_load_sandbox_config(const char *dir,
     ret = get_unsigned_int(L, LUA_GLOBALSINDEX, cfg_sb_te_im_limit,
                             &cfg->te_im_limit);
     if (ret) goto cleanup;
+
+    ret = get_unsigned_int(L, LUA_GLOBALSINDEX, cfg_sb_parallelism,
+                           &cfg->parallelism);
+    if (ret) goto cleanup;
+    if (cfg->parallelism < 1 || cfg->parallelism > HS_MAX_ANALYSIS_THREADS) {
+      lua_pushfstring(L, "%s must be 1-%d", cfg_sb_parallelism,
+                      HS_MAX_ANALYSIS_THREADS);
+      ret = 1;
+      goto cleanup;
+    }
+    if (cfg->parallelism > 1) {
+      ret = get_string_item(L, LUA_GLOBALSINDEX, cfg_sb_partition_key,
+                            &cfg->partition_key, NULL);
+      if (ret) goto cleanup;
+
+      ret = get_bool_item(L, LUA_GLOBALSINDEX, cfg_sb_partition_merge,
+                          &cfg->partition_merge);
+      if (ret) goto cleanup;
+    }
   }
 
   if (type == 'o') {
@@ -564,6 +734,10 @@ bool hs_load_sandbox_config(const char *dir,
     ret = get_option_char(L, LUA_GLOBALSINDEX, cfg_sb_read_queue,
                         &cfg->read_queue, g_queue_options);
     if (ret) goto cleanup;
+
+    ret = get_time_item(L, LUA_GLOBALSINDEX, cfg_sb_start_time,
+                        &cfg->start_time);
+    if (ret) goto cleanup;
   }
 
 cleanup:
@@ -623,6 +797,18 @@ int hs_load_config(const char *fn, hs_config *cfg)
                          &cfg->backpressure_df);
   if (ret) goto cleanup;
 
+  ret = get_unsigned_int(L, LUA_GLOBALSINDEX, cfg_analysis_prefetch,
+                         &cfg->analysis_prefetch);
+  if (ret) goto cleanup;
+
+  ret = get_bool_item(L, LUA_GLOBALSINDEX, cfg_analysis_shared_reader,
+                      &cfg->analysis_shared_reader);
+  if (ret) goto cleanup;
+
+  ret = get_bool_item(L, LUA_GLOBALSINDEX, cfg_analysis_dispatch,
+                      &cfg->analysis_dispatch);
+  if (ret) goto cleanup;
+
   ret = get_string_item(L, LUA_GLOBALSINDEX, cfg_load_path, &cfg->load_path,
                         "");
   if (ret) goto cleanup;
@@ -635,6 +821,24 @@ int hs_load_config(const char *fn, hs_config *cfg)
     goto cleanup;
   }
 
+  ret = get_uint8(L, LUA_GLOBALSINDEX, cfg_analysis_rebalance,
+                  &cfg->analysis_rebalance);
+  if (ret) goto cleanup;
+  if (cfg->analysis_rebalance > 100) {
+    lua_pushfstring(L, "%s must be 0-100", cfg_analysis_rebalance);
+    ret = 1;
+    goto cleanup;
+  }
+
+  ret = get_unsigned_int(L, LUA_GLOBALSINDEX, cfg_clock_resolution,
+                         &cfg->clock_resolution);
+  if (ret) goto cleanup;
+  if (cfg->clock_resolution > 1000) {
+    lua_pushfstring(L, "%s must be 0-1000", cfg_clock_resolution);
+    ret = 1;
+    goto cleanup;
+  }
+
   size_t len = strlen(cfg->load_path) + strlen(hs_input_dir) + 2;
   cfg->load_path_input = malloc(len);
   if (!cfg->load_path_input) {
@@ -758,6 +962,24 @@ int hs_load_config(const char *fn, hs_config *cfg)
     goto cleanup;
   }
 
+  ret = load_queue_config(L, cfg_iqc, &cfg->iqc);
+  if (ret) goto cleanup;
+
+  ret = get_uint8(L, LUA_GLOBALSINDEX, cfg_iq_shards, &cfg->input_shards);
+  if (ret) goto cleanup;
+  if (cfg->input_shards < 1 || cfg->input_shards > HS_MAX_INPUT_SHARDS) {
+    lua_pushfstring(L, "%s must be 1-%d", cfg_iq_shards, HS_MAX_INPUT_SHARDS);
+    ret = 1;
+    goto cleanup;
+  }
+
+  ret = get_option_char(L, LUA_GLOBALSINDEX, cfg_iq_read_order,
+                        &cfg->input_read_order, g_read_order_options);
+  if (ret) goto cleanup;
+
+  ret = load_queue_config(L, cfg_aqc, &cfg->aqc);
+  if (ret) goto cleanup;
+
   ret = check_for_unknown_options(L, LUA_GLOBALSINDEX, NULL);
   if (ret) goto cleanup;
 
@@ -876,6 +1098,7 @@ bool hs_output_runtime_cfg(lsb_output_buffer *ob, char type, const hs_config *cf
   lsb_outputf(ob, "memory_limit = %u\n", sbc->memory_limit);
   lsb_outputf(ob, "instruction_limit = %u\n", sbc->instruction_limit);
   lsb_outputf(ob, "ticker_interval = %u\n", sbc->ticker_interval);
+  lsb_outputf(ob, "backpressure_weight = %u\n", sbc->backpressure_weight);
   lsb_outputf(ob, "preserve_data = %s\n",
               sbc->preserve_data ? "true" : "false");
   lsb_outputf(ob, "restricted_headers = %s\n",
@@ -887,6 +1110,10 @@ bool hs_output_runtime_cfg(lsb_output_buffer *ob, char type, const hs_config *cf
     lsb_outputf(ob, "thread = %u\n", sbc->thread);
     lsb_outputf(ob, "process_message_inject_limit = %u\n", sbc->pm_im_limit);
     lsb_outputf(ob, "timer_event_inject_limit = %u\n", sbc->te_im_limit);
+    lsb_outputf(ob, "parallelism = %u\n", sbc->parallelism);
+    if (sbc->parallelism > 1) {
+      lsb_outputf(ob, "partition = %u\n", sbc->partition);
+    }
   }
 
   if (type == 'o') {
@@ -904,6 +1131,7 @@ bool hs_output_runtime_cfg(lsb_output_buffer *ob, char type, const hs_config *cf
       lsb_outputf(ob, "read_queue = \"both\"\n");
       break;
     }
+    lsb_outputf(ob, "start_time = %lld\n", sbc->start_time);
   }
 
   // just test the last write to make sure the buffer wasn't exhausted
@@ -17,6 +17,7 @@
 #define HS_EXT_LEN 4
 #define HS_MAX_PATH 260
 #define HS_MAX_ANALYSIS_THREADS 64
+#define HS_MAX_INPUT_SHARDS 64
 
 extern const char *hs_input_dir;
 extern const char *hs_analysis_dir;
@@ -35,24 +36,42 @@ typedef struct hs_sandbox_config
   char *cfg_name;
   char *cfg_lua;
   char *message_matcher; // analysis/output sandbox only
+  char *partition_key;   // analysis sandbox only (parallelism > 1)
 
   unsigned thread; // analysis sandbox only
+  unsigned parallelism; // analysis sandbox only, hash partitioned instances
+  unsigned partition;   // analysis sandbox only, instance being created
   unsigned async_buffer_size; // output sandbox only
   unsigned output_limit;
   unsigned memory_limit;
   unsigned instruction_limit;
   unsigned ticker_interval;
+  unsigned backpressure_weight;
 
   bool preserve_data;
   bool restricted_headers;
   bool shutdown_terminate;
   bool rm_cp_terminate;   // output sandbox only
+  bool partition_merge;   // analysis sandbox only, partials go to instance 0
 
   char     read_queue;    // output sandbox only
+  long long start_time;   // output sandbox only, seconds (< 0 relative)
   unsigned pm_im_limit;   // analysis sandbox only
   unsigned te_im_limit;   // analysis sandbox only
 } hs_sandbox_config;
 
+typedef struct hs_queue_config
+{
+  unsigned group_commit_bytes; // 0 disables group commit
+  unsigned group_commit_usec;
+  unsigned sync_interval_ms;
+  char     sync; // 'n' none, 'i' interval, 's' segment, 'c' checkpoint
+  char     compression; // 'n' none, 'l' lz4, 'z' zstd
+  bool     preallocate; // preallocated, memory mapped segments
+  bool     mmap_readers; // readers parse the mapped files in place
+  unsigned index_interval; // bytes between index entries, 0 disables
+} hs_queue_config;
+
 typedef struct hs_config
 {
   char *run_path;
@@ -75,13 +94,23 @@ typedef struct hs_config
   unsigned output_size;
   unsigned backpressure;
   unsigned backpressure_df;
+  unsigned analysis_prefetch; // decoded messages queued per analysis thread
+  unsigned clock_resolution; // coarse clock update interval (ms)
   int      pid;
   uint8_t  analysis_threads;
   uint8_t  analysis_utilization_limit;
+  uint8_t  analysis_rebalance; // utilization gap that triggers a migration
+  uint8_t  input_shards;
+  char     input_read_order; // 't' timestamp merge, 'r' round robin
+  bool     analysis_shared_reader; // one reader/decoder for all the threads
+  bool     analysis_dispatch; // index the matchers by their header equalities
 
   hs_sandbox_config ipd; // input plugin defaults
   hs_sandbox_config apd; // analysis plugin defaults
   hs_sandbox_config opd; // output plugin defaults
+
+  hs_queue_config iqc; // input queue
+  hs_queue_config aqc; // analysis queue
 } hs_config;
 
 
@@ -0,0 +1,431 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight message matcher dispatch index implementation @file */
+
+#include "hs_dispatch.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hs_logger.h"
+
+static const char g_module[] = "dispatch";
+
+typedef struct parser
+{
+  const char  *s;
+  bool        error;
+} parser;
+
+
+static void skip_space(parser *p)
+{
+  while (isspace((unsigned char)*p->s)) ++p->s;
+}
+
+
+static bool accept(parser *p, const char *token)
+{
+  skip_space(p);
+  size_t len = strlen(token);
+  if (strncmp(p->s, token, len) != 0) return false;
+  p->s += len;
+  return true;
+}
+
+
+/**
+ * Skips a quoted string or regex literal
+ *
+ * @return bool True if the literal contains an escape sequence
+ */
+static bool skip_literal(parser *p, char delim)
+{
+  bool escaped = false;
+  for (++p->s; *p->s && *p->s != delim; ++p->s) {
+    if (*p->s == '\\' && p->s[1]) {
+      escaped = true;
+      ++p->s;
+    }
+  }
+  if (*p->s) {
+    ++p->s;
+  } else {
+    p->error = true;
+  }
+  return escaped;
+}
+
+
+static bool is_name_char(char c)
+{
+  return isalnum((unsigned char)c) || c == '_' || c == '.' || c == '-'
+      || c == '+';
+}
+
+
+static void free_keys(hs_dispatch_key *items, int cnt)
+{
+  for (int i = 0; i < cnt; ++i) {
+    free(items[i].value);
+  }
+}
+
+
+static void free_key_set(hs_dispatch_keys *keys)
+{
+  free_keys(keys->items, keys->cnt);
+  free(keys->items);
+  keys->items = NULL;
+  keys->cnt = 0;
+}
+
+
+static bool parse_or(parser *p, hs_dispatch_keys *keys);
+
+
+/**
+ * Parses a parenthesized expression, a boolean constant or a relational
+ * expression
+ *
+ * @return bool True if keys were found (otherwise the term can be true for any
+ *         message)
+ */
+static bool parse_term(parser *p, hs_dispatch_keys *keys)
+{
+  keys->items = NULL;
+  keys->cnt = 0;
+  if (accept(p, "(")) {
+    bool indexed = parse_or(p, keys);
+    if (!accept(p, ")")) p->error = true;
+    return indexed && !p->error;
+  }
+
+  skip_space(p);
+  const char *name = p->s;
+  while (is_name_char(*p->s)) ++p->s;
+  while (*p->s == '[') { // Fields[name][fi][ai]
+    while (*p->s && *p->s != ']') ++p->s;
+    if (*p->s) ++p->s;
+  }
+  size_t nlen = p->s - name;
+  if (nlen == 0) {
+    p->error = true;
+    return false;
+  }
+
+  const char *op = NULL;
+  static const char *ops[] = { "==", "!=", ">=", "<=", "=~", "!~", ">", "<" };
+  for (size_t i = 0; i < sizeof(ops) / sizeof(*ops); ++i) {
+    if (accept(p, ops[i])) {
+      op = ops[i];
+      break;
+    }
+  }
+  if (!op) return false; // TRUE or FALSE
+
+  skip_space(p);
+  const char *value = p->s;
+  bool escaped = false;
+  char delim = *p->s;
+  if (delim == '"' || delim == '\'' || delim == '/') {
+    escaped = skip_literal(p, delim);
+  } else {
+    delim = 0;
+    while (is_name_char(*p->s)) ++p->s;
+  }
+  if (p->error || p->s == value) {
+    p->error = true;
+    return false;
+  }
+
+  char field = 0;
+  if (nlen == 4 && strncmp(name, "Type", nlen) == 0) {
+    field = 'T';
+  } else if (nlen == 6 && strncmp(name, "Logger", nlen) == 0) {
+    field = 'L';
+  } else if (nlen == 8 && strncmp(name, "Hostname", nlen) == 0) {
+    field = 'H';
+  }
+  if (!field || op[0] != '=' || op[1] != '=' || delim == '/' || !delim
+      || escaped) {
+    return false;
+  }
+
+  keys->items = malloc(sizeof(hs_dispatch_key));
+  size_t len = p->s - value - 2;
+  if (!keys->items || !(keys->items[0].value = malloc(len + 1))) {
+    hs_log(NULL, g_module, 0, "key allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(keys->items[0].value, value + 1, len);
+  keys->items[0].value[len] = 0;
+  keys->items[0].len = len;
+  keys->items[0].field = field;
+  keys->cnt = 1;
+  return true;
+}
+
+
+/**
+ * A conjunction can only be true when its most selective indexed term is
+ */
+static bool parse_and(parser *p, hs_dispatch_keys *keys)
+{
+  bool indexed = parse_term(p, keys);
+  while (!p->error && accept(p, "&&")) {
+    hs_dispatch_keys term;
+    bool ti = parse_term(p, &term);
+    if (ti && (!indexed || term.cnt < keys->cnt)) {
+      free_key_set(keys);
+      *keys = term;
+      indexed = true;
+    } else {
+      free_key_set(&term);
+    }
+  }
+  return indexed && !p->error;
+}
+
+
+/**
+ * A disjunction can only be true when one of its terms is, every term must be
+ * indexed
+ */
+static bool parse_or(parser *p, hs_dispatch_keys *keys)
+{
+  bool indexed = parse_and(p, keys);
+  while (!p->error && accept(p, "||")) {
+    hs_dispatch_keys term;
+    bool ti = parse_and(p, &term);
+    if (indexed && ti && keys->cnt + term.cnt <= HS_DISPATCH_MAX_KEYS) {
+      hs_dispatch_key *tmp = realloc(keys->items, sizeof(hs_dispatch_key)
+                                     * (keys->cnt + term.cnt));
+      if (!tmp) {
+        hs_log(NULL, g_module, 0, "keys realloc failed");
+        exit(EXIT_FAILURE);
+      }
+      keys->items = tmp;
+      memcpy(keys->items + keys->cnt, term.items,
+             sizeof(hs_dispatch_key) * term.cnt);
+      keys->cnt += term.cnt;
+      free(term.items);
+    } else {
+      indexed = false;
+      free_key_set(&term);
+    }
+  }
+  if (!indexed) free_key_set(keys);
+  return indexed && !p->error;
+}
+
+
+static unsigned hash_key(char field, const char *value, size_t len)
+{
+  unsigned h = 2166136261u; // FNV-1a
+  h = (h ^ (unsigned char)field) * 16777619u;
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ (unsigned char)value[i]) * 16777619u;
+  }
+  return h;
+}
+
+
+static hs_dispatch_entry* find_entry(const hs_dispatch *d, char field,
+                                     const char *value, size_t len,
+                                     unsigned hash)
+{
+  if (!d->entries_cap) return NULL;
+
+  size_t mask = d->entries_cap - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    hs_dispatch_entry *e = &d->entries[i];
+    if (!e->key.value) return e;
+    if (e->hash == hash && e->key.field == field && e->key.len == len
+        && memcmp(e->key.value, value, len) == 0) {
+      return e;
+    }
+  }
+}
+
+
+static void grow_entries(hs_dispatch *d)
+{
+  hs_dispatch_entry *old = d->entries;
+  size_t old_cap = d->entries_cap;
+  d->entries_cap = old_cap ? old_cap * 2 : 64;
+  d->entries = calloc(d->entries_cap, sizeof(hs_dispatch_entry));
+  if (!d->entries) {
+    hs_log(NULL, g_module, 0, "entries calloc failed");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < old_cap; ++i) {
+    hs_dispatch_entry *e = &old[i];
+    if (!e->key.value) continue;
+    *find_entry(d, e->key.field, e->key.value, e->key.len, e->hash) = *e;
+  }
+  free(old);
+}
+
+
+static void grow_slots(hs_dispatch *d, int slot)
+{
+  if (slot < d->slots_cap) return;
+
+  int cap = slot + 1;
+  hs_dispatch_slot *tmp = realloc(d->slots, sizeof(hs_dispatch_slot) * cap);
+  if (!tmp) {
+    hs_log(NULL, g_module, 0, "slots realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  memset(tmp + d->slots_cap, 0,
+         sizeof(hs_dispatch_slot) * (cap - d->slots_cap));
+  d->slots = tmp;
+  d->slots_cap = cap;
+}
+
+
+static void add_entry_slot(hs_dispatch *d, const hs_dispatch_key *k, int slot)
+{
+  if ((d->entries_cnt + 1) * 2 > d->entries_cap) grow_entries(d);
+
+  unsigned hash = hash_key(k->field, k->value, k->len);
+  hs_dispatch_entry *e = find_entry(d, k->field, k->value, k->len, hash);
+  if (!e->key.value) {
+    e->key.field = k->field;
+    e->key.len = k->len;
+    e->key.value = malloc(k->len + 1);
+    if (!e->key.value) {
+      hs_log(NULL, g_module, 0, "key malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(e->key.value, k->value, k->len + 1);
+    e->hash = hash;
+    ++d->entries_cnt;
+  }
+  for (int i = 0; i < e->cnt; ++i) {
+    if (e->slots[i] == slot) return; // Type == 'a' || Type == 'a'
+  }
+  if (e->cnt == e->cap) {
+    int cap = e->cap ? e->cap * 2 : 4;
+    int *tmp = realloc(e->slots, sizeof(int) * cap);
+    if (!tmp) {
+      hs_log(NULL, g_module, 0, "entry realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    e->slots = tmp;
+    e->cap = cap;
+  }
+  e->slots[e->cnt++] = slot;
+}
+
+
+static void select_entry(hs_dispatch *d, char field, const lsb_const_string *s)
+{
+  if (!s->s) return;
+
+  hs_dispatch_entry *e = find_entry(d, field, s->s, s->len,
+                                    hash_key(field, s->s, s->len));
+  if (!e) return;
+  for (int i = 0; i < e->cnt; ++i) {
+    d->slots[e->slots[i]].mark = d->gen;
+  }
+}
+
+
+void hs_parse_dispatch_keys(hs_dispatch_keys *keys, const char *matcher)
+{
+  parser p = { .s = matcher, .error = false };
+  bool indexed = parse_or(&p, keys);
+  skip_space(&p);
+  if (!indexed || p.error || *p.s) free_key_set(keys);
+}
+
+
+void hs_free_dispatch_keys(hs_dispatch_keys *keys)
+{
+  free_key_set(keys);
+}
+
+
+void hs_init_dispatch(hs_dispatch *d)
+{
+  d->entries = NULL;
+  d->entries_cap = 0;
+  d->entries_cnt = 0;
+  d->slots = NULL;
+  d->slots_cap = 0;
+  d->gen = 1;
+}
+
+
+void hs_free_dispatch(hs_dispatch *d)
+{
+  for (size_t i = 0; i < d->entries_cap; ++i) {
+    free(d->entries[i].key.value);
+    free(d->entries[i].slots);
+  }
+  free(d->entries);
+  free(d->slots);
+  hs_init_dispatch(d);
+}
+
+
+void hs_add_dispatch(hs_dispatch *d, int slot, const hs_dispatch_keys *keys)
+{
+  grow_slots(d, slot);
+  d->slots[slot].mark = 0;
+  d->slots[slot].residual = keys->cnt == 0;
+  for (int i = 0; i < keys->cnt; ++i) {
+    add_entry_slot(d, &keys->items[i], slot);
+  }
+}
+
+
+void hs_remove_dispatch(hs_dispatch *d, int slot,
+                        const hs_dispatch_keys *keys)
+{
+  // the emptied entries are kept, the key space of a thread is small
+  for (int i = 0; i < keys->cnt; ++i) {
+    const hs_dispatch_key *k = &keys->items[i];
+    hs_dispatch_entry *e = find_entry(d, k->field, k->value, k->len,
+                                      hash_key(k->field, k->value, k->len));
+    if (!e) continue;
+    for (int j = 0; j < e->cnt; ++j) {
+      if (e->slots[j] == slot) {
+        e->slots[j] = e->slots[--e->cnt];
+        break;
+      }
+    }
+  }
+  if (slot < d->slots_cap) {
+    d->slots[slot].mark = 0;
+    d->slots[slot].residual = false;
+  }
+}
+
+
+void hs_select_dispatch(hs_dispatch *d, const lsb_heka_message *m)
+{
+  if (++d->gen == 0) { // wrapped, clear the stale marks
+    for (int i = 0; i < d->slots_cap; ++i) {
+      d->slots[i].mark = 0;
+    }
+    d->gen = 1;
+  }
+  select_entry(d, 'T', &m->type);
+  select_entry(d, 'L', &m->logger);
+  select_entry(d, 'H', &m->hostname);
+}
+
+
+bool hs_dispatch_selected(const hs_dispatch *d, int slot)
+{
+  return slot >= d->slots_cap || d->slots[slot].residual
+      || d->slots[slot].mark == d->gen;
+}
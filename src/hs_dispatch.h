@@ -0,0 +1,113 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Hindsight message matcher dispatch index @file */
+
+#ifndef hs_dispatch_h_
+#define hs_dispatch_h_
+
+#include <luasandbox/util/heka_message.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HS_DISPATCH_MAX_KEYS 32 // per matcher, more are treated as residual
+
+// Header equality a message must satisfy for the matcher to be true
+typedef struct hs_dispatch_key
+{
+  char    field; // 'T'ype, 'L'ogger or 'H'ostname
+  char    *value;
+  size_t  len;
+} hs_dispatch_key;
+
+// A matcher can only be true when one of its keys is (an empty set is a
+// residual matcher that has to be evaluated for every message)
+typedef struct hs_dispatch_keys
+{
+  hs_dispatch_key *items;
+  int             cnt;
+} hs_dispatch_keys;
+
+typedef struct hs_dispatch_entry
+{
+  hs_dispatch_key key;  // value NULL when the hash slot is unused
+  unsigned        hash;
+  int             *slots;
+  int             cnt;
+  int             cap;
+} hs_dispatch_entry;
+
+typedef struct hs_dispatch_slot
+{
+  unsigned  mark;      // generation of the last message that selected it
+  bool      residual;
+} hs_dispatch_slot;
+
+// Per analysis thread index of the plugin list slots by the Type, Logger and
+// Hostname equalities of their matchers
+typedef struct hs_dispatch
+{
+  hs_dispatch_entry *entries;  // open addressing, power of two capacity
+  size_t            entries_cap;
+  size_t            entries_cnt;
+  hs_dispatch_slot  *slots;    // indexed by the plugin list slot
+  int               slots_cap;
+  unsigned          gen;
+} hs_dispatch;
+
+/**
+ * Extracts the dispatch keys of a message matcher expression, the expression
+ * must already have been validated by lsb_create_message_matcher
+ *
+ * @param keys Result (the items must be freed with hs_free_dispatch_keys)
+ * @param matcher Message matcher expression
+ */
+void hs_parse_dispatch_keys(hs_dispatch_keys *keys, const char *matcher);
+
+void hs_free_dispatch_keys(hs_dispatch_keys *keys);
+
+void hs_init_dispatch(hs_dispatch *d);
+
+void hs_free_dispatch(hs_dispatch *d);
+
+/**
+ * Indexes a plugin list slot
+ *
+ * @param d Dispatch index
+ * @param slot Plugin list slot
+ * @param keys Keys of the slot's matcher
+ */
+void hs_add_dispatch(hs_dispatch *d, int slot, const hs_dispatch_keys *keys);
+
+/**
+ * Removes a plugin list slot from the index
+ *
+ * @param d Dispatch index
+ * @param slot Plugin list slot
+ * @param keys Keys the slot was added with
+ */
+void hs_remove_dispatch(hs_dispatch *d, int slot,
+                        const hs_dispatch_keys *keys);
+
+/**
+ * Selects the slots whose matchers can be true for the message
+ *
+ * @param d Dispatch index
+ * @param m Decoded message
+ */
+void hs_select_dispatch(hs_dispatch *d, const lsb_heka_message *m);
+
+/**
+ * Tests if a slot was selected by the last hs_select_dispatch
+ *
+ * @param d Dispatch index
+ * @param slot Plugin list slot
+ *
+ * @return bool True if the slot's matcher has to be evaluated
+ */
+bool hs_dispatch_selected(const hs_dispatch *d, int slot);
+
+#endif
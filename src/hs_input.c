@@ -8,23 +8,409 @@
 
 #include "hs_input.h"
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <luasandbox/util/heka_message.h>
 #include <luasandbox/lauxlib.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "hs_catalog.h"
 #include "hs_logger.h"
+#include "hs_output.h"
 #include "hs_util.h"
 
 static const char g_module[] = "input_reader";
 
-bool hs_open_file(hs_input *hsi, const char *subdir, unsigned long long id)
+
+static void reset_readahead(hs_input *hsi)
+{
+  if (hsi->ra_pending) {
+    hs_uring_wait(hsi->uring);
+    hsi->ra_pending = false;
+  }
+  hsi->ra_offset = 0;
+  hsi->ra_pos = 0;
+  hsi->ra_len = 0;
+}
+
+
+static void disable_uring(hs_input *hsi)
+{
+  hs_log(NULL, g_module, 4, "%s io_uring disabled, using stdio", hsi->name);
+  reset_readahead(hsi);
+  hs_destroy_uring(hsi->uring);
+  hsi->uring = NULL;
+}
+
+
+/**
+ * Returns the length of the valid data in the file; a preallocated segment
+ * records it in its trailer, for a plain log it is the file size.
+ */
+static size_t find_data_end(hs_input *hsi)
+{
+  struct stat st;
+  int fd = fileno(hsi->fh);
+  if (fstat(fd, &st)) return hsi->data_end;
+
+  hs_segment_trailer t;
+  size_t size = (size_t)st.st_size;
+  if (size > sizeof(t)
+      && pread(fd, &t, sizeof(t), size - sizeof(t)) == sizeof(t)
+      && t.magic == HS_SEGMENT_MAGIC
+      && t.end <= size - sizeof(t)) {
+    return (size_t)t.end;
+  }
+  return size;
+}
+
+
+static ssize_t fill_readahead(hs_input *hsi, size_t offset)
+{
+  int ret = hs_uring_read(hsi->uring, offset);
+  if (ret) return ret;
+  hsi->ra_pending = true;
+  hsi->ra_offset = offset;
+  hsi->ra_pos = 0;
+  hsi->ra_len = 0;
+  hsi->ra_limit = hsi->data_end;
+  return 0;
+}
+
+
+static size_t readahead_length(hs_input *hsi, ssize_t n)
+{
+  // anything past the end of the data at the time of the read is not valid
+  size_t end = hsi->ra_offset + (size_t)n;
+  if (end > hsi->ra_limit) {
+    return hsi->ra_limit > hsi->ra_offset ? hsi->ra_limit - hsi->ra_offset : 0;
+  }
+  return (size_t)n;
+}
+
+
+/**
+ * Copies data from the registered readahead buffer, refilling it
+ * synchronously when it does not cover the checkpoint offset and queuing the
+ * next read asynchronously once it has been consumed.
+ *
+ * @return ssize_t Bytes copied or -errno
+ */
+static ssize_t read_uring(hs_input *hsi, char *dst, size_t len)
+{
+  size_t size;
+  const char *buf = hs_uring_buffer(hsi->uring, &size);
+
+  if (!hsi->ra_pending && (hsi->ra_pos == hsi->ra_len
+                           || hsi->ra_offset + hsi->ra_pos != hsi->cp.offset)) {
+    ssize_t ret = fill_readahead(hsi, hsi->cp.offset);
+    if (ret) return ret;
+  }
+  if (hsi->ra_pending) {
+    ssize_t n = hs_uring_wait(hsi->uring);
+    hsi->ra_pending = false;
+    if (n < 0) return n;
+    hsi->ra_len = readahead_length(hsi, n);
+    if (hsi->ra_offset != hsi->cp.offset) { // stale readahead, read again
+      ssize_t ret = fill_readahead(hsi, hsi->cp.offset);
+      if (ret) return ret;
+      hsi->ra_pending = false;
+      n = hs_uring_wait(hsi->uring);
+      if (n < 0) return n;
+      hsi->ra_len = readahead_length(hsi, n);
+    }
+  }
+
+  size_t avail = hsi->ra_len - hsi->ra_pos;
+  if (len > avail) len = avail;
+  memcpy(dst, buf + hsi->ra_pos, len);
+  hsi->ra_pos += len;
+
+  if (hsi->ra_pos == size) { // a full buffer was consumed, keep reading ahead
+    ssize_t ret = fill_readahead(hsi, hsi->ra_offset + size);
+    if (ret) return ret;
+  }
+  return (ssize_t)len;
+}
+
+
+/**
+ * Stops viewing the mapped file, anything left in the view belonged to it and
+ * is discarded.
+ */
+static void unmap_file(hs_input *hsi)
+{
+  if (hsi->ib_buf) {
+    hsi->ib.buf = hsi->ib_buf;
+    hsi->ib.size = hsi->ib_size;
+    hsi->ib.readpos = 0;
+    hsi->ib.scanpos = 0;
+    hsi->ib.msglen = 0;
+    hsi->ib_buf = NULL;
+  }
+  if (hsi->map) {
+    munmap(hsi->map, hsi->map_size);
+    hsi->map = NULL;
+    hsi->map_size = 0;
+  }
+}
+
+
+/**
+ * Extends the input buffer view over the mapped file to the end of the valid
+ * data, the file is remapped when it has outgrown the mapping.
+ */
+static size_t read_map(hs_input *hsi)
+{
+  lsb_input_buffer *ib = &hsi->ib;
+  if (hsi->cp.offset >= hsi->data_end) {
+    hsi->data_end = find_data_end(hsi);
+    if (hsi->cp.offset >= hsi->data_end) return 0;
+  }
+
+  if (hsi->data_end > hsi->map_size) {
+    // the pages past the end of the file are never touched
+    size_t size = (hsi->data_end + HS_INPUT_MAP_SIZE - 1) / HS_INPUT_MAP_SIZE
+        * HS_INPUT_MAP_SIZE;
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(hsi->fh), 0);
+    if (map == MAP_FAILED) {
+      hs_log(NULL, g_module, 0, "%s file: %s mmap failed: %s", hsi->name,
+             hsi->fn, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+    if (hsi->map) munmap(hsi->map, hsi->map_size);
+    hsi->map = map;
+    hsi->map_size = size;
+  }
+
+  if (!hsi->ib_buf) {
+    hsi->ib_buf = ib->buf;
+    hsi->ib_size = ib->size;
+    ib->readpos = 0;
+    ib->scanpos = 0;
+    ib->msglen = 0;
+  }
+  // the buffer starts readpos bytes before the file position, this also
+  // follows the parser when it discards a buffer without a message header
+  ib->buf = hsi->map + (hsi->cp.offset - ib->readpos);
+  size_t nread = hsi->data_end - hsi->cp.offset;
+  ib->readpos += nread;
+  ib->size = ib->readpos;
+  hsi->cp.offset = hsi->data_end;
+  return nread;
+}
+
+
+static void grow_buffer(hs_input *hsi, char **buf, size_t *size, size_t len)
+{
+  if (len <= *size) return;
+
+  char *tmp = realloc(*buf, len);
+  if (!tmp) {
+    hs_log(NULL, g_module, 0, "%s block buffer realloc failed", hsi->name);
+    exit(EXIT_FAILURE);
+  }
+  *buf = tmp;
+  *size = len;
+}
+
+
+static bool data_available(hs_input *hsi, size_t end)
+{
+  if (end > hsi->data_end) {
+    hsi->data_end = find_data_end(hsi);
+    if (end > hsi->data_end) return false;
+  }
+  return true;
+}
+
+
+static bool read_header(hs_input *hsi, off_t pos, hs_block_header *h)
+{
+  if (!data_available(hsi, (size_t)pos + sizeof(*h))) return false;
+  if (pread(fileno(hsi->fh), h, sizeof(*h), pos) != sizeof(*h)) return false;
+  if (h->magic != HS_BLOCK_MAGIC) {
+    hs_log(NULL, g_module, 2, "%s file: %s corrupt block at: %lld, skipping "
+           "the rest of the file", hsi->name, hsi->fn, (long long)pos);
+    hsi->format = 'x';
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Finds the block holding the checkpoint offset, the part of it before the
+ * checkpoint is discarded when it is decompressed.
+ */
+static void seek_block(hs_input *hsi)
+{
+  hs_block_header h;
+  off_t pos = 0;
+  size_t offset = 0;
+  while (offset < hsi->cp.offset && read_header(hsi, pos, &h)
+         && offset + h.raw_len <= hsi->cp.offset) {
+    pos += sizeof(h) + h.len;
+    offset += h.raw_len;
+  }
+  hsi->block_next = pos;
+  hsi->block_skip = hsi->cp.offset - offset;
+}
+
+
+static bool detect_format(hs_input *hsi)
+{
+  uint32_t magic;
+  if (!data_available(hsi, sizeof(magic))) return false;
+  if (pread(fileno(hsi->fh), &magic, sizeof(magic), 0) != sizeof(magic)) {
+    return false;
+  }
+  if (magic == HS_BLOCK_MAGIC) {
+    hsi->format = 'b';
+    seek_block(hsi);
+  } else {
+    hsi->format = 'p';
+  }
+  return true;
+}
+
+
+/**
+ * Reads and decompresses the next complete block
+ *
+ * @return bool False if no complete block is available
+ */
+static bool next_block(hs_input *hsi)
+{
+  hs_block_header h;
+  off_t pos = hsi->block_next;
+  if (!read_header(hsi, pos, &h)) return false;
+  if (!data_available(hsi, (size_t)pos + sizeof(h) + h.len)) return false;
+
+  grow_buffer(hsi, &hsi->zbuf, &hsi->zbuf_size, h.len);
+  grow_buffer(hsi, &hsi->block, &hsi->block_size, h.raw_len);
+  hsi->block_next = pos + sizeof(h) + h.len;
+  // the bytes before the checkpoint are already part of its offset
+  size_t skip = hsi->block_skip < h.raw_len ? hsi->block_skip : h.raw_len;
+  hsi->block_skip -= skip;
+  hsi->block_len = h.raw_len;
+  hsi->block_pos = skip;
+  if (pread(fileno(hsi->fh), hsi->zbuf, h.len, pos + sizeof(h)) != h.len
+      || hs_decompress((char)h.codec, hsi->zbuf, h.len, hsi->block,
+                       h.raw_len)) {
+    hs_log(NULL, g_module, 2, "%s file: %s unable to decompress the block at: "
+           "%lld, discarding %u bytes", hsi->name, hsi->fn, (long long)pos,
+           h.raw_len);
+    hsi->cp.offset += h.raw_len - skip;
+    hsi->block_len = 0;
+    hsi->block_pos = 0;
+  }
+  return true;
+}
+
+
+static size_t read_blocks(hs_input *hsi, char *dst, size_t len)
+{
+  while (hsi->block_pos == hsi->block_len) {
+    if (!next_block(hsi)) return 0;
+  }
+  size_t avail = hsi->block_len - hsi->block_pos;
+  if (len > avail) len = avail;
+  memcpy(dst, hsi->block + hsi->block_pos, len);
+  hsi->block_pos += len;
+  return len;
+}
+
+
+/**
+ * Moves on to the next queue file once the current one has been read to the
+ * end.
+ *
+ * @return bool True if a new file was opened
+ */
+static bool next_file(hs_input *hsi, const hs_config *cfg, time_t t)
+{
+#ifdef HINDSIGHT_CLI
+  (void)t;
+  if (hsi->cp.offset < cfg->output_size && hsi->format != 'x') return false;
+  return hs_open_file(hsi, hsi->cp.id + 1);
+#else
+  // When the read gets to the end it will always check once for the next
+  // available file just incase the output_size was increased on the last
+  // restart.
+  if (hsi->cp.offset < cfg->output_size && !hsi->next
+      && hsi->format != 'x') {
+    return false;
+  }
+  if (t == hsi->timer) return false;
+
+  hsi->timer = t;
+  hsi->next = hs_open_file(hsi, hsi->cp.id + 1);
+  if (hsi->next) {
+    hsi->wait_cnt = 0;
+  } else if (++hsi->wait_cnt > 60 || hsi->cp.offset < cfg->output_size) {
+    size_t next_id = hs_find_next_id(cfg->output_path, hsi->subdir,
+                                     hsi->cp.id);
+    if (next_id > hsi->cp.id + 1) {
+      hs_log(NULL, g_module, 3, "%s the %s checkpoint skipped %zu missing files",
+             hsi->name, hsi->subdir, next_id - hsi->cp.id - 1);
+      hsi->next = hs_open_file(hsi, next_id);
+      if (!hsi->next) {
+        hs_log(NULL, g_module, 2, "%s unable to open %s queue file: %zu",
+               hsi->name, hsi->subdir, next_id);
+      }
+    }
+    hsi->wait_cnt = 0;
+  }
+  return hsi->next;
+#endif
+}
+
+
+static hs_input_status first_file(hs_input *hsi, const hs_config *cfg,
+                                  hs_checkpoint_reader *cpr, time_t t)
+{
+#ifdef HINDSIGHT_CLI
+  (void)cfg;
+  (void)cpr;
+  (void)t;
+  return hs_open_file(hsi, hsi->cp.id) ? HS_INPUT_DATA : HS_INPUT_IDLE;
+#else
+  if (t == hsi->timer) return HS_INPUT_IDLE;
+
+  hs_input_status status = HS_INPUT_IDLE;
+  hsi->timer = t;
+  if (++hsi->wait_cnt > 60) { // the internal state is bad (manual prune?)
+    hs_lookup_input_checkpoint(cpr, hsi->subdir,
+                               NULL, // restart from the end
+                               cfg->output_path, &hsi->cp);
+    hs_log(NULL, g_module, 3, "%s the %s checkpoint was reset", hsi->name,
+           hsi->subdir);
+    hsi->wait_cnt = 0;
+    status = HS_INPUT_RESET;
+  }
+  hsi->next = hs_open_file(hsi, hsi->cp.id);
+  if (hsi->next) {
+    hsi->wait_cnt = 0;
+    if (status == HS_INPUT_IDLE) status = HS_INPUT_DATA;
+  }
+  return status;
+#endif
+}
+
+
+bool hs_open_file(hs_input *hsi, unsigned long long id)
 {
   char fqfn[HS_MAX_PATH];
-  int ret = snprintf(fqfn, sizeof(fqfn), "%s/%s/%llu.log", hsi->path, subdir,
-                     id);
+  int ret = snprintf(fqfn, sizeof(fqfn), "%s/%s/%llu.log", hsi->path,
+                     hsi->subdir, id);
   if (ret < 0 || ret > (int)sizeof(fqfn) - 1) {
     hs_log(NULL, g_module, 0, "%s file: %llu.log: fully qualiifed path is"
            " greater than %zu", hsi->name, hsi->cp.id, sizeof(fqfn));
@@ -37,6 +423,8 @@ bool hs_open_file(hs_input *hsi, const char *subdir, unsigned long long id)
     if (setvbuf(fh, NULL, _IONBF, 0)) {
       exit(EXIT_FAILURE);
     }
+    // queue files are read front to back once, widen the kernel readahead
+    posix_fadvise(fileno(fh), 0, 0, POSIX_FADV_SEQUENTIAL);
 
     if (hsi->cp.id == id && hsi->cp.offset) {
       hs_log(NULL, g_module, 7, "%s opened file: %s offset: %zu", hsi->name,
@@ -56,10 +444,23 @@ bool hs_open_file(hs_input *hsi, const char *subdir, unsigned long long id)
     if (hsi->fh) {
       fclose(hsi->fh);
     }
+    unmap_file(hsi);
+    if (hsi->uring) {
+      reset_readahead(hsi);
+      if (hs_uring_set_file(hsi->uring, fileno(fh))) {
+        disable_uring(hsi);
+      }
+    }
     if (hsi->cp.id != id) {
       hsi->cp.id = id;
       hsi->cp.offset = 0;
     }
+    hsi->data_end = 0;
+    hsi->format = 0;
+    hsi->block_len = 0;
+    hsi->block_pos = 0;
+    hsi->block_skip = 0;
+    hsi->block_next = 0;
     if (ret >= (int)hsi->fn_size) {
       free(hsi->fn);
       hsi->fn_size = (size_t)(ret + 1);
@@ -80,6 +481,9 @@ bool hs_open_file(hs_input *hsi, const char *subdir, unsigned long long id)
 
 size_t hs_read_file(hs_input *hsi)
 {
+  if (!hsi->format && !detect_format(hsi)) return 0;
+  if (hsi->format == 'p' && hsi->use_map) return read_map(hsi);
+
   lsb_input_buffer *ib = &hsi->ib;
   size_t need;
   if (ib->msglen) {
@@ -93,24 +497,369 @@ size_t hs_read_file(hs_input *hsi)
     hs_log(NULL, g_module, 0, "%s buffer reallocation failed", hsi->name);
     exit(EXIT_FAILURE);
   }
-  size_t nread = fread(ib->buf + ib->readpos,
-                       1,
-                       ib->size - ib->readpos,
-                       hsi->fh);
+  size_t len = ib->size - ib->readpos;
+  if (hsi->format != 'p') {
+    size_t nread = hsi->format == 'b' ? read_blocks(hsi, ib->buf + ib->readpos,
+                                                    len) : 0;
+    hsi->cp.offset += nread;
+    ib->readpos += nread;
+    return nread;
+  }
+
+  if (hsi->cp.offset + len > hsi->data_end) {
+    hsi->data_end = find_data_end(hsi);
+    if (hsi->cp.offset >= hsi->data_end) return 0;
+    if (hsi->cp.offset + len > hsi->data_end) {
+      len = hsi->data_end - hsi->cp.offset;
+    }
+  }
+
+  size_t nread = 0;
+  if (hsi->uring) {
+    ssize_t n = read_uring(hsi, ib->buf + ib->readpos, len);
+    if (n >= 0) {
+      nread = (size_t)n;
+    } else {
+      hs_log(NULL, g_module, 3, "%s io_uring read failed: %s", hsi->name,
+             strerror((int)-n));
+      disable_uring(hsi);
+    }
+  }
+  if (!nread && !hsi->uring) {
+    // positioned read, the readahead does not move the file offset
+    ssize_t n = pread(fileno(hsi->fh), ib->buf + ib->readpos, len,
+                      (off_t)hsi->cp.offset);
+    if (n > 0) nread = (size_t)n;
+  }
   hsi->cp.offset += nread;
   ib->readpos += nread;
   return nread;
 }
 
 
+static bool find_id_range(const hs_input *hsi, unsigned long long *first,
+                          unsigned long long *last)
+{
+  char dir[HS_MAX_PATH];
+  if (hs_get_fqfn(hsi->path, hsi->subdir, dir, sizeof(dir))) return false;
+  hs_catalog_ids ids;
+  if (hs_lookup_catalog(dir, 0, &ids)) {
+    *first = ids.first;
+    *last = ids.last;
+    return ids.cnt > 0;
+  }
+
+  DIR *dp = opendir(dir);
+  if (!dp) return false;
+
+  bool found = false;
+  unsigned long long id;
+  struct dirent *entry;
+  while ((entry = readdir(dp))) {
+    if (!hs_extract_id(entry->d_name, &id)) continue;
+    if (!found || id < *first) *first = id;
+    if (!found || id > *last) *last = id;
+    found = true;
+  }
+  closedir(dp);
+  return found;
+}
+
+
+static void get_index_fqfn(const hs_input *hsi, unsigned long long id,
+                           const char *ext, char *fqfn, size_t fqfn_len)
+{
+  int ret = snprintf(fqfn, fqfn_len, "%s/%s/%llu%s", hsi->path, hsi->subdir,
+                     id, ext);
+  if (ret < 0 || ret > (int)fqfn_len - 1) {
+    hs_log(NULL, g_module, 0, "%s file: %llu%s: fully qualiifed path is"
+           " greater than %zu", hsi->name, id, ext, fqfn_len);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static void append_entry(hs_index_entry **e, size_t *cnt, size_t *cap,
+                         int64_t timestamp, uint64_t offset)
+{
+  if (*cnt == *cap) {
+    size_t n = *cap ? *cap * 2 : 64;
+    hs_index_entry *tmp = realloc(*e, sizeof(hs_index_entry) * n);
+    if (!tmp) {
+      hs_log(NULL, g_module, 0, "index realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    *e = tmp;
+    *cap = n;
+  }
+  (*e)[*cnt].timestamp = timestamp;
+  (*e)[*cnt].offset = offset;
+  ++*cnt;
+}
+
+
+/**
+ * Rebuilds the index of a queue file by scanning it, a complete file gets the
+ * terminating entry and the index is saved so the file is only scanned once.
+ * The entries are interval bytes apart (HS_INDEX_INTERVAL when it is 0).
+ */
+static hs_index_entry* rebuild_index(const hs_input *hsi, unsigned long long id,
+                                     bool complete, unsigned interval,
+                                     size_t *cnt)
+{
+  hs_index_entry *e = NULL;
+  size_t cap = 0;
+  *cnt = 0;
+
+  hs_input scan;
+  hs_init_input(&scan, hsi->ib.maxsize, hsi->path, hsi->subdir, hsi->name,
+                true);
+  scan.cp.id = id;
+  if (!hs_open_file(&scan, id)) {
+    hs_free_input(&scan);
+    return NULL;
+  }
+
+  size_t discarded_bytes;
+  lsb_logger logger = { .context = NULL, .cb = hs_log };
+  int64_t max = INT64_MIN;
+  hs_checkpoint cp = { id, 0 };
+  uint64_t last = 0;
+  for (;;) {
+    if (lsb_find_heka_message(&scan.msg, &scan.ib, true, &discarded_bytes,
+                              &logger)) {
+      hs_consume_input(&scan, &cp);
+      if (scan.msg.timestamp > max) max = scan.msg.timestamp;
+      if (cp.offset - last >= (interval ? interval : HS_INDEX_INTERVAL)) {
+        append_entry(&e, cnt, &cap, max, cp.offset);
+        last = cp.offset;
+      }
+    } else if (!hs_read_file(&scan)) {
+      break;
+    }
+  }
+  hs_free_input(&scan);
+  if (!complete) return e;
+
+  if (last != cp.offset) append_entry(&e, cnt, &cap, max, cp.offset);
+  append_entry(&e, cnt, &cap, max, UINT64_MAX);
+
+  char tmp[HS_MAX_PATH];
+  char fqfn[HS_MAX_PATH];
+  get_index_fqfn(hsi, id, ".idx.tmp", tmp, sizeof(tmp));
+  get_index_fqfn(hsi, id, ".idx", fqfn, sizeof(fqfn));
+  FILE *fh = fopen(tmp, "we");
+  if (fh) {
+    bool ok = fwrite(e, sizeof(hs_index_entry), *cnt, fh) == *cnt;
+    if (!fclose(fh) && ok && !rename(tmp, fqfn)) {
+      hs_log(NULL, g_module, 7, "%s rebuilt index: %s", hsi->name, fqfn);
+    } else {
+      unlink(tmp);
+    }
+  }
+  return e;
+}
+
+
+static hs_index_entry* load_index(const hs_input *hsi, unsigned long long id,
+                                  bool complete, unsigned interval, size_t *cnt)
+{
+  char fqfn[HS_MAX_PATH];
+  get_index_fqfn(hsi, id, ".idx", fqfn, sizeof(fqfn));
+  FILE *fh = fopen(fqfn, "re");
+  if (!fh) return rebuild_index(hsi, id, complete, interval, cnt);
+
+  hs_index_entry *e = NULL;
+  size_t cap = 0;
+  hs_index_entry entry;
+  *cnt = 0;
+  while (fread(&entry, sizeof(entry), 1, fh) == 1) {
+    append_entry(&e, cnt, &cap, entry.timestamp, entry.offset);
+  }
+  fclose(fh);
+  if (complete && (*cnt == 0 || e[*cnt - 1].offset != UINT64_MAX)) {
+    // truncated (the writer crashed), it cannot tell if the file is older
+    free(e);
+    return rebuild_index(hsi, id, complete, interval, cnt);
+  }
+  return e;
+}
+
+
+/**
+ * A complete file is older than ns when everything in it (the terminating
+ * entry's running max) precedes ns, a pruned file is always older
+ */
+static bool older_file(const hs_input *hsi, unsigned long long id,
+                       long long ns, unsigned interval)
+{
+  size_t cnt;
+  hs_index_entry *e = load_index(hsi, id, true, interval, &cnt);
+  if (!e) return true;
+  bool older = e[cnt - 1].offset == UINT64_MAX && e[cnt - 1].timestamp < ns;
+  free(e);
+  return older;
+}
+
+
+bool hs_seek_input(hs_input *hsi, long long ns, unsigned index_interval)
+{
+  unsigned long long first, last;
+  if (!find_id_range(hsi, &first, &last)) return false;
+
+  // binary search the complete files for the first one that is not older,
+  // only its index and the ones probed on the way are loaded
+  unsigned long long lo = first, hi = last;
+  while (lo < hi) {
+    unsigned long long mid = lo + (hi - lo) / 2;
+    if (older_file(hsi, mid, ns, index_interval)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  hs_checkpoint pos = { lo, 0 };
+  for (unsigned long long id = lo; id <= last; ++id) {
+    size_t cnt;
+    hs_index_entry *e = load_index(hsi, id, id < last, index_interval, &cnt);
+    if (!e) continue; // pruned or empty
+    // the first entry that is not older than ns
+    size_t lo = 0, hi = cnt;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (e[mid].timestamp < ns) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    bool done = true;
+    pos.id = id;
+    pos.offset = 0;
+    if (lo > 0) {
+      if (e[lo - 1].offset == UINT64_MAX) { // the whole file is older
+        pos.offset = lo > 1 ? e[lo - 2].offset : 0;
+        done = false;
+      } else {
+        pos.offset = e[lo - 1].offset;
+      }
+    }
+    free(e);
+    if (done) break;
+  }
+
+  if (hsi->fh) fclose(hsi->fh);
+  hsi->fh = NULL;
+  unmap_file(hsi);
+  free(hsi->fn);
+  hsi->fn = NULL;
+  hsi->fn_size = 0;
+  hsi->ib.readpos = 0;
+  hsi->ib.scanpos = 0;
+  hsi->ib.msglen = 0;
+  hsi->pending = false;
+  hsi->cp = pos;
+  hsi->seek_ns = ns;
+  hs_log(NULL, g_module, 7, "%s seek: %lld positioned at: %llu:%zu",
+         hsi->name, ns, pos.id, pos.offset);
+  hs_open_file(hsi, pos.id); // retried by hs_poll_input if it fails
+  return true;
+}
+
+
+hs_input_status hs_poll_input(hs_input *hsi, const hs_config *cfg,
+                              hs_checkpoint_reader *cpr, time_t t)
+{
+  if (hsi->pending) return HS_INPUT_MESSAGE;
+  if (!hsi->fh) return first_file(hsi, cfg, cpr, t);
+
+  size_t discarded_bytes;
+  lsb_logger logger = { .context = NULL, .cb = hs_log };
+  bool decode = hsi->decode || hsi->seek_ns != LLONG_MIN;
+  while (lsb_find_heka_message(&hsi->msg, &hsi->ib, decode, &discarded_bytes,
+                               &logger)) {
+    if (!decode) { // the shards are still merged by timestamp
+      hsi->msg.timestamp = hs_message_timestamp(hsi->msg.raw.s,
+                                                hsi->msg.raw.len);
+    }
+    if (hsi->msg.timestamp < hsi->seek_ns) continue; // before the seek time
+    hsi->seek_ns = LLONG_MIN;
+    hsi->pending = true;
+    return HS_INPUT_MESSAGE;
+  }
+  if (hs_read_file(hsi)) return HS_INPUT_DATA;
+  return next_file(hsi, cfg, t) ? HS_INPUT_DATA : HS_INPUT_IDLE;
+}
+
+
+void hs_consume_input(hs_input *hsi, hs_checkpoint *cp)
+{
+  hsi->pending = false;
+  cp->id = hsi->cp.id;
+  cp->offset = hsi->cp.offset - (hsi->ib.readpos - hsi->ib.scanpos);
+}
+
+
+hs_input* hs_select_input(hs_input *list, int cnt, char order, int *rr)
+{
+  hs_input *hsi = NULL;
+  if (order == 'r') {
+    for (int i = 0; i < cnt; ++i) {
+      int idx = (*rr + i) % cnt;
+      if (list[idx].pending) {
+        *rr = (idx + 1) % cnt;
+        return &list[idx];
+      }
+    }
+    return NULL;
+  }
+
+  for (int i = 0; i < cnt; ++i) {
+    if (list[i].pending
+        && (!hsi || list[i].msg.timestamp < hsi->msg.timestamp)) {
+      hsi = &list[i];
+    }
+  }
+  return hsi;
+}
+
+
 void hs_init_input(hs_input *hsi, size_t max_message_size, const char *path,
-                   const char *name)
+                   const char *subdir, const char *name, bool use_map)
 {
   hsi->fh = NULL;
   hsi->fn = NULL;
   hsi->fn_size = 0;
   hsi->cp.id = 0;
   hsi->cp.offset = 0;
+  hsi->data_end = 0;
+  hsi->format = 0;
+  hsi->block = NULL;
+  hsi->block_size = 0;
+  hsi->block_len = 0;
+  hsi->block_pos = 0;
+  hsi->block_skip = 0;
+  hsi->block_next = 0;
+  hsi->zbuf = NULL;
+  hsi->zbuf_size = 0;
+  hsi->use_map = use_map;
+  hsi->map = NULL;
+  hsi->map_size = 0;
+  hsi->ib_buf = NULL;
+  hsi->ib_size = 0;
+  hsi->uring = use_map ? NULL : hs_create_uring(HS_INPUT_READAHEAD_SIZE);
+  hsi->ra_offset = 0;
+  hsi->ra_pos = 0;
+  hsi->ra_len = 0;
+  hsi->ra_limit = 0;
+  hsi->ra_pending = false;
+  hsi->pending = false;
+  hsi->next = false;
+  hsi->wait_cnt = 0;
+  hsi->timer = 0;
+  hsi->seek_ns = LLONG_MIN;
+  hsi->decode = true;
   if (strlen(path) > HS_MAX_PATH - 30) {
     hs_log(NULL, g_module, 0, "path too long");
     exit(EXIT_FAILURE);
@@ -123,6 +872,13 @@ void hs_init_input(hs_input *hsi, size_t max_message_size, const char *path,
   }
   strcpy(hsi->path, path);
 
+  hsi->subdir = malloc(strlen(subdir) + 1);
+  if (!hsi->subdir) {
+    hs_log(NULL, g_module, 0, "subdir malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(hsi->subdir, subdir);
+
   hsi->name = malloc(strlen(name) + 1);
   if (!hsi->name) {
     hs_log(NULL, g_module, 0, "name malloc failed");
@@ -131,22 +887,39 @@ void hs_init_input(hs_input *hsi, size_t max_message_size, const char *path,
   strcpy(hsi->name, name);
 
   lsb_init_input_buffer(&hsi->ib, max_message_size);
+  lsb_init_heka_message(&hsi->msg, 8);
 }
 
 
 void hs_free_input(hs_input *hsi)
 {
+  hs_destroy_uring(hsi->uring);
+  hsi->uring = NULL;
+
+  unmap_file(hsi);
+
   if (hsi->fh) fclose(hsi->fh);
   hsi->fh = NULL;
 
   free(hsi->path);
   hsi->path = NULL;
 
+  free(hsi->subdir);
+  hsi->subdir = NULL;
+
   free(hsi->name);
   hsi->name = NULL;
 
   free(hsi->fn);
   hsi->fn = NULL;
 
+  free(hsi->block);
+  hsi->block = NULL;
+  hsi->block_size = 0;
+  free(hsi->zbuf);
+  hsi->zbuf = NULL;
+  hsi->zbuf_size = 0;
+
   lsb_free_input_buffer(&hsi->ib);
+  lsb_free_heka_message(&hsi->msg);
 }
@@ -9,34 +9,150 @@
 #ifndef hs_input_h_
 #define hs_input_h_
 
+#include <luasandbox/util/heka_message.h>
 #include <luasandbox/util/input_buffer.h>
 
 #include "hs_checkpoint_reader.h"
 #include "hs_config.h"
+#include "hs_uring.h"
 
 #include <pthread.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define HS_INPUT_READAHEAD_SIZE (128 * 1024)
+#define HS_INPUT_MAP_SIZE (64 * 1024 * 1024) // mapping growth increment
+
+typedef enum {
+  HS_INPUT_MESSAGE, // a message is pending in hsi->msg
+  HS_INPUT_DATA,    // data was read or the next file was opened
+  HS_INPUT_IDLE,    // nothing new is available
+  HS_INPUT_RESET    // the checkpoint was reset to the end of the queue
+} hs_input_status;
 
 typedef struct hs_input
 {
   FILE              *fh;
   char              *path;
+  char              *subdir;
   char              *name;
   char              *fn;
   size_t            fn_size;
   lsb_input_buffer  ib;
   hs_checkpoint     cp;
+  size_t            data_end; // known length of the valid data in the file
+  lsb_heka_message  msg;
+  bool              pending;  // msg has not been consumed
+  bool              next;     // the last file check opened a new file
+  int               wait_cnt; // file checks without finding the next file
+  time_t            timer;    // time of the last file check
+  long long         seek_ns;  // messages older than this are skipped
+  bool              decode;   // false when the consumer decodes a copy of
+                              // msg.raw (only the timestamp is parsed)
+
+  // block compressed files (read with pread, the checkpoint offset is the
+  // position in the uncompressed stream)
+  char              format;     // 0 unknown, 'p' plain, 'b' blocks, 'x' corrupt
+  char              *block;     // decompressed block
+  size_t            block_size;
+  size_t            block_len;
+  size_t            block_pos;  // bytes of the block already consumed
+  size_t            block_skip; // bytes before the checkpoint to discard
+  off_t             block_next; // file offset of the next block header
+  char              *zbuf;      // compressed block
+  size_t            zbuf_size;
+
+  // read only mapping of a plain file, the input buffer is a view into it and
+  // the messages are parsed in place
+  bool              use_map;
+  char              *map;
+  size_t            map_size;
+  char              *ib_buf;    // input buffer allocation while viewing the map
+  size_t            ib_size;
+
+  // io_uring readahead (NULL when using stdio)
+  hs_uring          *uring;
+  size_t            ra_offset; // file offset of the readahead buffer
+  size_t            ra_pos;    // bytes of the buffer already consumed
+  size_t            ra_len;    // bytes of valid data in the buffer
+  size_t            ra_limit;  // data_end when the read was queued
+  bool              ra_pending;
 } hs_input;
 
 
+/**
+ * Initializes a reader for one queue directory
+ *
+ * @param hsi Input reader to initialize
+ * @param max_message_size Largest message the reader has to buffer
+ * @param path Hindsight output_path
+ * @param subdir Queue directory relative to path
+ * @param name Reader name (checkpoint key and log messages)
+ * @param use_map Map the queue files instead of reading them
+ */
 void hs_init_input(hs_input *hsi, size_t max_message_size,
                    const char *path,
-                   const char *name);
+                   const char *subdir,
+                   const char *name,
+                   bool use_map);
 void hs_free_input(hs_input *hsi);
 
-bool hs_open_file(hs_input *hsi, const char *subdir, unsigned long long id);
+bool hs_open_file(hs_input *hsi, unsigned long long id);
 
 size_t hs_read_file(hs_input *hsi);
 
+/**
+ * Makes the next message available in hsi->msg, reading more data and moving
+ * on to the next queue file as needed. A pending message is kept until it is
+ * consumed.
+ *
+ * @param hsi Input reader
+ * @param cfg Hindsight configuration
+ * @param cpr Checkpoint reader used to recover when the queue file is missing
+ * @param t Current time, the file checks are limited to once a second
+ *
+ * @return hs_input_status
+ */
+hs_input_status hs_poll_input(hs_input *hsi, const hs_config *cfg,
+                              hs_checkpoint_reader *cpr, time_t t);
+
+/**
+ * Positions the reader on the first message at or after a timestamp using the
+ * queue file indexes (a missing index is rebuilt from the log and saved when
+ * the file is complete). Messages older than the timestamp are skipped until
+ * the first one that is not.
+ *
+ * @param hsi Input reader
+ * @param ns Timestamp in nanoseconds since the epoch
+ * @param index_interval The queue's index_interval, the entry spacing of a
+ *                       rebuilt index (HS_INDEX_INTERVAL when it is 0)
+ *
+ * @return bool False if the queue has no files (the reader is unchanged)
+ */
+bool hs_seek_input(hs_input *hsi, long long ns, unsigned index_interval);
+
+/**
+ * Marks the pending message as consumed
+ *
+ * @param hsi Input reader
+ * @param cp Populated with the checkpoint following the message
+ */
+void hs_consume_input(hs_input *hsi, hs_checkpoint *cp);
+
+/**
+ * Chooses the input queue shard to deliver the next message from
+ *
+ * @param list Array of shard readers (already polled)
+ * @param cnt Number of entries in list
+ * @param order 't' for the oldest message first, 'r' to rotate through the
+ *              shards
+ * @param rr Round robin position
+ *
+ * @return hs_input* Reader holding the selected message or NULL if none of
+ *         them have a message pending
+ */
+hs_input* hs_select_input(hs_input *list, int cnt, char order, int *rr);
+
 #endif
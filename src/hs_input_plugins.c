@@ -16,7 +16,6 @@
 #include <luasandbox.h>
 #include <luasandbox/lauxlib.h>
 #include <luasandbox/lua.h>
-#include <luasandbox/util/protobuf.h>
 #include <luasandbox_output.h>
 #include <math.h>
 #include <pthread.h>
@@ -106,11 +105,24 @@ static int inject_message(void *parent,
                           double cp_numeric,
                           const char *cp_string)
 {
-  static time_t last_bp_check = 0;
-  static bool backpressure = false;
-  static char header[14];
-
   hs_input_plugin *p = parent;
+  hs_output *output = p->output;
+  char header[14];
+  struct iovec iov[2];
+  size_t tlen = 0;
+  bool staged = true;
+
+  if (pb) {
+    iov[0].iov_base = header;
+    iov[0].iov_len = hs_output_header(header, pb_len);
+    iov[1].iov_base = (void *)pb;
+    iov[1].iov_len = pb_len;
+    tlen = iov[0].iov_len + pb_len;
+    // wait for room before taking the checkpoint lock so the checkpoint
+    // writer is never blocked behind a full ring
+    staged = hs_reserve_output_ring(output, &p->ring, tlen);
+  }
+
   int rv;
   pthread_mutex_lock(&p->cp.lock);
   rv = update_checkpoint(cp_numeric, cp_string, &p->cp);
@@ -118,8 +130,15 @@ static int inject_message(void *parent,
     p->stats = lsb_heka_get_stats(p->hsb);
     p->sample = false;
   }
-  if (pb) {
+  if (pb && rv == LSB_HEKA_IM_SUCCESS) {
     ++p->im_delta_cnt;
+    // staged under the checkpoint lock so any checkpoint the writer records
+    // only covers messages that are already visible to the queue writer
+    if (staged) {
+      hs_ring_push(&p->ring, iov, 2);
+    } else {
+      hs_write_output(output, iov, 2);
+    }
   }
   pthread_mutex_unlock(&p->cp.lock);
 
@@ -132,63 +151,10 @@ static int inject_message(void *parent,
   }
   if (rv != LSB_HEKA_IM_SUCCESS) return rv;
 
-  bool bp;
-  pthread_mutex_lock(&p->plugins->output->lock);
-  int len = lsb_pb_output_varint(header + 3, pb_len);
-  int tlen = 4 + len + pb_len;
-
-  header[0] = 0x1e;
-  header[1] = (char)(len + 1);
-  header[2] = 0x08;
-  header[3 + len] = 0x1f;
-  if (fwrite(header, 4 + len, 1, p->plugins->output->fh) == 1
-      && fwrite(pb, pb_len, 1, p->plugins->output->fh) == 1) {
-    p->plugins->output->cp.offset += tlen;
-    if (p->plugins->output->cp.offset >= p->plugins->cfg->output_size) {
-      ++p->plugins->output->cp.id;
-      hs_open_output_file(p->plugins->output);
-      if (p->plugins->cfg->backpressure
-          && p->plugins->output->cp.id - p->plugins->output->min_cp_id
-          > p->plugins->cfg->backpressure) {
-        backpressure = true;
-        hs_log(NULL, g_module, 4, "applying backpressure (checkpoint)");
-      }
-      if (!backpressure && p->plugins->cfg->backpressure_df) {
-        unsigned df = hs_disk_free_ob(p->plugins->output->path,
-                                      p->plugins->cfg->output_size);
-        if (df <= p->plugins->cfg->backpressure_df) {
-          backpressure = true;
-          hs_log(NULL, g_module, 4, "applying backpressure (disk)");
-        }
-      }
-    }
-    if (backpressure && last_bp_check < time(NULL)) {
-      last_bp_check = time(NULL);
-      bool release_dfbp = true;
-      if (p->plugins->cfg->backpressure_df) {
-        unsigned df = hs_disk_free_ob(p->plugins->output->path,
-                                      p->plugins->cfg->output_size);
-        release_dfbp = (df > p->plugins->cfg->backpressure_df);
-      }
-      // even if we triggered on disk space continue to backpressure
-      // until the queue is caught up too
-      if (p->plugins->output->cp.id == p->plugins->output->min_cp_id
-          && release_dfbp) {
-        backpressure = false;
-        hs_log(NULL, g_module, 4, "releasing backpressure");
-      }
-    }
-  } else {
-    hs_log(NULL, g_module, 0, "inject_message fwrite failed: %s",
-           strerror(ferror(p->plugins->output->fh)));
-    exit(EXIT_FAILURE);
-  }
-  bp = backpressure;
-  pthread_mutex_unlock(&p->plugins->output->lock);
-
-  if (bp) {
-    usleep(100000); // throttle to 10 messages per second
+  if (staged) {
+    hs_wake_output_writer(output, tlen);
   }
+  hs_throttle_output(output, &p->ring, tlen);
   return rv;
 }
 
@@ -201,6 +167,8 @@ static void destroy_input_plugin(hs_input_plugin *p)
     hs_log(NULL, p->name, 3, "lsb_heka_destroy_sandbox failed: %s", msg);
     free(msg);
   }
+  if (p->output) hs_remove_output_ring(p->output, &p->ring);
+  hs_free_ring(&p->ring);
   free(p->name);
   free_ip_checkpoint(&p->cp);
   sem_destroy(&p->shutdown);
@@ -306,6 +274,13 @@ create_input_plugin(const hs_config *cfg, hs_sandbox_config *sbc)
   p->ctx.plugin_name = NULL;
   p->ctx.output_path = NULL;
   init_ip_checkpoint(&p->cp);
+  if (hs_init_ring(&p->ring, HS_OUTPUT_RING_SIZE)) {
+    destroy_input_plugin(p);
+    hs_log(NULL, g_module, 2, "%s ring memory allocation failed",
+           sbc->cfg_name);
+    return NULL;
+  }
+  p->ring.weight = sbc->backpressure_weight;
   return p;
 }
 
@@ -525,6 +500,9 @@ static void add_to_input_plugins(hs_input_plugins *plugins, hs_input_plugin *p)
   assert(p->list_index >= 0);
 
   hs_lookup_checkpoint(p->plugins->cpr, p->name, &p->cp);
+  p->output = hs_shard_output(plugins->output, plugins->cfg->input_shards,
+                              p->name);
+  hs_add_output_ring(p->output, &p->ring);
 
   int ret = pthread_create(&p->thread,
                            NULL,
@@ -545,6 +523,9 @@ void hs_init_input_plugins(hs_input_plugins *plugins,
   plugins->cfg = cfg;
   plugins->cpr = cpr;
   plugins->output = output;
+  for (int i = 0; i < cfg->input_shards; ++i) {
+    hs_start_output_writer(&output[i]);
+  }
   plugins->list = NULL;
   plugins->list_cnt = 0;
   plugins->list_cap = 0;
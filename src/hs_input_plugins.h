@@ -18,6 +18,7 @@
 #include "hs_checkpoint_reader.h"
 #include "hs_logger.h"
 #include "hs_output.h"
+#include "hs_ring.h"
 
 typedef struct hs_input_plugin hs_input_plugin;
 typedef struct hs_input_plugins hs_input_plugins;
@@ -30,6 +31,8 @@ struct hs_input_plugin {
   pthread_t         thread;
   int               list_index;
   hs_ip_checkpoint  cp;
+  hs_output         *output; // input queue shard
+  hs_ring           ring;
   lsb_heka_stats    stats;
   sem_t             shutdown;
   int               im_delta_cnt;
@@ -42,7 +45,7 @@ struct hs_input_plugins {
   hs_input_plugin       **list;
   hs_config             *cfg;
   hs_checkpoint_reader  *cpr;
-  hs_output             *output;
+  hs_output             *output; // one per input queue shard
 
   pthread_mutex_t list_lock;
   int list_cnt;
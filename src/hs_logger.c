@@ -7,6 +7,7 @@
 /** @brief Hindsight logging implementation @file */
 
 #include "hs_logger.h"
+#include "hs_clock.h"
 #include "hs_util.h"
 
 #include <pthread.h>
@@ -51,13 +52,7 @@ hs_log(void *context, const char *plugin, int severity, const char *fmt, ...)
 {
   if (severity > g_loglevel) return;
 
-  struct timespec ts;
-  if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
-    ts.tv_sec = time(NULL);
-    fprintf(stderr, "%lld [error] hs_log clock_gettime failed\n",
-            ts.tv_sec * 1000000000LL);
-    ts.tv_nsec = 0;
-  }
+  long long ns = hs_coarse_time_ns();
 
   const char *level;
   switch (severity) {
@@ -94,7 +89,7 @@ hs_log(void *context, const char *plugin, int severity, const char *fmt, ...)
   va_start(args, fmt);
   pthread_mutex_lock(&g_logger);
   pthread_cleanup_push(release_mutex, &g_logger);
-  fprintf(stderr, "%lld [%s] %s ", ts.tv_sec * 1000000000LL + ts.tv_nsec, level,
+  fprintf(stderr, "%lld [%s] %s ", ns, level,
           plugin ? plugin : "unnamed");
   vfprintf(stderr, fmt, args);
   fwrite("\n", 1, 1, stderr);
@@ -6,44 +6,52 @@
 
 /** @brief Hindsight output implementation @file */
 
+#define _GNU_SOURCE
+
 #include "hs_output.h"
 
-#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
 #include <luasandbox/lauxlib.h>
+#include <luasandbox/util/protobuf.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "hs_catalog.h"
+#include "hs_clock.h"
 #include "hs_logger.h"
 #include "hs_util.h"
 
 static const char g_module[] = "output";
+static const char hs_next_ext[] = ".log.next";
 
-
-static bool extract_id(const char *fn, unsigned long long *id)
-{
-  size_t l = strlen(fn);
-  size_t i = 0;
-  for (; i < l && isdigit(fn[i]); ++i);
-  if (i > 0 && i + 4 == l && strncmp(fn + i, ".log", 4) == 0) {
-    *id = strtoull(fn, NULL, 10);
-    return true;
-  }
-  return false;
-}
+#ifdef IOV_MAX
+static const int max_iov = IOV_MAX;
+#else
+static const int max_iov = 1024;
+#endif
 
 
 static size_t find_last_id(const char *path)
 {
+  hs_catalog_ids ids;
+  if (hs_lookup_catalog(path, 0, &ids)) return ids.last;
+
   unsigned long long file_id = 0, current_id = 0;
   struct dirent *entry;
   DIR *dp = opendir(path);
   if (dp == NULL) return file_id;
 
   while ((entry = readdir(dp))) {
-    if (extract_id(entry->d_name, &current_id)) {
+    if (hs_extract_id(entry->d_name, &current_id)) {
       if (current_id > file_id) {
         file_id = current_id;
       }
@@ -54,10 +62,1089 @@ static size_t find_last_id(const char *path)
 }
 
 
-void hs_init_output(hs_output *output, const char *path, const char *subdir)
+static long long get_time_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static size_t frame_length(const hs_ring *r, size_t offset, size_t avail)
+{
+  unsigned char header[14];
+  if (avail > sizeof(header)) avail = sizeof(header);
+  hs_ring_copy(r, offset, header, avail);
+
+  // 0x1e, header length, 0x08, varint message length, 0x1f
+  size_t len = 0;
+  int vlen = header[1] - 1;
+  for (int i = 0; i < vlen; ++i) {
+    len |= (size_t)(header[3 + i] & 0x7f) << (7 * i);
+  }
+  return 3 + header[1] + len;
+}
+
+
+long long hs_message_timestamp(const char *pb, size_t len)
+{
+  const char *p = pb;
+  const char *e = pb + len;
+  while (p && p < e) {
+    int tag, wiretype;
+    long long v;
+    p = lsb_pb_read_key(p, &tag, &wiretype);
+    if (wiretype == 0) {
+      p = lsb_pb_read_varint(p, e, &v);
+      if (p && tag == 2) return v;
+    } else if (wiretype == 2) {
+      p = lsb_pb_read_varint(p, e, &v);
+      if (!p || v < 0 || v >= e - p) break;
+      p += v;
+    } else {
+      break;
+    }
+  }
+  return LLONG_MAX;
+}
+
+
+static long long ring_timestamp(const hs_ring *r, size_t offset, size_t len)
+{
+  // the uuid and timestamp lead the message, only the start is copied
+  char pb[48];
+  unsigned char hlen;
+  hs_ring_copy(r, offset + 1, &hlen, 1);
+  size_t hdr = 3 + hlen;
+  size_t n = len - hdr < sizeof(pb) ? len - hdr : sizeof(pb);
+  hs_ring_copy(r, offset + hdr, pb, n);
+  return hs_message_timestamp(pb, n);
+}
+
+
+/**
+ * Divides 90% of the reader drain rate between the producers so the readers
+ * catch up (weighted max-min fairness). A producer using less than its
+ * weighted share is allowed what it recently used plus some headroom and the
+ * remainder is split between the others by weight, so the throttling falls on
+ * the producers responsible for the backlog. Each producer is allowed at least
+ * max_message_size per second. The caller must hold output->lock.
+ */
+static void set_producer_rates(hs_output *output)
+{
+  bool bp = hs_output_backpressure(output);
+  double budget = output->drain_rate * 0.9;
+  double weights = 0;
+  for (int i = 0; i < output->rings_cap; ++i) {
+    hs_ring *r = output->rings[i];
+    if (!r) continue;
+    weights += __atomic_load_n(&r->weight, __ATOMIC_RELAXED);
+    if (bp && r->rate && r->usage >= r->rate * 0.9) {
+      output->demand[i] = DBL_MAX; // held to its rate, the demand is unknown
+    } else {
+      output->demand[i] = r->usage * 1.25;
+    }
+  }
+
+  // satisfy the producers asking for less than their share until the
+  // remaining budget only covers producers asking for more; a satisfied
+  // demand d is marked done by storing it as -d - 1
+  bool changed = true;
+  while (changed && weights > 0) {
+    changed = false;
+    for (int i = 0; i < output->rings_cap; ++i) {
+      hs_ring *r = output->rings[i];
+      if (!r || output->demand[i] < 0) continue;
+      unsigned w = __atomic_load_n(&r->weight, __ATOMIC_RELAXED);
+      if (output->demand[i] <= budget * w / weights) {
+        budget -= output->demand[i];
+        weights -= w;
+        output->demand[i] = -output->demand[i] - 1;
+        changed = true;
+      }
+    }
+  }
+
+  unsigned long long floor = output->cfg->max_message_size;
+  for (int i = 0; i < output->rings_cap; ++i) {
+    hs_ring *r = output->rings[i];
+    if (!r) continue;
+    double rate;
+    if (output->demand[i] < 0) {
+      rate = -output->demand[i] - 1;
+    } else {
+      rate = budget * __atomic_load_n(&r->weight, __ATOMIC_RELAXED) / weights;
+    }
+    unsigned long long ull = (unsigned long long)rate;
+    if (ull < floor) ull = floor;
+    __atomic_store_n(&r->rate, ull, __ATOMIC_RELAXED);
+  }
+}
+
+
+static void apply_backpressure(hs_output *output)
+{
+  const hs_config *cfg = output->cfg;
+  if (cfg->backpressure
+      && output->cp.id - output->min_cp_id > cfg->backpressure) {
+    __atomic_store_n(&output->backpressure, true, __ATOMIC_RELEASE);
+    hs_log(NULL, g_module, 4, "applying backpressure (checkpoint)");
+  }
+  if (!output->backpressure && cfg->backpressure_df) {
+    // measured by the preparer after allocating the next file
+    unsigned df = __atomic_load_n(&output->disk_free, __ATOMIC_RELAXED);
+    if (df <= cfg->backpressure_df) {
+      __atomic_store_n(&output->backpressure, true, __ATOMIC_RELEASE);
+      hs_log(NULL, g_module, 4, "applying backpressure (disk)");
+    }
+  }
+}
+
+
+static void release_backpressure(hs_output *output)
+{
+  const hs_config *cfg = output->cfg;
+  if (!output->backpressure || output->last_bp_check >= hs_coarse_time()) {
+    return;
+  }
+
+  output->last_bp_check = hs_coarse_time();
+  bool release_dfbp = true;
+  if (cfg->backpressure_df) {
+    unsigned df = hs_disk_free_ob(output->path, cfg->output_size);
+    release_dfbp = (df > cfg->backpressure_df);
+  }
+  // even if we triggered on disk space continue to backpressure
+  // until the queue is caught up too
+  if (output->cp.id == output->min_cp_id && release_dfbp) {
+    __atomic_store_n(&output->backpressure, false, __ATOMIC_RELEASE);
+    hs_log(NULL, g_module, 4, "releasing backpressure");
+  }
+}
+
+
+static void add_iov(hs_output *output, void *base, size_t len)
+{
+  if (output->iov_cnt == output->iov_cap) {
+    int cap = output->iov_cap ? output->iov_cap * 2 : 64;
+    struct iovec *tmp = realloc(output->iov, sizeof(struct iovec) * cap);
+    if (!tmp) {
+      hs_log(NULL, g_module, 0, "iov realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    output->iov = tmp;
+    output->iov_cap = cap;
+  }
+  output->iov[output->iov_cnt].iov_base = base;
+  output->iov[output->iov_cnt].iov_len = len;
+  ++output->iov_cnt;
+}
+
+
+static void writev_all(hs_output *output, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0) {
+    ssize_t n = writev(output->fd, iov, iovcnt > max_iov ? max_iov : iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      hs_log(NULL, g_module, 0, "writev failed: %s", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (n > 0) { // short write
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+
+static void release_staged(hs_output *output, size_t *staged)
+{
+  // the data is in the file, release the ring space
+  for (int i = 0; i < output->rings_cap; ++i) {
+    hs_ring *r = output->rings[i];
+    if (!r || !staged[i]) continue;
+
+    hs_ring_consume(r, staged[i]);
+    if (output->qcfg->group_commit_bytes) {
+      __atomic_sub_fetch(&output->pending, staged[i], __ATOMIC_RELAXED);
+    }
+    staged[i] = 0;
+    if (r->waiting) {
+      pthread_cond_broadcast(&output->space);
+    }
+  }
+  if (output->idx_dirty) {
+    fflush(output->idx_fh);
+    output->idx_dirty = false;
+  }
+  // the data is visible, wake the idle readers
+  for (int i = 0; i < output->waiters_cnt; ++i) {
+    hs_notify_waiter(output->waiters[i]);
+  }
+}
+
+
+static void disable_uring(hs_output *output)
+{
+  hs_log(NULL, g_module, 4, "%s: io_uring disabled, using writev",
+         output->path);
+  hs_destroy_uring(output->uring);
+  output->uring = NULL;
+}
+
+
+static void complete_write(hs_output *output)
+{
+  if (!output->inflight_cnt) return;
+
+  ssize_t n = hs_uring_wait(output->uring);
+  if (n < 0) {
+    hs_log(NULL, g_module, 0, "io_uring write failed: %s", strerror(-n));
+    exit(EXIT_FAILURE);
+  }
+  struct iovec *iov = output->inflight_iov;
+  int iovcnt = output->inflight_cnt;
+  while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+    n -= iov->iov_len;
+    ++iov;
+    --iovcnt;
+  }
+  if (iovcnt > 0) { // short write, finish it synchronously
+    iov->iov_base = (char *)iov->iov_base + n;
+    iov->iov_len -= n;
+    size_t remaining = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+      remaining += iov[i].iov_len;
+    }
+    // io_uring writes do not move the file position
+    lseek(output->fd, output->written - remaining, SEEK_SET);
+    writev_all(output, iov, iovcnt);
+  }
+  output->inflight_cnt = 0;
+  release_staged(output, output->inflight);
+}
+
+
+static void get_fqfn(const hs_output *output, unsigned long long id,
+                     const char *ext, char *fqfn, size_t fqfn_len)
 {
-  output->fh = NULL;
+  int ret = snprintf(fqfn, fqfn_len, "%s/%llu%s", output->path, id, ext);
+  if (ret < 0 || ret > (int)fqfn_len - 1) {
+    hs_log(NULL, g_module, 0, "output filename exceeds %zu", fqfn_len);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static void unmap_segment(const hs_output *output, int fd, char *map,
+                          size_t size, off_t end, bool truncate)
+{
+  if (munmap(map, size)) {
+    hs_log(NULL, g_module, 3, "%s munmap failed: %s", output->path,
+           strerror(errno));
+  }
+  if (truncate) {
+    // drop the unused space and the trailer, the file is now a plain log
+    if (ftruncate(fd, end)) {
+      hs_log(NULL, g_module, 3, "%s ftruncate failed: %s", output->path,
+             strerror(errno));
+    }
+  }
+}
+
+
+static void finish_segment(hs_output *output, bool truncate)
+{
+  unmap_segment(output, output->fd, output->map, output->map_size,
+                output->written, truncate);
+  output->map = NULL;
+  output->map_size = 0;
+  output->trailer = NULL;
+  if (truncate) lseek(output->fd, output->written, SEEK_SET);
+}
+
+
+static void set_segment(hs_output *output, char *map, size_t size)
+{
+  output->map = map;
+  output->map_size = size;
+  output->trailer = NULL;
+  if (map) {
+    output->trailer = (hs_segment_trailer *)(map + size
+                                             - sizeof(hs_segment_trailer));
+  }
+}
+
+
+static char* map_segment(int fd, const char *fqfn, size_t size)
+{
+  char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    hs_log(NULL, g_module, 3, "%s: mmap failed: %s", fqfn, strerror(errno));
+    return NULL;
+  }
+  return map;
+}
+
+
+/**
+ * Allocates an empty file at its full size; the trailer is written last so a
+ * reader never sees the file extended without it.
+ *
+ * @return char* Segment mapping or NULL if the file has to be written as a
+ *         plain log
+ */
+static char* create_segment(const hs_output *output, int fd, const char *fqfn,
+                            size_t *size)
+{
+  hs_segment_trailer t;
+  *size = (size_t)output->cfg->output_size + output->cfg->max_message_size
+      + sizeof(t);
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, *size)) {
+    hs_log(NULL, g_module, 4, "%s: fallocate failed: %s", fqfn,
+           strerror(errno));
+    if (ftruncate(fd, 0)) { // release any partial allocation
+      hs_log(NULL, g_module, 3, "%s: ftruncate failed: %s", fqfn,
+             strerror(errno));
+    }
+    return NULL;
+  }
+  t.magic = HS_SEGMENT_MAGIC;
+  t.end = 0;
+  if (pwrite(fd, &t, sizeof(t), *size - sizeof(t)) != sizeof(t)) {
+    hs_log(NULL, g_module, 0, "%s: trailer write failed: %s", fqfn,
+           strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return map_segment(fd, fqfn, *size);
+}
+
+
+/**
+ * Opens an existing file as a preallocated segment, it is resumed from the end
+ * recorded in its trailer; anything written after that is ignored and
+ * overwritten.
+ *
+ * @return char* Segment mapping or NULL if the file is a plain log
+ */
+static char* resume_segment(const hs_output *output, int fd, const char *fqfn,
+                            size_t *size)
+{
+  struct stat st;
+  if (fstat(fd, &st)) {
+    hs_log(NULL, g_module, 0, "%s: %s", fqfn, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (st.st_size == 0) return create_segment(output, fd, fqfn, size);
+
+  hs_segment_trailer t;
+  *size = (size_t)st.st_size;
+  if (*size > sizeof(t)
+      && pread(fd, &t, sizeof(t), *size - sizeof(t)) == sizeof(t)
+      && t.magic == HS_SEGMENT_MAGIC
+      && t.end <= *size - sizeof(t)) {
+    return map_segment(fd, fqfn, *size);
+  }
+  return NULL; // existing plain log, keep appending to it
+}
+
+
+static int open_file(const hs_output *output, const char *fqfn, int flags)
+{
+  // read access is needed for the mmap and the format checks on restart
+  flags |= O_CREAT | O_CLOEXEC | O_RDWR;
+  if (!output->qcfg->preallocate) flags |= O_APPEND;
+  int fd = open(fqfn, flags,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  if (fd == -1) {
+    hs_log(NULL, g_module, 0, "%s: %s", fqfn, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+
+/**
+ * Creates the next queue file under a temporary name so it is invisible to
+ * the readers until the writer renames it on rollover.
+ */
+static void prepare_file(hs_output *output, unsigned long long id, int *fd,
+                         char **map, size_t *size)
+{
+  char fqfn[HS_MAX_PATH];
+  get_fqfn(output, id, hs_next_ext, fqfn, sizeof(fqfn));
+  *fd = open_file(output, fqfn, O_TRUNC);
+  *map = NULL;
+  *size = 0;
+  if (output->qcfg->preallocate) {
+    *map = create_segment(output, *fd, fqfn, size);
+  }
+}
+
+
+static void* preparer_thread(void *arg)
+{
+  hs_output *output = (hs_output *)arg;
+
+  pthread_mutex_lock(&output->prep_lock);
+  while (true) {
+    if (output->old_fd != -1) {
+      int fd = output->old_fd;
+      char *map = output->old_map;
+      size_t size = output->old_map_size;
+      off_t end = output->old_end;
+      output->old_fd = -1;
+      pthread_mutex_unlock(&output->prep_lock);
+      if (map) unmap_segment(output, fd, map, size, end, true);
+      close(fd);
+      pthread_mutex_lock(&output->prep_lock);
+      continue;
+    }
+    if (output->prep_stop) break;
+
+    if (output->next_fd == -1) {
+      unsigned long long id = output->next_id;
+      int fd;
+      char *map;
+      size_t size;
+      pthread_mutex_unlock(&output->prep_lock);
+      prepare_file(output, id, &fd, &map, &size);
+      if (output->cfg->backpressure_df) {
+        unsigned df = hs_disk_free_ob(output->path, output->cfg->output_size);
+        __atomic_store_n(&output->disk_free, df, __ATOMIC_RELAXED);
+      }
+      pthread_mutex_lock(&output->prep_lock);
+      output->next_fd = fd;
+      output->next_map = map;
+      output->next_map_size = size;
+      pthread_cond_broadcast(&output->prep_cond);
+      continue;
+    }
+    pthread_cond_wait(&output->prep_cond, &output->prep_lock);
+  }
+  pthread_mutex_unlock(&output->prep_lock);
+  return NULL;
+}
+
+
+/**
+ * Starts the index of the current file; a file resumed with data is left
+ * unindexed, the readers rebuild it from the log when needed
+ */
+static void open_index(hs_output *output)
+{
+  if (output->idx_fh) {
+    fclose(output->idx_fh);
+    output->idx_fh = NULL;
+  }
+  output->idx_dirty = false;
+  if (!output->qcfg->index_interval) return;
+
+  char fqfn[HS_MAX_PATH];
+  get_fqfn(output, output->cp.id, ".idx", fqfn, sizeof(fqfn));
+  if (output->cp.offset) {
+    unlink(fqfn);
+    return;
+  }
+  output->idx_fh = fopen(fqfn, "we");
+  if (!output->idx_fh) {
+    hs_log(NULL, g_module, 3, "%s: %s", fqfn, strerror(errno));
+  }
+  output->idx_last = 0;
+  output->idx_max = INT64_MIN;
+}
+
+
+/**
+ * Switches to the file prepared in the background; the current file is handed
+ * to the preparer to be finalized and closed.
+ */
+static void next_output_file(hs_output *output)
+{
+  if (!output->preparer_running) {
+    hs_open_output_file(output);
+    return;
+  }
+
+  pthread_mutex_lock(&output->prep_lock);
+  while (output->next_fd == -1) { // only waits if rollovers outpace the disk
+    pthread_cond_wait(&output->prep_cond, &output->prep_lock);
+  }
+
+  char tmp[HS_MAX_PATH];
+  char fqfn[HS_MAX_PATH];
+  get_fqfn(output, output->cp.id, hs_next_ext, tmp, sizeof(tmp));
+  get_fqfn(output, output->cp.id, ".log", fqfn, sizeof(fqfn));
+  if (rename(tmp, fqfn)) {
+    hs_log(NULL, g_module, 0, "%s: rename failed: %s", fqfn, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  output->old_fd = output->fd;
+  output->old_map = output->map;
+  output->old_map_size = output->map_size;
+  output->old_end = output->written;
+  output->fd = output->next_fd;
+  set_segment(output, output->next_map, output->next_map_size);
+  output->cp.offset = output->written = 0;
+  open_index(output);
+
+  output->next_fd = -1;
+  output->next_id = output->cp.id + 1;
+  pthread_cond_broadcast(&output->prep_cond);
+  pthread_mutex_unlock(&output->prep_lock);
+
+  if (output->uring && hs_uring_set_file(output->uring, output->fd)) {
+    disable_uring(output);
+  }
+}
+
+
+static void request_sync(hs_output *output)
+{
+  pthread_mutex_lock(&output->sync_lock);
+  ++output->sync_req;
+  pthread_cond_broadcast(&output->sync_cond);
+  pthread_mutex_unlock(&output->sync_lock);
+}
+
+
+/**
+ * Syncs the queue files up to the target position, the files before target.id
+ * are complete so each of them is synced once.
+ */
+static void sync_files(hs_output *output, int *fd, unsigned long long *fd_id,
+                       const hs_checkpoint *target)
+{
+  while (*fd_id < target->id || (*fd_id == target->id && target->offset)) {
+    if (*fd == -1) {
+      char fqfn[HS_MAX_PATH];
+      get_fqfn(output, *fd_id, ".log", fqfn, sizeof(fqfn));
+      *fd = open(fqfn, O_RDONLY | O_CLOEXEC); // a pruned file needs no sync
+    }
+    if (*fd != -1 && fdatasync(*fd)) {
+      hs_log(NULL, g_module, 0, "%s: fdatasync failed: %s", output->path,
+             strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if (*fd_id == target->id) break;
+
+    if (*fd != -1) close(*fd);
+    *fd = -1;
+    ++*fd_id;
+  }
+}
+
+
+static void* syncer_thread(void *arg)
+{
+  hs_output *output = (hs_output *)arg;
+  int fd = -1;
+  unsigned long long fd_id = output->synced.id;
+  hs_checkpoint last = output->synced;
+
+  pthread_mutex_lock(&output->sync_lock);
+  for (;;) {
+    bool stop = output->sync_stop;
+    if (!stop && output->sync_done == output->sync_req) {
+      if (output->qcfg->sync == 'i') {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        long long ns = ts.tv_nsec
+            + output->qcfg->sync_interval_ms * 1000000LL;
+        ts.tv_sec += ns / 1000000000LL;
+        ts.tv_nsec = ns % 1000000000LL;
+        if (pthread_cond_timedwait(&output->sync_cond, &output->sync_lock,
+                                   &ts) != ETIMEDOUT) {
+          continue;
+        }
+      } else {
+        pthread_cond_wait(&output->sync_cond, &output->sync_lock);
+        continue;
+      }
+    }
+    unsigned long long req = output->sync_req;
+    // segment syncs only cover the completed files
+    bool full = output->qcfg->sync != 's' || output->sync_full || stop;
+    output->sync_full = false;
+    pthread_mutex_unlock(&output->sync_lock);
+
+    pthread_mutex_lock(&output->lock);
+    complete_write(output);
+    hs_checkpoint target = output->cp;
+    pthread_mutex_unlock(&output->lock);
+    if (!full) target.offset = 0;
+
+    long long ns = 0;
+    bool synced = false;
+    if (target.id > last.id
+        || (target.id == last.id && target.offset > last.offset)) {
+      long long start = get_time_ns();
+      sync_files(output, &fd, &fd_id, &target);
+      ns = get_time_ns() - start;
+      last = target;
+      synced = true;
+    }
+
+    pthread_mutex_lock(&output->sync_lock);
+    if (synced) {
+      output->synced = target;
+      ++output->sync_cnt;
+      output->sync_ns += ns;
+      if (ns > output->sync_max_ns) output->sync_max_ns = ns;
+    }
+    output->sync_done = req;
+    pthread_cond_broadcast(&output->sync_cond);
+    if (stop) break;
+  }
+  pthread_mutex_unlock(&output->sync_lock);
+  if (fd != -1) close(fd);
+  return NULL;
+}
+
+
+static void grow_buffer(char **buf, size_t *size, size_t len)
+{
+  if (len <= *size) return;
+
+  char *tmp = realloc(*buf, len);
+  if (!tmp) {
+    hs_log(NULL, g_module, 0, "block buffer realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  *buf = tmp;
+  *size = len;
+}
+
+
+/**
+ * Replaces the gathered batch with a single compressed block; incompressible
+ * data is stored as is.
+ */
+static void compress_batch(hs_output *output)
+{
+  size_t len = 0;
+  for (int i = 0; i < output->iov_cnt; ++i) {
+    len += output->iov[i].iov_len;
+  }
+  grow_buffer(&output->raw, &output->raw_size, len);
+  char *p = output->raw;
+  for (int i = 0; i < output->iov_cnt; ++i) {
+    memcpy(p, output->iov[i].iov_base, output->iov[i].iov_len);
+    p += output->iov[i].iov_len;
+  }
+
+  hs_block_header h;
+  size_t bound = hs_compress_bound(output->codec, len);
+  if (bound < len) bound = len;
+  grow_buffer(&output->zbuf, &output->zbuf_size, sizeof(h) + bound);
+  size_t n = hs_compress(output->codec, output->raw, len,
+                         output->zbuf + sizeof(h), bound);
+  h.codec = (uint32_t)output->codec;
+  if (n == 0 || n >= len) {
+    memcpy(output->zbuf + sizeof(h), output->raw, len);
+    n = len;
+    h.codec = 'n';
+  }
+  h.magic = HS_BLOCK_MAGIC;
+  h.raw_len = (uint32_t)len;
+  h.len = (uint32_t)n;
+  memcpy(output->zbuf, &h, sizeof(h));
+
+  output->iov_cnt = 0;
+  add_iov(output, output->zbuf, sizeof(h) + n);
+}
+
+
+static void copy_batch(hs_output *output)
+{
+  size_t len = 0;
+  for (int i = 0; i < output->iov_cnt; ++i) {
+    len += output->iov[i].iov_len;
+  }
+  size_t capacity = output->map_size - sizeof(hs_segment_trailer);
+  if ((size_t)output->written + len > capacity) {
+    // larger than expected message, fall back to writing the rest of the file
+    hs_log(NULL, g_module, 4, "%s segment full, extending with writev",
+           output->path);
+    finish_segment(output, true);
+    return;
+  }
+
+  char *p = output->map + output->written;
+  for (int i = 0; i < output->iov_cnt; ++i) {
+    memcpy(p, output->iov[i].iov_base, output->iov[i].iov_len);
+    p += output->iov[i].iov_len;
+  }
+  output->written += len;
+  __atomic_store_n(&output->trailer->end, (uint64_t)output->written,
+                   __ATOMIC_RELEASE);
+  output->iov_cnt = 0;
+  release_staged(output, output->staged);
+}
+
+
+static void write_batch(hs_output *output)
+{
+  if (!output->iov_cnt) return;
+  if (output->codec != 'n') compress_batch(output);
+
+  if (output->map) {
+    copy_batch(output);
+    if (!output->iov_cnt) return;
+  }
+
+  if (output->uring) {
+    // one write is kept in flight while the next batch is gathered
+    complete_write(output);
+    struct iovec *iov = output->inflight_iov;
+    int cap = output->inflight_iov_cap;
+    output->inflight_iov = output->iov;
+    output->inflight_iov_cap = output->iov_cap;
+    output->inflight_cnt = output->iov_cnt;
+    output->iov = iov;
+    output->iov_cap = cap;
+    output->iov_cnt = 0;
+
+    size_t *staged = output->inflight; // all zero after completion
+    output->inflight = output->staged;
+    output->staged = staged;
+
+    char *zbuf = output->inflight_zbuf;
+    size_t zbuf_size = output->inflight_zbuf_size;
+    output->inflight_zbuf = output->zbuf;
+    output->inflight_zbuf_size = output->zbuf_size;
+    output->zbuf = zbuf;
+    output->zbuf_size = zbuf_size;
+
+    size_t len = 0;
+    for (int i = 0; i < output->inflight_cnt; ++i) {
+      len += output->inflight_iov[i].iov_len;
+    }
+    off_t offset = output->written;
+    output->written += len;
+    if (output->inflight_cnt <= max_iov) {
+      if (!hs_uring_writev(output->uring, output->inflight_iov,
+                           output->inflight_cnt, offset)) {
+        return;
+      }
+      disable_uring(output);
+    }
+    lseek(output->fd, offset, SEEK_SET);
+    writev_all(output, output->inflight_iov, output->inflight_cnt);
+    output->inflight_cnt = 0;
+    release_staged(output, output->inflight);
+    return;
+  }
+
+  writev_all(output, output->iov, output->iov_cnt);
+  output->iov_cnt = 0;
+  release_staged(output, output->staged);
+}
+
+
+/**
+ * Removes the index of the current file after a failed write, readers rebuild
+ * it from the log instead of trusting a truncated one
+ */
+static void abandon_index(hs_output *output)
+{
+  hs_log(NULL, g_module, 3, "%s: %llu.idx write failed", output->path,
+         output->cp.id);
+  char fqfn[HS_MAX_PATH];
+  get_fqfn(output, output->cp.id, ".idx", fqfn, sizeof(fqfn));
+  unlink(fqfn);
+  output->idx_fh = NULL;
+  output->idx_dirty = false;
+}
+
+
+/**
+ * Accounts the message at the current offset to the index, an entry is added
+ * at the boundary after it once index_interval bytes have been written since
+ * the last one
+ */
+static void index_message(hs_output *output, long long ts, size_t len)
+{
+  if (ts > output->idx_max) output->idx_max = ts;
+  uint64_t end = output->cp.offset + len;
+  if (end - output->idx_last < output->qcfg->index_interval) return;
+
+  hs_index_entry e = { .timestamp = output->idx_max, .offset = end };
+  if (fwrite(&e, sizeof(e), 1, output->idx_fh) != 1) {
+    fclose(output->idx_fh);
+    abandon_index(output);
+    return;
+  }
+  output->idx_last = end;
+  output->idx_dirty = true;
+}
+
+
+/**
+ * Completes the index of the current file with an entry at its end and the
+ * terminating entry (offset UINT64_MAX)
+ */
+static void finish_index(hs_output *output)
+{
+  if (!output->idx_fh) return;
+
+  hs_index_entry e[2] = {
+    { .timestamp = output->idx_max, .offset = output->cp.offset },
+    { .timestamp = output->idx_max, .offset = UINT64_MAX }
+  };
+  size_t start = output->idx_last == output->cp.offset ? 1 : 0;
+  bool ok = fwrite(e + start, sizeof(e[0]), 2 - start, output->idx_fh)
+      == 2 - start;
+  if (fclose(output->idx_fh) || !ok) {
+    abandon_index(output);
+    return;
+  }
+  output->idx_fh = NULL;
+  output->idx_dirty = false;
+}
+
+
+static void advance(hs_output *output, size_t len)
+{
+  output->cp.offset += len;
+  if (output->cp.offset >= output->cfg->output_size) {
+    write_batch(output);
+    complete_write(output);
+    finish_index(output);
+    ++output->cp.id;
+    next_output_file(output);
+    if (output->syncer_running && output->qcfg->sync == 's') {
+      request_sync(output);
+    }
+    apply_backpressure(output);
+  }
+}
+
+
+static size_t ring_base(hs_output *output, int idx)
+{
+  return output->inflight[idx] + output->staged[idx];
+}
+
+
+static void add_ring_span(hs_output *output, int idx, size_t len)
+{
+  hs_ring *r = output->rings[idx];
+  struct iovec iov[2];
+  int cnt = hs_ring_map(r, ring_base(output, idx), len, iov);
+  for (int i = 0; i < cnt; ++i) {
+    add_iov(output, iov[i].iov_base, iov[i].iov_len);
+  }
+  output->staged[idx] += len;
+}
+
+
+static bool gather_ring(hs_output *output, int idx)
+{
+  hs_ring *r = output->rings[idx];
+  size_t used = hs_ring_used(r) - ring_base(output, idx);
+  if (!used) return false;
+
+  size_t span = 0;
+  while (used) {
+    size_t len = frame_length(r, ring_base(output, idx) + span, used);
+    if (output->idx_fh) {
+      index_message(output,
+                    ring_timestamp(r, ring_base(output, idx) + span, len),
+                    len);
+    }
+    span += len;
+    used -= len;
+    if (output->cp.offset + len >= output->cfg->output_size) {
+      // everything up to the rollover point goes into the current file
+      add_ring_span(output, idx, span);
+      span = 0;
+    }
+    advance(output, len);
+  }
+  if (span) add_ring_span(output, idx, span);
+  return true;
+}
+
+
+static bool drain_rings(hs_output *output)
+{
+  bool wrote = false;
+  for (int i = 0; i < output->rings_cap; ++i) {
+    if (output->rings[i] && gather_ring(output, i)) {
+      wrote = true;
+    }
+  }
+  if (wrote) write_batch(output);
+  return wrote;
+}
+
+
+static bool rings_pending(hs_output *output)
+{
+  for (int i = 0; i < output->rings_cap; ++i) {
+    if (output->rings[i] && hs_ring_used(output->rings[i])) return true;
+  }
+  return false;
+}
+
+
+static bool rings_waiting(hs_output *output)
+{
+  for (int i = 0; i < output->rings_cap; ++i) {
+    if (output->rings[i] && output->rings[i]->waiting) return true;
+  }
+  return false;
+}
+
+
+/**
+ * Determines if the staged data should be written now or held to build a
+ * larger batch (group commit).
+ *
+ * @return long long 0 to write now, otherwise the deadline to wait for (ns)
+ */
+static long long group_commit_deadline(hs_output *output, long long *first_ns)
+{
+  unsigned bytes = output->qcfg->group_commit_bytes;
+  if (!bytes || output->stop) return 0;
+
+  size_t pending = __atomic_load_n(&output->pending, __ATOMIC_RELAXED);
+  if (pending == 0 || pending >= bytes || rings_waiting(output)) return 0;
+
+  long long now = get_time_ns();
+  if (!*first_ns) *first_ns = now;
+  long long deadline = *first_ns + output->qcfg->group_commit_usec * 1000LL;
+  return now < deadline ? deadline : 0;
+}
+
+
+static void* writer_thread(void *arg)
+{
+  hs_output *output = (hs_output *)arg;
+  struct timespec ts;
+  long long first_ns = 0;
+
+  pthread_mutex_lock(&output->lock);
+  while (true) {
+    long long deadline = group_commit_deadline(output, &first_ns);
+    if (deadline) {
+      // the condition variable uses the realtime clock, convert the deadline
+      long long wait = deadline - get_time_ns();
+      if (wait > 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        wait += ts.tv_nsec;
+        ts.tv_sec += wait / 1000000000LL;
+        ts.tv_nsec = wait % 1000000000LL;
+        pthread_cond_timedwait(&output->wake, &output->lock, &ts);
+      }
+      continue;
+    }
+
+    bool wrote = drain_rings(output);
+    first_ns = 0;
+    release_backpressure(output);
+    if (wrote) continue;
+    complete_write(output);
+    if (output->stop) break;
+
+    // pairs with the fence in hs_wake_output_writer so a push is either seen
+    // here or the producer sees the idle flag and signals
+    __atomic_store_n(&output->writer_idle, true, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!rings_pending(output)) {
+      if (clock_gettime(CLOCK_REALTIME, &ts)) {
+        ts.tv_sec = time(NULL);
+        ts.tv_nsec = 0;
+      }
+      ts.tv_sec += 1; // also drives the backpressure release check
+      pthread_cond_timedwait(&output->wake, &output->lock, &ts);
+    }
+    __atomic_store_n(&output->writer_idle, false, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&output->lock);
+  return NULL;
+}
+
+
+void hs_init_output(hs_output *output, const hs_config *cfg,
+                    const hs_queue_config *qcfg, const char *subdir)
+{
+  const char *path = cfg->output_path;
+  output->fd = -1;
   output->cp.offset = 0;
+  output->cfg = cfg;
+  output->qcfg = qcfg;
+  output->rings = NULL;
+  output->staged = NULL;
+  output->demand = NULL;
+  output->rings_cap = 0;
+  output->waiters = NULL;
+  output->waiters_cnt = 0;
+  output->waiters_cap = 0;
+  output->iov = NULL;
+  output->iov_cnt = 0;
+  output->iov_cap = 0;
+  output->uring = NULL;
+  output->inflight = NULL;
+  output->inflight_iov = NULL;
+  output->inflight_cnt = 0;
+  output->inflight_iov_cap = 0;
+  output->written = 0;
+  output->map = NULL;
+  output->map_size = 0;
+  output->trailer = NULL;
+  output->codec = qcfg->compression;
+  output->raw = NULL;
+  output->raw_size = 0;
+  output->zbuf = NULL;
+  output->zbuf_size = 0;
+  output->inflight_zbuf = NULL;
+  output->inflight_zbuf_size = 0;
+  output->idx_fh = NULL;
+  output->idx_last = 0;
+  output->idx_max = INT64_MIN;
+  output->idx_dirty = false;
+  output->next_id = 0;
+  output->next_fd = -1;
+  output->next_map = NULL;
+  output->next_map_size = 0;
+  output->old_fd = -1;
+  output->old_map = NULL;
+  output->old_map_size = 0;
+  output->old_end = 0;
+  output->disk_free = 0;
+  output->preparer_running = false;
+  output->prep_stop = false;
+  output->synced.id = 0;
+  output->synced.offset = 0;
+  output->sync_req = 0;
+  output->sync_done = 0;
+  output->sync_cnt = 0;
+  output->sync_ns = 0;
+  output->sync_max_ns = 0;
+  output->sync_full = false;
+  output->syncer_running = false;
+  output->sync_stop = false;
+  output->pending = 0;
+  output->last_bp_check = 0;
+  output->producers = 0;
+  output->drain_rate = 0;
+  output->drain_pos = 0;
+  output->drain_ns = 0;
+  output->usage_ns = 0;
+  output->drop_id = ULLONG_MAX;
+  output->backpressure = false;
+  output->writer_idle = false;
+  output->writer_running = false;
+  output->stop = false;
   size_t len = strlen(path) + strlen(subdir) + 2;
   output->path = malloc(len);
   if (!output->path) {
@@ -65,59 +1152,639 @@ void hs_init_output(hs_output *output, const char *path, const char *subdir)
     exit(EXIT_FAILURE);
   }
   snprintf(output->path, len, "%s/%s", path, subdir);
-  output->cp.id = output->min_cp_id = find_last_id(output->path);
-
+  output->subdir = output->path + strlen(path) + 1;
+  if (!hs_codec_available(output->codec)) {
+    hs_log(NULL, g_module, 0, "%s: the configured compression is not "
+           "available in this build", output->path);
+    exit(EXIT_FAILURE);
+  }
   int ret = mkdir(path, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP);
   if (ret && errno != EEXIST) {
     hs_log(NULL, g_module, 0, "output path could not be created: %s", path);
     exit(EXIT_FAILURE);
   }
 
-  ret = mkdir(output->path, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP);
-  if (ret && errno != EEXIST) {
-    hs_log(NULL, g_module, 0, "output path could not be created: %s", output->path);
-    exit(EXIT_FAILURE);
+  // create the queue directory and any parent it has (input/<shard>)
+  for (char *s = output->path + strlen(path) + 1;; ++s) {
+    if (*s && *s != '/') continue;
+    char c = *s;
+    *s = 0;
+    ret = mkdir(output->path, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP);
+    *s = c;
+    if (ret && errno != EEXIST) {
+      hs_log(NULL, g_module, 0, "output path could not be created: %s",
+             output->path);
+      exit(EXIT_FAILURE);
+    }
+    if (!c) break;
   }
+  // after the directory exists so the catalog can watch it
+  output->cp.id = output->min_cp_id = find_last_id(output->path);
 
   if (pthread_mutex_init(&output->lock, NULL)) {
     perror("output lock pthread_mutex_init failed");
     exit(EXIT_FAILURE);
   }
+  if (pthread_mutex_init(&output->prep_lock, NULL)) {
+    perror("output prep_lock pthread_mutex_init failed");
+    exit(EXIT_FAILURE);
+  }
+  if (pthread_mutex_init(&output->sync_lock, NULL)) {
+    perror("output sync_lock pthread_mutex_init failed");
+    exit(EXIT_FAILURE);
+  }
+  if (pthread_cond_init(&output->wake, NULL)
+      || pthread_cond_init(&output->space, NULL)
+      || pthread_cond_init(&output->prep_cond, NULL)
+      || pthread_cond_init(&output->sync_cond, NULL)) {
+    perror("output pthread_cond_init failed");
+    exit(EXIT_FAILURE);
+  }
   hs_open_output_file(output);
 }
 
 
 void hs_free_output(hs_output *output)
 {
-  if (output->fh) fclose(output->fh);
-  output->fh = NULL;
+  if (output->writer_running) {
+    pthread_mutex_lock(&output->lock);
+    output->stop = true;
+    pthread_cond_signal(&output->wake);
+    pthread_mutex_unlock(&output->lock);
+    pthread_join(output->writer, NULL);
+    output->writer_running = false;
+  }
+  if (output->syncer_running) { // the final sync covers everything written
+    pthread_mutex_lock(&output->sync_lock);
+    output->sync_stop = true;
+    pthread_cond_broadcast(&output->sync_cond);
+    pthread_mutex_unlock(&output->sync_lock);
+    pthread_join(output->syncer, NULL);
+    output->syncer_running = false;
+  }
+  if (output->preparer_running) {
+    pthread_mutex_lock(&output->prep_lock);
+    output->prep_stop = true;
+    pthread_cond_broadcast(&output->prep_cond);
+    pthread_mutex_unlock(&output->prep_lock);
+    pthread_join(output->preparer, NULL);
+    output->preparer_running = false;
+  }
+  if (output->next_fd != -1) { // discard the unused file
+    char fqfn[HS_MAX_PATH];
+    get_fqfn(output, output->next_id, hs_next_ext, fqfn, sizeof(fqfn));
+    if (output->next_map) munmap(output->next_map, output->next_map_size);
+    close(output->next_fd);
+    unlink(fqfn);
+    output->next_fd = -1;
+  }
+  free(output->rings);
+  output->rings = NULL;
+  hs_destroy_uring(output->uring);
+  output->uring = NULL;
+  free(output->staged);
+  output->staged = NULL;
+  free(output->demand);
+  output->demand = NULL;
+  free(output->waiters);
+  output->waiters = NULL;
+  output->waiters_cnt = 0;
+  output->waiters_cap = 0;
+  free(output->inflight);
+  output->inflight = NULL;
+  output->rings_cap = 0;
+  free(output->iov);
+  output->iov = NULL;
+  output->iov_cnt = 0;
+  output->iov_cap = 0;
+  free(output->inflight_iov);
+  output->inflight_iov = NULL;
+  output->inflight_cnt = 0;
+  output->inflight_iov_cap = 0;
+  free(output->raw);
+  output->raw = NULL;
+  output->raw_size = 0;
+  free(output->zbuf);
+  output->zbuf = NULL;
+  output->zbuf_size = 0;
+  free(output->inflight_zbuf);
+  output->inflight_zbuf = NULL;
+  output->inflight_zbuf_size = 0;
+  if (output->idx_fh) fclose(output->idx_fh);
+  output->idx_fh = NULL;
+
+  if (output->map) finish_segment(output, false); // resumed on restart
+  if (output->fd != -1) close(output->fd);
+  output->fd = -1;
 
   free(output->path);
   output->path = NULL;
 
+  pthread_cond_destroy(&output->sync_cond);
+  pthread_cond_destroy(&output->prep_cond);
+  pthread_cond_destroy(&output->space);
+  pthread_cond_destroy(&output->wake);
+  pthread_mutex_destroy(&output->sync_lock);
+  pthread_mutex_destroy(&output->prep_lock);
   pthread_mutex_destroy(&output->lock);
 }
 
 
+static bool is_compressed(const hs_output *output)
+{
+  uint32_t magic;
+  return pread(output->fd, &magic, sizeof(magic), 0) == sizeof(magic)
+      && magic == HS_BLOCK_MAGIC;
+}
+
+
+/**
+ * Positions the writer after the last complete block of a compressed file,
+ * the queue offset is the uncompressed length of the blocks.
+ */
+static void resume_blocks(hs_output *output)
+{
+  hs_block_header h;
+  off_t pos = 0;
+  size_t offset = 0;
+  while (pos + (off_t)sizeof(h) <= output->written
+         && pread(output->fd, &h, sizeof(h), pos) == sizeof(h)
+         && h.magic == HS_BLOCK_MAGIC
+         && pos + (off_t)sizeof(h) + h.len <= output->written) {
+    pos += sizeof(h) + h.len;
+    offset += h.raw_len;
+  }
+  if (pos != output->written) {
+    hs_log(NULL, g_module, 3, "%s: discarding a partial block at the end of "
+           "%llu.log", output->path, output->cp.id);
+    if (output->map) {
+      __atomic_store_n(&output->trailer->end, (uint64_t)pos, __ATOMIC_RELEASE);
+    } else if (ftruncate(output->fd, pos)) {
+      hs_log(NULL, g_module, 0, "%s ftruncate failed: %s", output->path,
+             strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    output->written = pos;
+  }
+  output->cp.offset = offset;
+}
+
+
 void hs_open_output_file(hs_output *output)
 {
-  static char fqfn[260];
-  if (output->fh) {
-    fclose(output->fh);
-    output->fh = NULL;
+  char fqfn[HS_MAX_PATH];
+  if (output->map) finish_segment(output, true);
+  if (output->fd != -1) {
+    close(output->fd);
+    output->fd = -1;
+  }
+  get_fqfn(output, output->cp.id, ".log", fqfn, sizeof(fqfn));
+  output->fd = open_file(output, fqfn, 0);
+
+  char *map = NULL;
+  size_t size = 0;
+  if (output->qcfg->preallocate) {
+    map = resume_segment(output, output->fd, fqfn, &size);
+  }
+  set_segment(output, map, size);
+  if (map) {
+    output->cp.offset = output->written = output->trailer->end;
+  } else {
+    output->cp.offset = output->written = lseek(output->fd, 0, SEEK_END);
+  }
+  if (output->written && is_compressed(output) != (output->codec != 'n')) {
+    // the compression setting changed, start a new file
+    ++output->cp.id;
+    hs_open_output_file(output);
+    return;
+  }
+  if (output->codec != 'n') resume_blocks(output);
+  if (output->uring && hs_uring_set_file(output->uring, output->fd)) {
+    disable_uring(output);
+  }
+  open_index(output);
+}
+
+
+void hs_start_output_writer(hs_output *output)
+{
+  output->uring = hs_create_uring(0);
+  if (output->uring && hs_uring_set_file(output->uring, output->fd)) {
+    disable_uring(output);
   }
-  int ret = snprintf(fqfn, sizeof(fqfn), "%s/%llu.log", output->path,
-                     output->cp.id);
-  if (ret < 0 || ret > (int)sizeof(fqfn) - 1) {
-    hs_log(NULL, g_module, 0, "output filename exceeds %zu", sizeof(fqfn));
+  output->next_id = output->cp.id + 1;
+  if (pthread_create(&output->preparer, NULL, preparer_thread,
+                     (void *)output)) {
+    perror("output preparer pthread_create failed");
     exit(EXIT_FAILURE);
   }
-  output->fh = fopen(fqfn, "a+e");
-  if (!output->fh) {
-    hs_log(NULL, g_module, 0, "%s: %s", fqfn, strerror(errno));
+  output->preparer_running = true;
+
+  if (output->qcfg->sync != 'n') {
+    output->synced = output->cp; // the existing data is taken as durable
+    if (pthread_create(&output->syncer, NULL, syncer_thread,
+                       (void *)output)) {
+      perror("output syncer pthread_create failed");
+      exit(EXIT_FAILURE);
+    }
+    output->syncer_running = true;
+  }
+
+  if (pthread_create(&output->writer, NULL, writer_thread, (void *)output)) {
+    perror("output writer pthread_create failed");
     exit(EXIT_FAILURE);
+  }
+  output->writer_running = true;
+}
+
+
+void hs_add_output_ring(hs_output *output, hs_ring *r)
+{
+  pthread_mutex_lock(&output->lock);
+  int idx = -1;
+  for (int i = 0; i < output->rings_cap; ++i) {
+    if (!output->rings[i]) {
+      idx = i;
+      break;
+    }
+  }
+  if (idx == -1) {
+    int cap = output->rings_cap + 1;
+    hs_ring **tmp = realloc(output->rings, sizeof(hs_ring *) * cap);
+    size_t *stmp = realloc(output->staged, sizeof(size_t) * cap);
+    size_t *itmp = realloc(output->inflight, sizeof(size_t) * cap);
+    double *dtmp = realloc(output->demand, sizeof(double) * cap);
+    if (!tmp || !stmp || !itmp || !dtmp) {
+      hs_log(NULL, g_module, 0, "rings realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    output->rings = tmp;
+    output->staged = stmp;
+    output->inflight = itmp;
+    output->demand = dtmp;
+    idx = output->rings_cap++;
+  }
+  output->rings[idx] = r;
+  output->staged[idx] = 0;
+  output->inflight[idx] = 0;
+  ++output->producers;
+  set_producer_rates(output);
+  pthread_mutex_unlock(&output->lock);
+}
+
+
+void hs_remove_output_ring(hs_output *output, hs_ring *r)
+{
+  pthread_mutex_lock(&output->lock);
+  for (int i = 0; i < output->rings_cap; ++i) {
+    if (output->rings[i] == r) {
+      if (gather_ring(output, i)) write_batch(output);
+      complete_write(output);
+      output->rings[i] = NULL;
+      --output->producers;
+      set_producer_rates(output);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&output->lock);
+}
+
+
+void hs_add_output_waiter(hs_output *output, hs_waiter *w)
+{
+  pthread_mutex_lock(&output->lock);
+  if (output->waiters_cnt == output->waiters_cap) {
+    int cap = output->waiters_cap + 4;
+    hs_waiter **tmp = realloc(output->waiters, sizeof(hs_waiter *) * cap);
+    if (!tmp) {
+      hs_log(NULL, g_module, 0, "waiters realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    output->waiters = tmp;
+    output->waiters_cap = cap;
+  }
+  output->waiters[output->waiters_cnt++] = w;
+  pthread_mutex_unlock(&output->lock);
+}
+
+
+void hs_remove_output_waiter(hs_output *output, hs_waiter *w)
+{
+  pthread_mutex_lock(&output->lock);
+  for (int i = 0; i < output->waiters_cnt; ++i) {
+    if (output->waiters[i] == w) {
+      output->waiters[i] = output->waiters[--output->waiters_cnt];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&output->lock);
+}
+
+
+bool hs_reserve_output_ring(hs_output *output, hs_ring *r, size_t len)
+{
+  if (len > r->size) return false;
+  if (hs_ring_space(r) >= len) return true;
+
+  pthread_mutex_lock(&output->lock);
+  r->waiting = true;
+  pthread_cond_signal(&output->wake);
+  while (hs_ring_space(r) < len) {
+    pthread_cond_wait(&output->space, &output->lock);
+  }
+  r->waiting = false;
+  pthread_mutex_unlock(&output->lock);
+  return true;
+}
+
+
+void hs_write_output(hs_output *output, const struct iovec *iov, int iovcnt)
+{
+  size_t len = 0;
+  pthread_mutex_lock(&output->lock);
+  drain_rings(output);
+  for (int i = 0; i < iovcnt; ++i) {
+    add_iov(output, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  if (output->idx_fh && len) {
+    index_message(output, iovcnt > 1
+                  ? hs_message_timestamp(iov[1].iov_base, iov[1].iov_len)
+                  : LLONG_MAX, len);
+  }
+  write_batch(output);
+  complete_write(output); // iov is owned by the caller
+  advance(output, len);
+  pthread_mutex_unlock(&output->lock);
+}
+
+
+void hs_wake_output_writer(hs_output *output, size_t len)
+{
+  bool signal = false;
+  unsigned bytes = output->qcfg->group_commit_bytes;
+  if (bytes) {
+    size_t n = __atomic_add_fetch(&output->pending, len, __ATOMIC_SEQ_CST);
+    signal = n >= bytes && n - len < bytes; // crossed the batch threshold
   } else {
-    fseek(output->fh, 0, SEEK_END);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+  if (signal || __atomic_load_n(&output->writer_idle, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&output->lock);
+    pthread_cond_signal(&output->wake);
+    pthread_mutex_unlock(&output->lock);
+  }
+}
+
+
+size_t hs_output_header(char *header, size_t pb_len)
+{
+  int len = lsb_pb_output_varint(header + 3, pb_len);
+  header[0] = 0x1e;
+  header[1] = (char)(len + 1);
+  header[2] = 0x08;
+  header[3 + len] = 0x1f;
+  return 4 + len;
+}
+
+
+size_t hs_output_message(hs_output *output, hs_ring *r, const char *pb,
+                         size_t pb_len)
+{
+  char header[14];
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = hs_output_header(header, pb_len);
+  iov[1].iov_base = (void *)pb;
+  iov[1].iov_len = pb_len;
+
+  size_t len = iov[0].iov_len + pb_len;
+  if (hs_reserve_output_ring(output, r, len)) {
+    hs_ring_push(r, iov, 2);
+    hs_wake_output_writer(output, len);
+  } else {
+    hs_write_output(output, iov, 2);
+  }
+  return len;
+}
+
+
+void hs_flush_output(hs_output *output)
+{
+  drain_rings(output);
+  complete_write(output);
+}
+
+
+bool hs_output_backpressure(hs_output *output)
+{
+  return __atomic_load_n(&output->backpressure, __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ * Drops the files every reader has moved past from the page cache. When the
+ * queue is synced only the durable files are dropped, dirty pages cannot be.
+ */
+static void drop_passed_files(hs_output *output, unsigned long long min_id)
+{
+  unsigned long long end = min_id;
+  if (output->syncer_running) {
+    pthread_mutex_lock(&output->sync_lock);
+    if (output->synced.id < end) end = output->synced.id;
+    pthread_mutex_unlock(&output->sync_lock);
+  }
+  if (output->drop_id == ULLONG_MAX) output->drop_id = end;
+
+  for (; output->drop_id < end; ++output->drop_id) {
+    char fqfn[HS_MAX_PATH];
+    get_fqfn(output, output->drop_id, ".log", fqfn, sizeof(fqfn));
+    int fd = open(fqfn, O_RDONLY | O_CLOEXEC); // it may have been pruned
+    if (fd == -1) continue;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+
+void hs_update_output_readers(hs_output *output, const hs_checkpoint *min_cp)
+{
+  long long now = get_time_ns();
+  pthread_mutex_lock(&output->lock);
+  output->min_cp_id = min_cp->id;
+  if (min_cp->id != ULLONG_MAX) {
+    double pos = (double)min_cp->id * output->cfg->output_size
+        + min_cp->offset;
+    if (output->drain_ns && now > output->drain_ns
+        && pos >= output->drain_pos) {
+      double sample = (pos - output->drain_pos) * 1e9
+          / (now - output->drain_ns);
+      if (output->drain_rate) {
+        sample = output->drain_rate * 0.7 + sample * 0.3;
+      }
+      output->drain_rate = (unsigned long long)sample;
+    }
+    output->drain_pos = pos;
+    output->drain_ns = now;
+  }
+
+  if (output->usage_ns && now > output->usage_ns) {
+    double secs = (now - output->usage_ns) / 1e9;
+    for (int i = 0; i < output->rings_cap; ++i) {
+      hs_ring *r = output->rings[i];
+      if (!r) continue;
+      unsigned long long injected = __atomic_load_n(&r->injected,
+                                                    __ATOMIC_RELAXED);
+      double sample = (injected - r->injected_last) / secs;
+      r->usage = r->usage * 0.7 + sample * 0.3;
+      r->injected_last = injected;
+    }
+  }
+  output->usage_ns = now;
+  set_producer_rates(output);
+  pthread_mutex_unlock(&output->lock);
+  if (min_cp->id != ULLONG_MAX) drop_passed_files(output, min_cp->id);
+}
+
+
+static size_t file_resident(hs_output *output, unsigned long long id,
+                            unsigned char **vec, size_t *vec_size)
+{
+  char fqfn[HS_MAX_PATH];
+  get_fqfn(output, id, ".log", fqfn, sizeof(fqfn));
+  int fd = open(fqfn, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return 0;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t pages = ((size_t)st.st_size + page - 1) / page;
+  if (pages > *vec_size) {
+    unsigned char *tmp = realloc(*vec, pages);
+    if (!tmp) {
+      close(fd);
+      return 0;
+    }
+    *vec = tmp;
+    *vec_size = pages;
+  }
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+
+  size_t resident = 0;
+  if (!mincore(map, (size_t)st.st_size, *vec)) {
+    for (size_t i = 0; i < pages; ++i) {
+      if ((*vec)[i] & 1) resident += page;
+    }
+  }
+  munmap(map, (size_t)st.st_size);
+  return resident;
+}
+
+
+size_t hs_output_resident(hs_output *output, const hs_checkpoint *min)
+{
+  pthread_mutex_lock(&output->lock);
+  unsigned long long last = output->cp.id;
+  pthread_mutex_unlock(&output->lock);
+
+  // only the files the readers still have to get through matter, the ones
+  // before the slowest reader are waiting for the cleanup
+  unsigned long long id = min->id < last ? min->id : last;
+  hs_catalog_ids ids;
+  if (hs_lookup_catalog(output->path, 0, &ids) && ids.first > id) {
+    id = ids.first;
+  }
+
+  size_t resident = 0;
+  unsigned char *vec = NULL;
+  size_t vec_size = 0;
+  for (; id <= last; ++id) {
+    resident += file_resident(output, id, &vec, &vec_size);
+  }
+  free(vec);
+  return resident;
+}
+
+
+void hs_throttle_output(hs_output *output, hs_ring *r, size_t len)
+{
+  __atomic_store_n(&r->injected, r->injected + len, __ATOMIC_RELAXED);
+  if (!hs_output_backpressure(output)) {
+    r->last_ns = 0;
+    return;
+  }
+
+  double rate = (double)__atomic_load_n(&r->rate, __ATOMIC_RELAXED);
+  long long now = get_time_ns();
+  if (r->last_ns) {
+    r->tokens += (now - r->last_ns) * rate / 1e9;
+    if (r->tokens > rate / 10) r->tokens = rate / 10; // 100ms burst
+  } else {
+    r->tokens = 0;
+  }
+  r->last_ns = now;
+  r->tokens -= len;
+  if (r->tokens < 0 && rate > 0) {
+    long long ns = (long long)(-r->tokens * 1e9 / rate);
+    if (ns > 1000000000LL) ns = 1000000000LL; // stay responsive to shutdown
+    struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+    nanosleep(&ts, NULL);
+  }
+}
+
+
+void hs_sync_output(hs_output *output)
+{
+  if (!output->syncer_running) return;
+
+  pthread_mutex_lock(&output->sync_lock);
+  unsigned long long req = ++output->sync_req;
+  output->sync_full = true;
+  pthread_cond_broadcast(&output->sync_cond);
+  while (output->sync_done < req) {
+    pthread_cond_wait(&output->sync_cond, &output->sync_lock);
+  }
+  pthread_mutex_unlock(&output->sync_lock);
+}
+
+
+bool hs_output_synced(hs_output *output, const hs_checkpoint *cp)
+{
+  if (!output->syncer_running) return true;
+
+  pthread_mutex_lock(&output->sync_lock);
+  bool synced = output->synced.id > cp->id
+      || (output->synced.id == cp->id && output->synced.offset >= cp->offset);
+  pthread_mutex_unlock(&output->sync_lock);
+  return synced;
+}
+
+
+void hs_output_sync_stats(hs_output *output, unsigned *cnt, long long *ns,
+                          long long *max_ns)
+{
+  pthread_mutex_lock(&output->sync_lock);
+  *cnt = output->sync_cnt;
+  *ns = output->sync_ns;
+  *max_ns = output->sync_max_ns;
+  output->sync_cnt = 0;
+  output->sync_ns = 0;
+  output->sync_max_ns = 0;
+  pthread_mutex_unlock(&output->sync_lock);
+}
+
+
+hs_output* hs_shard_output(hs_output *outputs, int shards, const char *name)
+{
+  // FNV-1a so a plugin keeps writing to the same shard across restarts
+  uint32_t h = 2166136261U;
+  for (const unsigned char *s = (const unsigned char *)name; *s; ++s) {
+    h ^= *s;
+    h *= 16777619U;
   }
-  output->cp.offset = ftell(output->fh);
+  return &outputs[h % (uint32_t)shards];
 }
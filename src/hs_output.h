@@ -10,26 +10,360 @@
 #define hs_output_h_
 
 #include "hs_checkpoint_reader.h"
+#include "hs_compress.h"
 #include "hs_config.h"
+#include "hs_ring.h"
+#include "hs_uring.h"
+#include "hs_waiter.h"
 
 #include <luasandbox/lua.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define HS_OUTPUT_RING_SIZE (256 * 1024)
+#define HS_SEGMENT_MAGIC 0x31474553534800ULL // "\0HSSEG1"
+
+// Stored in the last bytes of a preallocated queue file, end is the length of
+// the valid data. Finalized files are truncated to their data and have no
+// trailer.
+typedef struct hs_segment_trailer
+{
+  uint64_t magic;
+  uint64_t end;
+} hs_segment_trailer;
+
+#define HS_BLOCK_MAGIC 0x425a5348U // "HSZB"
+
+// Precedes each block of a compressed queue file, the block holds complete
+// framed messages. The queue checkpoints of a compressed file refer to the
+// uncompressed message stream.
+typedef struct hs_block_header
+{
+  uint32_t magic;
+  uint32_t codec;   // 'l' lz4, 'z' zstd, 'n' stored (incompressible)
+  uint32_t raw_len; // uncompressed length
+  uint32_t len;     // compressed length following the header
+} hs_block_header;
+
+#define HS_INDEX_INTERVAL (1024 * 1024) // rebuilt index entry spacing
+
+// Entries of the optional <id>.idx file next to each queue file, ordered by
+// offset. The timestamp is the largest message timestamp before the offset so
+// it never decreases; every message before an entry with a timestamp < t is
+// older than t.
+typedef struct hs_index_entry
+{
+  int64_t  timestamp;
+  uint64_t offset;    // queue offset of a message boundary
+} hs_index_entry;
 
 typedef struct hs_output
 {
-  FILE *fh;
+  int fd;
   char *path;
+  const char *subdir; // queue directory relative to the output_path
   unsigned long long min_cp_id;
   pthread_mutex_t lock;
   hs_checkpoint cp;
+
+  // per producer staging rings drained by the writer thread
+  const hs_config       *cfg;
+  const hs_queue_config *qcfg;
+  hs_ring               **rings;
+  size_t                *staged; // bytes of each ring in the current batch
+  double                *demand; // rate allocation scratch space per ring
+  int                   rings_cap;
+  hs_waiter             **waiters; // readers woken after each write
+  int                   waiters_cnt;
+  int                   waiters_cap;
+  struct iovec          *iov;    // current batch
+  int                   iov_cnt;
+  int                   iov_cap;
+  hs_uring              *uring;           // NULL when using writev
+  size_t                *inflight;        // bytes of each ring being written
+  struct iovec          *inflight_iov;    // batch submitted to io_uring
+  int                   inflight_cnt;
+  int                   inflight_iov_cap;
+  off_t                 written;          // file offset of the next write
+  char                  *map;             // preallocated segment mapping
+  size_t                map_size;
+  hs_segment_trailer    *trailer;
+  char                  codec;            // 'n' when not compressing
+  char                  *raw;             // batch being compressed
+  size_t                raw_size;
+  char                  *zbuf;            // header and compressed batch
+  size_t                zbuf_size;
+  char                  *inflight_zbuf;   // block submitted to io_uring
+  size_t                inflight_zbuf_size;
+  FILE                  *idx_fh;          // NULL when the file is not indexed
+  uint64_t              idx_last;         // offset of the last index entry
+  int64_t               idx_max;          // largest timestamp in the file
+  bool                  idx_dirty;        // entries appended since the flush
+
+  // the next file is created in the background so a rollover only swaps it in
+  pthread_t             preparer;
+  pthread_mutex_t       prep_lock;
+  pthread_cond_t        prep_cond;
+  unsigned long long    next_id;
+  int                   next_fd;          // -1 until prepared
+  char                  *next_map;
+  size_t                next_map_size;
+  int                   old_fd;           // retired file to finalize, or -1
+  char                  *old_map;
+  size_t                old_map_size;
+  off_t                 old_end;
+  unsigned              disk_free;        // output_size blocks (backpressure)
+  bool                  preparer_running;
+  bool                  prep_stop;
+
+  // queue files are made durable in the background (hs_queue_config.sync)
+  pthread_t             syncer;
+  pthread_mutex_t       sync_lock;
+  pthread_cond_t        sync_cond;
+  hs_checkpoint         synced;           // everything before it is durable
+  unsigned long long    sync_req;         // sync requests made
+  unsigned long long    sync_done;        // sync requests completed
+  unsigned              sync_cnt;         // stats since the last sample
+  long long             sync_ns;
+  long long             sync_max_ns;
+  bool                  sync_full;        // include the current file
+  bool                  syncer_running;
+  bool                  sync_stop;
+
+  size_t                pending; // bytes pushed but not written (group commit)
+  pthread_t             writer;
+  pthread_cond_t        wake;
+  pthread_cond_t        space;
+  time_t                last_bp_check;
+  int                   producers;        // registered rings
+  unsigned long long    drain_rate;       // slowest reader (bytes per second)
+  double                drain_pos;        // slowest reader stream position
+  long long             drain_ns;         // time drain_pos was measured
+  long long             usage_ns;         // time of the last producer sample
+  unsigned long long    drop_id;          // next file to drop from the page
+                                          // cache (checkpoint writer only)
+  bool                  backpressure;
+  bool                  writer_idle;
+  bool                  writer_running;
+  bool                  stop;
 } hs_output;
 
 
-void hs_init_output(hs_output *output, const char *path, const char *subdir);
+/**
+ * Opens (or creates) the most recent file in the queue directory
+ *
+ * @param output Output queue to initialize
+ * @param cfg Hindsight configuration (output_path, output_size, backpressure
+ *            settings)
+ * @param qcfg Queue specific configuration
+ * @param subdir Queue directory name
+ */
+void hs_init_output(hs_output *output, const hs_config *cfg,
+                    const hs_queue_config *qcfg, const char *subdir);
 
 void hs_free_output(hs_output *output);
 
 void hs_open_output_file(hs_output *output);
 
+/**
+ * Starts the thread that drains the staging rings into the queue file
+ *
+ * @param output Output queue
+ */
+void hs_start_output_writer(hs_output *output);
+
+/**
+ * Registers a producer's staging ring with the writer thread
+ *
+ * @param output Output queue
+ * @param r Ring to register
+ */
+void hs_add_output_ring(hs_output *output, hs_ring *r);
+
+/**
+ * Drains and unregisters a producer's staging ring, after this call returns
+ * the ring can be freed
+ *
+ * @param output Output queue
+ * @param r Ring to remove (no-op if it was never registered)
+ */
+void hs_remove_output_ring(hs_output *output, hs_ring *r);
+
+/**
+ * Registers a reader to be woken whenever new data is written to the queue
+ *
+ * @param output Output queue
+ * @param w Reader's waiter
+ */
+void hs_add_output_waiter(hs_output *output, hs_waiter *w);
+
+/**
+ * Unregisters a reader, after this call returns the waiter can be freed
+ *
+ * @param output Output queue
+ * @param w Reader's waiter (no-op if it was never registered)
+ */
+void hs_remove_output_waiter(hs_output *output, hs_waiter *w);
+
+/**
+ * Blocks until the producer's staging ring has room for len bytes
+ *
+ * @param output Output queue
+ * @param r Producer's ring
+ * @param len Number of bytes the producer is about to push
+ *
+ * @return bool False if the message is larger than the ring (it must be
+ *         written with hs_write_output)
+ */
+bool hs_reserve_output_ring(hs_output *output, hs_ring *r, size_t len);
+
+/**
+ * Writes a framed message directly to the queue file after draining the
+ * rings (preserving the producer's message order); used for messages that do
+ * not fit in a ring
+ *
+ * @param output Output queue
+ * @param iov Message pieces (framing header and protobuf)
+ * @param iovcnt Number of entries in iov
+ */
+void hs_write_output(hs_output *output, const struct iovec *iov, int iovcnt);
+
+/**
+ * Notifies the writer thread that data was pushed to a ring
+ *
+ * @param output Output queue
+ * @param len Number of bytes pushed
+ */
+void hs_wake_output_writer(hs_output *output, size_t len);
+
+/**
+ * Frames a message and queues it through the producer's ring
+ *
+ * @param output Output queue
+ * @param r Producer's ring
+ * @param pb Protobuf encoded Heka message
+ * @param pb_len Length of pb
+ *
+ * @return size_t Framed length of the message (header and pb_len)
+ */
+size_t hs_output_message(hs_output *output, hs_ring *r, const char *pb,
+                         size_t pb_len);
+
+/**
+ * Builds the Heka stream framing header for a message
+ *
+ * @param header Buffer of at least 14 bytes
+ * @param pb_len Length of the protobuf message
+ *
+ * @return size_t Length of the header
+ */
+size_t hs_output_header(char *header, size_t pb_len);
+
+/**
+ * Writes anything staged in the rings to the queue file; the caller must hold
+ * output->lock
+ *
+ * @param output Output queue
+ */
+void hs_flush_output(hs_output *output);
+
+/**
+ * Returns true if the writer thread is applying backpressure
+ *
+ * @param output Output queue
+ *
+ * @return bool
+ */
+bool hs_output_backpressure(hs_output *output);
+
+/**
+ * Records the position of the slowest reader; it drives the checkpoint
+ * backpressure and the drain rate estimate the producer rates are derived from.
+ * The recent injection rate of each producer is sampled at the same time and
+ * the files every reader has passed are dropped from the page cache.
+ *
+ * @param output Output queue
+ * @param min_cp Slowest reader position (id ULLONG_MAX when there are no
+ *               readers)
+ */
+void hs_update_output_readers(hs_output *output, const hs_checkpoint *min_cp);
+
+/**
+ * Returns the timestamp of a protobuf encoded Heka message, LLONG_MAX when it
+ * is not within the data so the index entries stay conservative
+ *
+ * @param pb Encoded message (or its leading bytes)
+ * @param len Length of pb
+ *
+ * @return long long
+ */
+long long hs_message_timestamp(const char *pb, size_t len);
+
+/**
+ * Returns the number of bytes of the queue files from the slowest reader up to
+ * the writer that are resident in the page cache
+ *
+ * @param output Output queue
+ * @param min Slowest reader checkpoint (id ULLONG_MAX if there is none)
+ *
+ * @return size_t
+ */
+size_t hs_output_resident(hs_output *output, const hs_checkpoint *min);
+
+/**
+ * Accounts the bytes to the producer and limits it to its share of the reader
+ * drain rate while the queue applies backpressure (token bucket), returns
+ * immediately otherwise
+ *
+ * @param output Output queue
+ * @param r Producer's ring
+ * @param len Number of bytes the producer just queued (the framed length)
+ */
+void hs_throttle_output(hs_output *output, hs_ring *r, size_t len);
+
+/**
+ * Blocks until everything written to the queue so far is durable (no-op when
+ * the queue is not synced)
+ *
+ * @param output Output queue
+ */
+void hs_sync_output(hs_output *output);
+
+/**
+ * Returns true if the queue data before the checkpoint is durable (always true
+ * when the queue is not synced)
+ *
+ * @param output Output queue
+ * @param cp Queue position
+ *
+ * @return bool
+ */
+bool hs_output_synced(hs_output *output, const hs_checkpoint *cp);
+
+/**
+ * Returns and resets the sync statistics
+ *
+ * @param output Output queue
+ * @param cnt Number of syncs since the last call
+ * @param ns Total sync latency in nanoseconds
+ * @param max_ns Maximum sync latency in nanoseconds
+ */
+void hs_output_sync_stats(hs_output *output, unsigned *cnt, long long *ns,
+                          long long *max_ns);
+
+/**
+ * Returns the input queue shard a plugin writes to
+ *
+ * @param outputs Array of input queue shards
+ * @param shards Number of entries in outputs
+ * @param name Plugin name
+ *
+ * @return hs_output* Shard assigned to the plugin
+ */
+hs_output* hs_shard_output(hs_output *outputs, int shards, const char *name);
+
 #endif
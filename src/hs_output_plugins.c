@@ -15,7 +15,6 @@
 #include <luasandbox.h>
 #include <luasandbox/heka/sandbox.h>
 #include <luasandbox/lauxlib.h>
-#include <luasandbox/util/protobuf.h>
 #include <luasandbox/util/running_stats.h>
 #include <luasandbox_output.h>
 #include <pthread.h>
@@ -26,6 +25,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "hs_clock.h"
 #include "hs_input.h"
 #include "hs_output.h"
 #include "hs_util.h"
@@ -35,67 +35,19 @@ static const char g_module[] = "output_plugins";
 
 static int inject_message(void *parent, const char *pb, size_t pb_len)
 {
-  static time_t last_bp_check = 0;
-  static bool backpressure = false;
-  static char header[14];
-
   hs_output_plugin *p = parent;
-  bool bp;
-  pthread_mutex_lock(&p->plugins->output->lock);
-  int len = lsb_pb_output_varint(header + 3, pb_len);
-  int tlen = 4 + len + pb_len;
-  header[0] = 0x1e;
-  header[1] = (char)(len + 1);
-  header[2] = 0x08;
-  header[3 + len] = 0x1f;
-  if (fwrite(header, 4 + len, 1, p->plugins->output->fh) == 1
-      && fwrite(pb, pb_len, 1, p->plugins->output->fh) == 1) {
-    p->plugins->output->cp.offset += tlen;
-    if (p->plugins->output->cp.offset >= p->plugins->cfg->output_size) {
-      ++p->plugins->output->cp.id;
-      hs_open_output_file(p->plugins->output);
-      if (p->plugins->cfg->backpressure
-          && p->plugins->output->cp.id - p->plugins->output->min_cp_id
-          > p->plugins->cfg->backpressure) {
-        backpressure = true;
-        hs_log(NULL, g_module, 4, "applying backpressure (checkpoint)");
-      }
-      if (!backpressure && p->plugins->cfg->backpressure_df) {
-        unsigned df = hs_disk_free_ob(p->plugins->output->path,
-                                      p->plugins->cfg->output_size);
-        if (df <= p->plugins->cfg->backpressure_df) {
-          backpressure = true;
-          hs_log(NULL, g_module, 4, "applying backpressure (disk)");
-        }
-      }
-    }
-    if (backpressure && last_bp_check < time(NULL)) {
-      last_bp_check = time(NULL);
-      bool release_dfbp = true;
-      if (p->plugins->cfg->backpressure_df) {
-        unsigned df = hs_disk_free_ob(p->plugins->output->path,
-                                      p->plugins->cfg->output_size);
-        release_dfbp = (df > p->plugins->cfg->backpressure_df);
-      }
-      // even if we triggered on disk space continue to backpressure
-      // until the queue is caught up too
-      if (p->plugins->output->cp.id == p->plugins->output->min_cp_id
-          && release_dfbp) {
-        backpressure = false;
-        hs_log(NULL, g_module, 4, "releasing backpressure");
-      }
+  if (!p->ring.buf) { // most output plugins never inject, allocate on demand
+    if (hs_init_ring(&p->ring, HS_OUTPUT_RING_SIZE)) {
+      hs_log(NULL, p->name, 3, "ring memory allocation failed");
+      return LSB_HEKA_IM_ERROR;
     }
-  } else {
-    hs_log(NULL, g_module, 0, "inject_message fwrite failed: %s",
-           strerror(ferror(p->plugins->output->fh)));
-    exit(EXIT_FAILURE);
-  }
-  bp = backpressure;
-  pthread_mutex_unlock(&p->plugins->output->lock);
-
-  if (bp) {
-    usleep(100000); // throttle to 10 messages per second
+    p->ring.weight = p->bp_weight;
+    p->output = hs_shard_output(p->plugins->output,
+                                p->plugins->cfg->input_shards, p->name);
+    hs_add_output_ring(p->output, &p->ring);
   }
+  size_t len = hs_output_message(p->output, &p->ring, pb, pb_len);
+  hs_throttle_output(p->output, &p->ring, len);
   return LSB_HEKA_IM_SUCCESS;
 }
 
@@ -104,15 +56,27 @@ static void destroy_output_plugin(hs_output_plugin *p)
 {
   if (!p) return;
   hs_free_input(&p->analysis);
-  hs_free_input(&p->input);
+  if (p->input) {
+    for (int i = 0; i < p->shards; ++i) {
+      hs_free_input(&p->input[i]);
+    }
+    free(p->input);
+  }
   char *msg = lsb_heka_destroy_sandbox(p->hsb);
   if (msg) {
     hs_log(NULL, p->name, 3, "lsb_heka_destroy_sandbox failed: %s", msg);
     free(msg);
   }
   lsb_destroy_message_matcher(p->mm);
+  if (p->output) hs_remove_output_ring(p->output, &p->ring);
+  hs_free_ring(&p->ring);
   free(p->name);
-  free(p->async_cp);
+  if (p->async_cp) {
+    free(p->async_cp[0].input); // the shard checkpoints share one allocation
+    free(p->async_cp);
+  }
+  free(p->cp.input);
+  free(p->cur.input);
   pthread_mutex_destroy(&p->cp_lock);
   free(p);
 }
@@ -121,8 +85,9 @@ static void destroy_output_plugin(hs_output_plugin *p)
 static void update_checkpoint(hs_output_plugin *p)
 {
   pthread_mutex_lock(&p->cp_lock);
-  p->cp.input.id = p->cur.input.id;
-  p->cp.input.offset = p->cur.input.offset;
+  for (int i = 0; i < p->shards; ++i) {
+    p->cp.input[i] = p->cur.input[i];
+  }
   p->cp.analysis.id = p->cur.analysis.id;
   p->cp.analysis.offset = p->cur.analysis.offset;
   pthread_mutex_unlock(&p->cp_lock);
@@ -136,8 +101,13 @@ static void remove_checkpoint_q(hs_output_plugins *plugins,
 {
   char key[HS_MAX_PATH];
   if (q >= 'b') {
-    snprintf(key, HS_MAX_PATH, "%s->%s", hs_input_dir, plugin_name);
-    hs_remove_checkpoint(plugins->cpr, key);
+    int shards = plugins->cfg->input_shards;
+    for (int i = 0; i < shards; ++i) {
+      char subdir[HS_MAX_PATH];
+      if (hs_get_shard_dir(i, shards, subdir, sizeof(subdir))) continue;
+      snprintf(key, HS_MAX_PATH, "%s->%s", subdir, plugin_name);
+      hs_remove_checkpoint(plugins->cpr, key);
+    }
   }
   if (q <= 'b') {
     snprintf(key, HS_MAX_PATH, "%s->%s", hs_analysis_dir, plugin_name);
@@ -157,11 +127,13 @@ static int update_checkpoint_callback(void *parent, void *sequence_id)
     }
     int i = (uintptr_t)sequence_id % p->async_len;
     pthread_mutex_lock(&p->cp_lock);
-    if ((p->async_cp[i].input.id == p->cp.input.id
-         && p->async_cp[i].input.offset > p->cp.input.offset)
-        || p->async_cp[i].input.id > p->cp.input.id) {
-      p->cp.input.id = p->async_cp[i].input.id;
-      p->cp.input.offset = p->async_cp[i].input.offset;
+    for (int j = 0; j < p->shards; ++j) {
+      hs_checkpoint *acp = &p->async_cp[i].input[j];
+      if ((acp->id == p->cp.input[j].id
+           && acp->offset > p->cp.input[j].offset)
+          || acp->id > p->cp.input[j].id) {
+        p->cp.input[j] = *acp;
+      }
     }
     if ((p->async_cp[i].analysis.id == p->cp.analysis.id
          && p->async_cp[i].analysis.offset > p->cp.analysis.offset)
@@ -207,6 +179,13 @@ create_output_plugin(const hs_config *cfg, hs_sandbox_config *sbc)
   p->ticker_interval = sbc->ticker_interval;
   p->rm_cp_terminate = sbc->rm_cp_terminate;
   p->read_queue = sbc->read_queue;
+  p->start_ns = 0;
+  if (sbc->start_time) {
+    long long t = sbc->start_time;
+    if (t < 0) t += time(NULL); // relative to the load time
+    p->start_ns = t * 1000000000LL;
+  }
+  p->bp_weight = sbc->backpressure_weight;
   p->shutdown_terminate = sbc->shutdown_terminate;
   p->pm_sample = true;
   int stagger = p->ticker_interval > 60 ? 60 : p->ticker_interval;
@@ -218,15 +197,35 @@ create_output_plugin(const hs_config *cfg, hs_sandbox_config *sbc)
 #endif
   }
 
+  p->shards = cfg->input_shards;
+  hs_init_waiter(&p->waiter);
+  p->input = calloc(p->shards, sizeof(hs_input));
+  p->cp.input = calloc(p->shards, sizeof(hs_checkpoint));
+  p->cur.input = calloc(p->shards, sizeof(hs_checkpoint));
+  if (!p->input || !p->cp.input || !p->cur.input) {
+    destroy_output_plugin(p);
+    hs_log(NULL, g_module, 2, "%s input shard memory allocation failed",
+           sbc->cfg_name);
+    return NULL;
+  }
+
   if (sbc->async_buffer_size > 0) {
     p->async_len = sbc->async_buffer_size;
     p->async_cp = calloc(p->async_len, sizeof(hs_checkpoint_pair));
-    if (!p->async_cp) {
+    hs_checkpoint *input = NULL;
+    if (p->async_cp) {
+      input = calloc((size_t)p->async_len * p->shards, sizeof(hs_checkpoint));
+      p->async_cp[0].input = input;
+    }
+    if (!input) {
       destroy_output_plugin(p);
       hs_log(NULL, g_module, 2, "%s async buffer memory allocation failed",
              sbc->cfg_name);
       return NULL;
     }
+    for (int i = 0; i < p->async_len; ++i) {
+      p->async_cp[i].input = input + (size_t)i * p->shards;
+    }
   }
 
   p->mm = lsb_create_message_matcher(sbc->message_matcher);
@@ -327,17 +326,17 @@ static int output_message(hs_output_plugin *p, lsb_heka_message *msg,
   unsigned long long mmdelta = 0;
 
   if (msg->raw.s) { // non idle/empty message
-    if (sample) start = lsb_get_time();
+    if (sample) start = hs_fine_time();
     bool matched = lsb_eval_message_matcher(p->mm, msg);
     if (sample) {
-      mmdelta = lsb_get_time() - start;
+      mmdelta = hs_fine_time() - start;
       p->pm_sample = true;
     }
     if (matched) {
       if (p->async_len) {
         int i = (p->sequence_id + 1) % p->async_len;
-        p->async_cp[i].input.id = p->cur.input.id;
-        p->async_cp[i].input.offset = p->cur.input.offset;
+        memcpy(p->async_cp[i].input, p->cur.input,
+               sizeof(hs_checkpoint) * p->shards);
         p->async_cp[i].analysis.id = p->cur.analysis.id;
         p->async_cp[i].analysis.offset = p->cur.analysis.offset;
       }
@@ -383,7 +382,11 @@ static int output_message(hs_output_plugin *p, lsb_heka_message *msg,
   if (ret <= 0 && p->ticker_interval
       && current_t >= p->ticker_expires) {
     te_ret = lsb_heka_timer_event(p->hsb, current_t, false);
-    p->ticker_expires = current_t + p->ticker_interval;
+    // keep the schedule instead of drifting by the time it fired late
+    p->ticker_expires += p->ticker_interval;
+    if (p->ticker_expires <= current_t) {
+      p->ticker_expires = current_t + p->ticker_interval;
+    }
   }
 
   if (sample) {
@@ -404,38 +407,45 @@ static int output_message(hs_output_plugin *p, lsb_heka_message *msg,
 }
 
 
+static void register_waiter(hs_output_plugin *p, bool add)
+{
+  hs_output_plugins *plugins = p->plugins;
+  void (*fp)(hs_output *, hs_waiter *) = add ? hs_add_output_waiter
+      : hs_remove_output_waiter;
+  if (p->read_queue >= 'b') {
+    for (int i = 0; i < p->shards; ++i) {
+      fp(&plugins->output[i], &p->waiter);
+    }
+  }
+  if (p->read_queue <= 'b') {
+    fp(plugins->analysis, &p->waiter);
+  }
+}
+
+
 static void* input_thread(void *arg)
 {
   lsb_heka_message *msg = NULL;
 
-  lsb_heka_message im, *pim = NULL;
-  lsb_init_heka_message(&im, 8);
-
-  lsb_heka_message am, *pam = NULL;
-  lsb_init_heka_message(&am, 8);
+  lsb_heka_message idle;
+  lsb_init_heka_message(&idle, 8);
 
   hs_output_plugin *p = (hs_output_plugin *)arg;
   hs_log(NULL, p->name, 6, "starting");
+  register_waiter(p, true);
 
-  size_t db;
-  size_t bytes_read[2] = { 0 };
+  const hs_config *cfg = p->plugins->cfg;
+  hs_checkpoint_reader *cpr = p->plugins->cpr;
   int ret = 0;
   bool stop = false;
   bool sample = false;
-  time_t current_t = time(NULL);
-  lsb_logger logger = { .context = NULL, .cb = hs_log };
+  time_t current_t = hs_coarse_time();
 #ifdef HINDSIGHT_CLI
   long long cli_ns = 0;
   bool input_stop = p->read_queue == 'a';
   bool analysis_stop = p->read_queue == 'i';
   while (!(stop && input_stop && analysis_stop)) {
 #else
-  time_t itimer = 0;
-  time_t atimer = 0;
-  bool inext = false;
-  bool anext = false;
-  int iwait_cnt = 0;
-  int await_cnt = 0;
   while (!stop) {
 #endif
     pthread_mutex_lock(&p->cp_lock);
@@ -443,199 +453,76 @@ static void* input_thread(void *arg)
     sample = p->sample;
     pthread_mutex_unlock(&p->cp_lock);
 #ifndef HINDSIGHT_CLI
-    current_t = time(NULL);
+    current_t = hs_coarse_time();
 #endif
 
+    int seq = hs_waiter_seq(&p->waiter);
+    bool active = false;
+    hs_input *pim = NULL;
     if (p->read_queue >= 'b') {
-      if (p->input.fh && !pim) {
-        if (lsb_find_heka_message(&im, &p->input.ib, true, &db, &logger)) {
-          pim = &im;
-        } else {
-          bytes_read[0] = hs_read_file(&p->input);
-#ifdef HINDSIGHT_CLI
-          bool next = false;
-          if (!bytes_read[0]
-              && (p->input.cp.offset >= p->plugins->cfg->output_size)) {
-            next = hs_open_file(&p->input, hs_input_dir, p->input.cp.id + 1);
-          }
-          if (!bytes_read[0] && !next && stop) {
-            input_stop = true;
-          }
-#else
-          // When the read gets to the end it will always check once for the
-          // next available file just incase the output_size was increased on
-          // the last restart.
-          if (!bytes_read[0] &&
-              (p->input.cp.offset >= p->plugins->cfg->output_size || inext)) {
-            if (current_t != itimer) {
-              itimer = current_t;
-              inext = hs_open_file(&p->input, hs_input_dir, p->input.cp.id + 1);
-              if (inext) {
-                iwait_cnt = 0;
-              } else {
-                if (++iwait_cnt > 60
-                    || p->input.cp.offset < p->plugins->cfg->output_size) {
-                  size_t next_id = hs_find_next_id(p->plugins->cfg->output_path,
-                                                   hs_input_dir,
-                                                   p->input.cp.id);
-                  if (next_id > p->input.cp.id + 1) {
-                    hs_log(NULL, p->name, 3,
-                           "the input checkpoint skipped %zu missing files",
-                           next_id - p->input.cp.id - 1);
-                    inext = hs_open_file(&p->input, hs_input_dir, next_id);
-                    if (!inext) {
-                      hs_log(NULL, p->name, 2,
-                             "unable to open input queue file: %zu", next_id);
-                    }
-                  }
-                  iwait_cnt = 0;
-                }
-              }
-            }
-          }
-#endif
+      bool iactive = false;
+      for (int i = 0; i < p->shards; ++i) {
+        switch (hs_poll_input(&p->input[i], cfg, cpr, current_t)) {
+        case HS_INPUT_MESSAGE:
+        case HS_INPUT_DATA:
+          iactive = true;
+          break;
+        case HS_INPUT_RESET:
+          pthread_mutex_lock(&p->cp_lock);
+          p->cur.input[i] = p->cp.input[i] = p->input[i].cp;
+          pthread_mutex_unlock(&p->cp_lock);
+          break;
+        default:
+          break;
         }
-      } else if (!p->input.fh) { // still waiting on the first file
+      }
 #ifdef HINDSIGHT_CLI
-        bool next = hs_open_file(&p->input, hs_input_dir, p->input.cp.id);
-        if (!next && stop) input_stop = true;
-#else
-        if (current_t != itimer) {
-          itimer = current_t;
-          if (++iwait_cnt > 60) {
-            // the internal state is bad (manual prune?)
-            hs_lookup_input_checkpoint(p->plugins->cpr,
-                                       hs_input_dir,
-                                       NULL, // restart from the end
-                                       p->plugins->cfg->output_path,
-                                       &p->input.cp);
-            pthread_mutex_lock(&p->cp_lock);
-            p->cur.input.id = p->cp.input.id = p->input.cp.id;
-            p->cur.input.offset = p->cp.input.offset = p->input.cp.offset;
-            pthread_mutex_unlock(&p->cp_lock);
-            hs_log(NULL, p->name, 3, "the input checkpoint was reset");
-            iwait_cnt = 0;
-          }
-          inext = hs_open_file(&p->input, hs_input_dir, p->input.cp.id);
-          if (inext) iwait_cnt = 0;
-        }
+      if (!iactive && stop) input_stop = true;
 #endif
-      }
+      pim = hs_select_input(p->input, p->shards, cfg->input_read_order,
+                            &p->rr);
+      active = iactive;
     }
 
+    hs_input *pam = NULL;
     if (p->read_queue <= 'b') {
-      if (p->analysis.fh && !pam) {
-        if (lsb_find_heka_message(&am, &p->analysis.ib, true, &db, &logger)) {
-          pam = &am;
-        } else {
-          bytes_read[1] = hs_read_file(&p->analysis);
+      switch (hs_poll_input(&p->analysis, cfg, cpr, current_t)) {
+      case HS_INPUT_MESSAGE:
+        pam = &p->analysis;
+        active = true;
+        break;
+      case HS_INPUT_DATA:
+        active = true;
+        break;
+      case HS_INPUT_RESET:
+        pthread_mutex_lock(&p->cp_lock);
+        p->cur.analysis = p->cp.analysis = p->analysis.cp;
+        pthread_mutex_unlock(&p->cp_lock);
+        // fall through
+      default:
 #ifdef HINDSIGHT_CLI
-          bool next = false;
-          if (!bytes_read[1]
-              && (p->analysis.cp.offset >= p->plugins->cfg->output_size)) {
-            next = hs_open_file(&p->analysis, hs_analysis_dir,
-                                p->analysis.cp.id + 1);
-          }
-          if (!bytes_read[1] && !next && input_stop && stop) {
-            analysis_stop = true;
-          }
-#else
-          // When the read gets to the end it will always check once for the
-          // next available file just incase the output_size was increased on
-          // the last restart.
-          if (!bytes_read[1]
-              && (p->analysis.cp.offset >= p->plugins->cfg->output_size
-                  || anext)) {
-            if (current_t != atimer) {
-              atimer = current_t;
-              anext = hs_open_file(&p->analysis, hs_analysis_dir,
-                                   p->analysis.cp.id + 1);
-              if (anext) {
-                await_cnt = 0;
-              } else {
-                if (++await_cnt > 60
-                    || p->analysis.cp.offset < p->plugins->cfg->output_size) {
-                  size_t next_id = hs_find_next_id(p->plugins->cfg->output_path,
-                                                   hs_analysis_dir,
-                                                   p->analysis.cp.id);
-                  if (next_id > p->analysis.cp.id + 1) {
-                    hs_log(NULL, p->name, 3,
-                           "the analysis checkpoint skipped %zu missing files",
-                           next_id - p->analysis.cp.id - 1);
-                    anext = hs_open_file(&p->analysis, hs_analysis_dir,
-                                         next_id);
-                    if (!anext) {
-                      hs_log(NULL, p->name, 2,
-                             "unable to open analysis queue file: %zu",
-                             next_id);
-                    }
-                  }
-                  await_cnt = 0;
-                }
-              }
-            }
-          }
-#endif
-        }
-      } else if (!p->analysis.fh) { // still waiting on the first file
-#ifdef HINDSIGHT_CLI
-        bool next = hs_open_file(&p->analysis, hs_analysis_dir, p->analysis.cp.id);
-        if (!next && input_stop && stop) analysis_stop = true;
-#else
-        if (current_t != atimer) {
-          atimer = current_t;
-          if (++await_cnt > 60) {
-            // the internal state is bad (manual prune?)
-            hs_lookup_input_checkpoint(p->plugins->cpr,
-                                       hs_analysis_dir,
-                                       NULL, // restart from the end
-                                       p->plugins->cfg->output_path,
-                                       &p->analysis.cp);
-            pthread_mutex_lock(&p->cp_lock);
-            p->cur.analysis.id = p->cp.analysis.id = p->analysis.cp.id;
-            p->cur.analysis.offset = p->cp.analysis.offset = p->analysis.cp.offset;
-            pthread_mutex_unlock(&p->cp_lock);
-            hs_log(NULL, p->name, 3, "the analysis checkpoint was reset");
-            await_cnt = 0;
-          }
-          anext = hs_open_file(&p->analysis, hs_analysis_dir,
-                               p->analysis.cp.id);
-          if (anext) await_cnt = 0;
-        }
+        if (input_stop && stop) analysis_stop = true;
 #endif
+        break;
       }
     }
 
     // if we have one send the oldest first
-    if (pim) {
-      if (pam) {
-        if (pim->timestamp <= pam->timestamp) {
-          msg = pim;
-        } else {
-          msg = pam;
-        }
-      } else {
-        msg = pim;
-      }
-    } else if (pam) {
-      msg = pam;
+    hs_input *hsi = pim;
+    if (pam && (!pim || pam->msg.timestamp < pim->msg.timestamp)) {
+      hsi = pam;
     }
 
-    if (msg) {
+    if (hsi) {
       pthread_mutex_lock(&p->cp_lock);
-      if (msg == pim) {
-        pim = NULL;
-        p->cur.input.id = p->input.cp.id;
-        p->cur.input.offset = p->input.cp.offset -
-            (p->input.ib.readpos - p->input.ib.scanpos);
+      if (hsi == pam) {
+        hs_consume_input(hsi, &p->cur.analysis);
       } else {
-        pam = NULL;
-        p->cur.analysis.id = p->analysis.cp.id;
-        p->cur.analysis.offset = p->analysis.cp.offset -
-            (p->analysis.ib.readpos - p->analysis.ib.scanpos);
+        hs_consume_input(hsi, &p->cur.input[hsi - p->input]);
       }
       ++p->mm_delta_cnt;
       pthread_mutex_unlock(&p->cp_lock);
+      msg = &hsi->msg;
 #ifdef HINDSIGHT_CLI
       if (msg->timestamp > cli_ns) {
         cli_ns = msg->timestamp;
@@ -650,7 +537,7 @@ static void* input_thread(void *arg)
                  p->sequence_id + 1, err);
           sleep(1);
 #ifndef HINDSIGHT_CLI
-          current_t = time(NULL);
+          current_t = hs_coarse_time();
 #endif
           ret = output_message(p, msg, false, current_t);
           if (ret == LSB_HEKA_PM_RETRY) {
@@ -666,28 +553,31 @@ static void* input_thread(void *arg)
         break; // fatal error
       }
       msg = NULL;
-    } else if (!bytes_read[0] && !bytes_read[1]) {
+    } else if (!active) {
       // trigger any pending timer events
-      lsb_clear_heka_message(&im); // create an idle/empty message
-      msg = &im;
+      lsb_clear_heka_message(&idle); // create an idle/empty message
+      msg = &idle;
       output_message(p, msg, sample, current_t);
       msg = NULL;
-      sleep(1);
+      // until new input arrives or the next timer tick
+      hs_wait(&p->waiter, seq, hs_coarse_time() + 1);
     }
   }
+  register_waiter(p, false);
 
   shutdown_timer_event(p, current_t);
-  lsb_free_heka_message(&am);
-  lsb_free_heka_message(&im);
+  lsb_free_heka_message(&idle);
 
 // hold the current checkpoints in memory incase we restart it
   hs_output_plugins *plugins = p->plugins;
 
   if (p->read_queue >= 'b') {
-    hs_update_input_checkpoint(plugins->cpr,
-                               hs_input_dir,
-                               p->name,
-                               &p->cp.input);
+    for (int i = 0; i < p->shards; ++i) {
+      hs_update_input_checkpoint(plugins->cpr,
+                                 p->input[i].subdir,
+                                 p->name,
+                                 &p->cp.input[i]);
+    }
   }
 
   if (p->read_queue <= 'b') {
@@ -733,6 +623,7 @@ static void remove_plugin(hs_output_plugins *plugins, int idx)
   pthread_mutex_lock(&p->cp_lock);
   p->stop = true;
   pthread_mutex_unlock(&p->cp_lock);
+  hs_notify_waiter(&p->waiter);
   if (pthread_join(p->thread, NULL)) {
     hs_log(NULL, p->name, 3, "remove_plugin could not pthread_join");
   }
@@ -808,23 +699,32 @@ static void add_to_output_plugins(hs_output_plugins *plugins,
   // sync the output and read checkpoints
   // the read and output checkpoints can differ to allow for batching
   if (p->read_queue >= 'b') {
-    hs_lookup_input_checkpoint(p->plugins->cpr,
-                               hs_input_dir,
-                               p->name,
-                               path,
-                               &p->input.cp);
-    p->cur.input.id = p->cp.input.id = p->input.cp.id;
-    p->cur.input.offset = p->cp.input.offset = p->input.cp.offset;
+    for (int i = 0; i < p->shards; ++i) {
+      bool found = hs_lookup_input_checkpoint(p->plugins->cpr,
+                                              p->input[i].subdir,
+                                              p->name,
+                                              path,
+                                              &p->input[i].cp);
+      if (!found && p->start_ns) {
+        hs_seek_input(&p->input[i], p->start_ns,
+                      p->plugins->cfg->iqc.index_interval);
+      }
+      p->cur.input[i] = p->cp.input[i] = p->input[i].cp;
+    }
   } else {
     remove_checkpoint_q(plugins, p->name, 'i');
   }
 
   if (p->read_queue <= 'b') {
-    hs_lookup_input_checkpoint(p->plugins->cpr,
-                               hs_analysis_dir,
-                               p->name,
-                               path,
-                               &p->analysis.cp);
+    bool found = hs_lookup_input_checkpoint(p->plugins->cpr,
+                                            hs_analysis_dir,
+                                            p->name,
+                                            path,
+                                            &p->analysis.cp);
+    if (!found && p->start_ns) {
+      hs_seek_input(&p->analysis, p->start_ns,
+                    p->plugins->cfg->aqc.index_interval);
+    }
     p->cur.analysis.id = p->cp.analysis.id = p->analysis.cp.id;
     p->cur.analysis.offset = p->cp.analysis.offset = p->analysis.cp.offset;
   } else {
@@ -839,14 +739,40 @@ static void add_to_output_plugins(hs_output_plugins *plugins,
 }
 
 
+/**
+ * Creates the readers of the queues the plugin consumes, the others are left
+ * zeroed (hs_free_input ignores them)
+ */
+static void init_queue_readers(hs_output_plugin *p, const hs_config *cfg)
+{
+  if (p->read_queue >= 'b') {
+    for (int i = 0; i < p->shards; ++i) {
+      char subdir[HS_MAX_PATH];
+      if (hs_get_shard_dir(i, p->shards, subdir, sizeof(subdir))) {
+        hs_log(NULL, g_module, 0, "input queue shard name too long");
+        exit(EXIT_FAILURE);
+      }
+      hs_init_input(&p->input[i], cfg->max_message_size, cfg->output_path,
+                    subdir, p->name, cfg->iqc.mmap_readers);
+    }
+  }
+  if (p->read_queue <= 'b') {
+    hs_init_input(&p->analysis, cfg->max_message_size, cfg->output_path,
+                  hs_analysis_dir, p->name, cfg->aqc.mmap_readers);
+  }
+}
+
+
 void hs_init_output_plugins(hs_output_plugins *plugins,
                             hs_config *cfg,
                             hs_checkpoint_reader *cpr,
-                            hs_output *output)
+                            hs_output *output,
+                            hs_output *analysis)
 {
   plugins->cfg = cfg;
   plugins->cpr = cpr;
   plugins->output = output;
+  plugins->analysis = analysis;
   plugins->list = NULL;
   plugins->list_cnt = 0;
   plugins->list_cap = 0;
@@ -982,10 +908,7 @@ void hs_load_output_startup(hs_output_plugins *plugins)
       hs_output_plugin *p = create_output_plugin(cfg, &sbc);
       if (p) {
         p->plugins = plugins;
-        hs_init_input(&p->input, cfg->max_message_size, cfg->output_path,
-                      p->name);
-        hs_init_input(&p->analysis, cfg->max_message_size, cfg->output_path,
-                      p->name);
+        init_queue_readers(p, cfg);
         add_to_output_plugins(plugins, p, false);
       } else {
 #ifdef HINDSIGHT_CLI
@@ -1007,10 +930,15 @@ static void remove_checkpoints(hs_output_plugins *plugins, const char *filename)
 {
   char key[HS_MAX_PATH];
   int fnlen = strlen(filename);
+  int shards = plugins->cfg->input_shards;
 
-  snprintf(key, HS_MAX_PATH, "%s->%s.%.*s", hs_input_dir,
-           hs_output_dir, fnlen - HS_EXT_LEN, filename);
-  hs_remove_checkpoint(plugins->cpr, key);
+  for (int i = 0; i < shards; ++i) {
+    char subdir[HS_MAX_PATH];
+    if (hs_get_shard_dir(i, shards, subdir, sizeof(subdir))) continue;
+    snprintf(key, HS_MAX_PATH, "%s->%s.%.*s", subdir,
+             hs_output_dir, fnlen - HS_EXT_LEN, filename);
+    hs_remove_checkpoint(plugins->cpr, key);
+  }
 
   snprintf(key, HS_MAX_PATH, "%s->%s.%.*s", hs_analysis_dir,
            hs_output_dir, fnlen - HS_EXT_LEN, filename);
@@ -1046,10 +974,7 @@ void hs_load_output_dynamic(hs_output_plugins *plugins, const char *filename)
         hs_output_plugin *p = create_output_plugin(cfg, &sbc);
         if (p) {
           p->plugins = plugins;
-          hs_init_input(&p->input, cfg->max_message_size, cfg->output_path,
-                        p->name);
-          hs_init_input(&p->analysis, cfg->max_message_size, cfg->output_path,
-                        p->name);
+          init_queue_readers(p, cfg);
           add_to_output_plugins(plugins, p, true);
           loaded = true;
         } else {
@@ -1083,6 +1008,7 @@ void hs_stop_output_plugins(hs_output_plugins *plugins)
     pthread_mutex_lock(&plugins->list[i]->cp_lock);
     plugins->list[i]->stop = true;
     pthread_mutex_unlock(&plugins->list[i]->cp_lock);
+    hs_notify_waiter(&plugins->list[i]->waiter);
   }
   pthread_mutex_unlock(&plugins->list_lock);
 }
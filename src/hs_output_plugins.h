@@ -24,6 +24,7 @@
 #include "hs_input.h"
 #include "hs_logger.h"
 #include "hs_output.h"
+#include "hs_ring.h"
 
 typedef struct hs_output_plugin hs_output_plugin;
 typedef struct hs_output_plugins hs_output_plugins;
@@ -40,7 +41,9 @@ struct hs_output_plugin {
   int                 mm_delta_cnt;
   int                 pm_delta_cnt;
   int                 max_mps;
+  unsigned            bp_weight;
   time_t              ticker_expires;
+  long long           start_ns; // position used when there is no checkpoint
 
   pthread_t thread;
   int       list_index;
@@ -51,8 +54,13 @@ struct hs_output_plugin {
   bool      rm_cp_terminate;
   bool      shutdown_terminate;
   char      read_queue;
-  hs_input input;
-  hs_input analysis;
+  int       shards;
+  int       rr;        // round robin input shard
+  hs_input  *input;    // one per input queue shard
+  hs_input  analysis;
+  hs_output *output;   // input queue shard receiving injected messages
+  hs_ring   ring;
+  hs_waiter waiter;    // woken by the writers of the queues it reads
 
   pthread_mutex_t     cp_lock;
   hs_checkpoint_pair  cp;
@@ -67,7 +75,8 @@ struct hs_output_plugins {
   hs_output_plugin      **list;
   hs_config             *cfg;
   hs_checkpoint_reader  *cpr;
-  hs_output             *output;
+  hs_output             *output;   // input queue shards
+  hs_output             *analysis; // analysis queue
 
   pthread_mutex_t list_lock;
   int list_cnt;
@@ -81,7 +90,8 @@ struct hs_output_plugins {
 void hs_init_output_plugins(hs_output_plugins *plugins,
                             hs_config *cfg,
                             hs_checkpoint_reader *cpr,
-                            hs_output *output);
+                            hs_output *output,
+                            hs_output *analysis);
 
 void hs_free_output_plugins(hs_output_plugins *plugins);
 
@@ -0,0 +1,231 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight queue reader decode-ahead implementation @file */
+
+#include "hs_prefetch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hs_clock.h"
+#include "hs_logger.h"
+
+static const char g_module[] = "prefetch";
+
+
+/**
+ * Returns the slot to fill next, blocking while the ring is full
+ *
+ * @return hs_prefetch_slot* NULL if the stage is stopping
+ */
+static hs_prefetch_slot* next_slot(hs_prefetch *pf)
+{
+  for (;;) {
+    int seq = hs_waiter_seq(&pf->waiter);
+    if (__atomic_load_n(&pf->stop, __ATOMIC_ACQUIRE)) return NULL;
+    // the slowest consumer gates the reuse
+    unsigned used = 0;
+    for (int i = 0; i < pf->cursors_cnt; ++i) {
+      unsigned n = pf->tail - __atomic_load_n(&pf->cursors[i].head,
+                                              __ATOMIC_ACQUIRE);
+      if (n > used) used = n;
+    }
+    if (used < pf->size) return &pf->slots[pf->tail % pf->size];
+    hs_wait(&pf->waiter, seq, time(NULL) + 1); // until a slot is released
+  }
+}
+
+
+static void notify_consumers(hs_prefetch *pf)
+{
+  for (int i = 0; i < pf->cursors_cnt; ++i) {
+    hs_notify_waiter(pf->cursors[i].waiter);
+  }
+}
+
+
+static void publish_slot(hs_prefetch *pf)
+{
+  __atomic_store_n(&pf->tail, pf->tail + 1, __ATOMIC_RELEASE);
+  notify_consumers(pf);
+}
+
+
+static bool decode_slot(hs_prefetch_slot *s, hs_input *hsi)
+{
+  const lsb_const_string *raw = &hsi->msg.raw;
+  if (raw->len > s->buf_size) {
+    char *tmp = realloc(s->buf, raw->len);
+    if (!tmp) {
+      hs_log(NULL, g_module, 0, "slot realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    s->buf = tmp;
+    s->buf_size = raw->len;
+  }
+  memcpy(s->buf, raw->s, raw->len);
+  hs_consume_input(hsi, &s->cp);
+
+  lsb_logger logger = { .context = NULL, .cb = hs_log };
+  // an invalid message is dropped like the inline decode does, the next one
+  // checkpoints past it
+  return lsb_decode_heka_message(&s->msg, s->buf, raw->len, &logger);
+}
+
+
+static void* prefetch_thread(void *arg)
+{
+  hs_prefetch *pf = (hs_prefetch *)arg;
+  hs_log(NULL, g_module, 7, "starting: %s", pf->input[0].name);
+
+  while (!__atomic_load_n(&pf->stop, __ATOMIC_ACQUIRE)) {
+    int seq = hs_waiter_seq(&pf->waiter);
+    bool active = false;
+    time_t t = hs_coarse_time();
+    for (int i = 0; i < pf->shards; ++i) {
+      switch (hs_poll_input(&pf->input[i], pf->cfg, pf->cpr, t)) {
+      case HS_INPUT_MESSAGE:
+      case HS_INPUT_DATA:
+        active = true;
+        break;
+      case HS_INPUT_RESET:
+        {
+          // delivered in order so the consumers apply it after the slots
+          // already filled from the old position
+          hs_prefetch_slot *s = next_slot(pf);
+          if (!s) break;
+          s->reset = true;
+          s->shard = i;
+          s->cp = pf->input[i].cp;
+          publish_slot(pf);
+        }
+        break;
+      default:
+        break;
+      }
+    }
+
+    hs_input *hsi = hs_select_input(pf->input, pf->shards,
+                                    pf->cfg->input_read_order, &pf->rr);
+    if (hsi) {
+      hs_prefetch_slot *s = next_slot(pf);
+      if (!s) break;
+      s->reset = false;
+      s->shard = (int)(hsi - pf->input);
+      if (decode_slot(s, hsi)) publish_slot(pf);
+    } else if (!active) {
+      // the consumer treats the queues as drained until the next notification
+      __atomic_store_n(&pf->idle_seq, seq, __ATOMIC_RELEASE);
+      notify_consumers(pf);
+      hs_wait(&pf->waiter, seq, time(NULL) + 1);
+    }
+  }
+  hs_log(NULL, g_module, 7, "exiting: %s", pf->input[0].name);
+  return NULL;
+}
+
+
+void hs_init_prefetch(hs_prefetch *pf, unsigned size, hs_input *input,
+                      int shards, const hs_config *cfg,
+                      hs_checkpoint_reader *cpr, hs_waiter **consumers,
+                      int consumers_cnt)
+{
+  pf->input = input;
+  pf->shards = shards;
+  pf->rr = 0;
+  pf->cfg = cfg;
+  pf->cpr = cpr;
+  hs_init_waiter(&pf->waiter);
+  pf->size = size;
+  pf->tail = 0;
+  pf->idle_seq = hs_waiter_seq(&pf->waiter) - 1; // not idle until it polls
+  pf->stop = false;
+
+  pf->slots = calloc(size, sizeof(hs_prefetch_slot));
+  if (!pf->slots) {
+    hs_log(NULL, g_module, 0, "slots calloc failed");
+    exit(EXIT_FAILURE);
+  }
+  pf->cursors = calloc(consumers_cnt, sizeof(hs_prefetch_cursor));
+  if (!pf->cursors) {
+    hs_log(NULL, g_module, 0, "cursors calloc failed");
+    exit(EXIT_FAILURE);
+  }
+  pf->cursors_cnt = consumers_cnt;
+  for (int i = 0; i < consumers_cnt; ++i) {
+    pf->cursors[i].head = 0;
+    pf->cursors[i].waiter = consumers[i];
+  }
+  for (unsigned i = 0; i < size; ++i) {
+    if (lsb_init_heka_message(&pf->slots[i].msg, 8)) {
+      hs_log(NULL, g_module, 0, "failed to initialize the message");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < shards; ++i) {
+    input[i].decode = false; // framed only, the slot copy is decoded
+  }
+}
+
+
+void hs_free_prefetch(hs_prefetch *pf)
+{
+  for (unsigned i = 0; i < pf->size; ++i) {
+    lsb_free_heka_message(&pf->slots[i].msg);
+    free(pf->slots[i].buf);
+  }
+  free(pf->slots);
+  pf->slots = NULL;
+  pf->size = 0;
+  free(pf->cursors);
+  pf->cursors = NULL;
+  pf->cursors_cnt = 0;
+  for (int i = 0; i < pf->shards; ++i) {
+    pf->input[i].decode = true;
+  }
+}
+
+
+void hs_start_prefetch(hs_prefetch *pf)
+{
+  int ret = pthread_create(&pf->thread, NULL, prefetch_thread, (void *)pf);
+  if (ret) {
+    perror("prefetch pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+void hs_stop_prefetch(hs_prefetch *pf)
+{
+  __atomic_store_n(&pf->stop, true, __ATOMIC_RELEASE);
+  hs_notify_waiter(&pf->waiter);
+  pthread_join(pf->thread, NULL);
+}
+
+
+hs_prefetch_slot* hs_peek_prefetch(hs_prefetch *pf, int consumer, bool *idle)
+{
+  hs_prefetch_cursor *c = &pf->cursors[consumer];
+  int seq = hs_waiter_seq(&pf->waiter);
+  if (__atomic_load_n(&pf->tail, __ATOMIC_ACQUIRE) != c->head) {
+    *idle = false;
+    return &pf->slots[c->head % pf->size];
+  }
+  *idle = __atomic_load_n(&pf->idle_seq, __ATOMIC_ACQUIRE) == seq;
+  return NULL;
+}
+
+
+void hs_release_prefetch(hs_prefetch *pf, int consumer)
+{
+  hs_prefetch_cursor *c = &pf->cursors[consumer];
+  __atomic_store_n(&c->head, c->head + 1, __ATOMIC_RELEASE);
+  hs_notify_waiter(&pf->waiter);
+}
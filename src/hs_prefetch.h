@@ -0,0 +1,125 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Hindsight queue reader decode-ahead stage @file */
+
+#ifndef hs_prefetch_h_
+#define hs_prefetch_h_
+
+#include <luasandbox/util/heka_message.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hs_checkpoint_reader.h"
+#include "hs_config.h"
+#include "hs_input.h"
+#include "hs_waiter.h"
+
+#define HS_PREFETCH_SIZE 256 // shared reader slots when none are configured
+
+typedef struct hs_prefetch_slot
+{
+  lsb_heka_message msg;      // decoded from buf (read only for the consumers)
+  char             *buf;     // copy of the framed message
+  size_t           buf_size;
+  hs_checkpoint    cp;       // queue position after the message
+  int              shard;
+  bool             reset;    // cp was reset to the end of the queue, no msg
+} hs_prefetch_slot;
+
+// Consumer sequence counter, each one on its own cache line
+typedef struct hs_prefetch_cursor
+{
+  unsigned  head;   // next slot to consume
+  hs_waiter *waiter; // consumer's, woken when a slot is filled
+} __attribute__((aligned(64))) hs_prefetch_cursor;
+
+// A thread reading, framing and decoding the next messages of a set of queue
+// shards into a ring shared by one or more consumers (each message is decoded
+// once whatever the number of consumers). A slot is only refilled after every
+// consumer has released it and the consumers only advance their checkpoints
+// from the slots they have released.
+typedef struct hs_prefetch
+{
+  hs_input              *input;    // one per shard
+  int                   shards;
+  int                   rr;        // round robin input shard
+  const hs_config       *cfg;
+  hs_checkpoint_reader  *cpr;
+  hs_waiter             waiter;    // woken by the queue writers and releases
+
+  hs_prefetch_slot      *slots;
+  unsigned              size;
+  unsigned              tail;      // next slot to fill
+  int                   idle_seq;  // waiter sequence of the last poll that
+                                   // found nothing new
+  hs_prefetch_cursor    *cursors;
+  int                   cursors_cnt;
+  bool                  stop;
+  pthread_t             thread;
+} hs_prefetch;
+
+/**
+ * Initializes the stage, its waiter must be registered with the queue writers
+ * instead of the consumers'
+ *
+ * @param pf Stage to initialize
+ * @param size Number of slots
+ * @param input Queue shard readers (positioned where the stage starts)
+ * @param shards Number of shards
+ * @param cfg Hindsight configuration
+ * @param cpr Checkpoint reader
+ * @param consumers Consumer waiters (the index is the consumer id)
+ * @param consumers_cnt Number of consumers
+ */
+void hs_init_prefetch(hs_prefetch *pf, unsigned size, hs_input *input,
+                      int shards, const hs_config *cfg,
+                      hs_checkpoint_reader *cpr, hs_waiter **consumers,
+                      int consumers_cnt);
+
+/**
+ * Frees the stage (it must be stopped)
+ *
+ * @param pf Stage to free
+ */
+void hs_free_prefetch(hs_prefetch *pf);
+
+/**
+ * Starts the prefetch thread
+ *
+ * @param pf Initialized stage
+ */
+void hs_start_prefetch(hs_prefetch *pf);
+
+/**
+ * Stops and joins the prefetch thread, the unconsumed slots are discarded
+ *
+ * @param pf Running stage
+ */
+void hs_stop_prefetch(hs_prefetch *pf);
+
+/**
+ * Returns the consumer's oldest unreleased slot
+ *
+ * @param pf Running stage
+ * @param consumer Consumer id
+ * @param idle Set to true when there is no slot and the prefetch thread found
+ *             nothing new on its last poll
+ *
+ * @return hs_prefetch_slot* NULL if no slot is ready
+ */
+hs_prefetch_slot* hs_peek_prefetch(hs_prefetch *pf, int consumer, bool *idle);
+
+/**
+ * Releases the slot returned by hs_peek_prefetch
+ *
+ * @param pf Running stage
+ * @param consumer Consumer id
+ */
+void hs_release_prefetch(hs_prefetch *pf, int consumer);
+
+#endif
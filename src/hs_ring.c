@@ -0,0 +1,127 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight single producer/single consumer byte ring @file */
+
+#include "hs_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+int hs_init_ring(hs_ring *r, size_t min_size)
+{
+  size_t size = 1024;
+  while (size < min_size) {
+    size <<= 1;
+    if (size == 0) return 1;
+  }
+
+  r->buf = malloc(size);
+  if (!r->buf) return 1;
+  r->size = size;
+  r->mask = size - 1;
+  r->waiting = false;
+  r->rate = 0;
+  r->tokens = 0;
+  r->last_ns = 0;
+  r->weight = 1;
+  r->injected = 0;
+  r->injected_last = 0;
+  r->usage = 0;
+  r->head = 0;
+  r->tail = 0;
+  return 0;
+}
+
+
+void hs_free_ring(hs_ring *r)
+{
+  free(r->buf);
+  r->buf = NULL;
+  r->size = 0;
+  r->mask = 0;
+  r->head = 0;
+  r->tail = 0;
+}
+
+
+size_t hs_ring_space(hs_ring *r)
+{
+  size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  return r->size - (r->head - tail);
+}
+
+
+bool hs_ring_push(hs_ring *r, const struct iovec *iov, int iovcnt)
+{
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+  if (len > hs_ring_space(r)) return false;
+
+  size_t pos = r->head;
+  for (int i = 0; i < iovcnt; ++i) {
+    const char *src = iov[i].iov_base;
+    size_t n = iov[i].iov_len;
+    while (n) {
+      size_t idx = pos & r->mask;
+      size_t chunk = r->size - idx;
+      if (chunk > n) chunk = n;
+      memcpy(r->buf + idx, src, chunk);
+      src += chunk;
+      pos += chunk;
+      n -= chunk;
+    }
+  }
+  __atomic_store_n(&r->head, pos, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+size_t hs_ring_used(hs_ring *r)
+{
+  size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  return head - r->tail;
+}
+
+
+void hs_ring_copy(const hs_ring *r, size_t offset, void *dst, size_t len)
+{
+  struct iovec iov[2];
+  int cnt = hs_ring_map(r, offset, len, iov);
+  char *d = dst;
+  for (int i = 0; i < cnt; ++i) {
+    memcpy(d, iov[i].iov_base, iov[i].iov_len);
+    d += iov[i].iov_len;
+  }
+}
+
+
+int hs_ring_map(const hs_ring *r, size_t offset, size_t len,
+                struct iovec *iov)
+{
+  if (len == 0) return 0;
+
+  size_t idx = (r->tail + offset) & r->mask;
+  size_t chunk = r->size - idx;
+  iov[0].iov_base = r->buf + idx;
+  if (chunk >= len) {
+    iov[0].iov_len = len;
+    return 1;
+  }
+  iov[0].iov_len = chunk;
+  iov[1].iov_base = r->buf;
+  iov[1].iov_len = len - chunk;
+  return 2;
+}
+
+
+void hs_ring_consume(hs_ring *r, size_t len)
+{
+  __atomic_store_n(&r->tail, r->tail + len, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,126 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Hindsight single producer/single consumer byte ring @file */
+
+#ifndef hs_ring_h_
+#define hs_ring_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define HS_CACHE_LINE 64
+
+// the rings are embedded in heap allocated structures so the positions are
+// kept on separate cache lines with padding instead of alignment attributes
+typedef struct hs_ring
+{
+  char    *buf;
+  size_t  size; // power of two
+  size_t  mask;
+  bool    waiting; // producer is blocked waiting for space
+
+  // producer token bucket used while the queue applies backpressure, the rate
+  // (bytes per second) is assigned by the queue
+  unsigned long long  rate;
+  double              tokens;
+  long long           last_ns;
+
+  // backpressure attribution, injected is only written by the producer the
+  // rest is maintained by the queue
+  unsigned            weight;
+  unsigned long long  injected;      // bytes queued
+  unsigned long long  injected_last; // injected at the last usage sample
+  double              usage;         // smoothed bytes per second
+  char    pad0[HS_CACHE_LINE];
+  size_t  head; // producer position
+  char    pad1[HS_CACHE_LINE - sizeof(size_t)];
+  size_t  tail; // consumer position
+  char    pad2[HS_CACHE_LINE - sizeof(size_t)];
+} hs_ring;
+
+/**
+ * Allocates the ring buffer
+ *
+ * @param r Ring to initialize
+ * @param min_size Minimum capacity in bytes (rounded up to a power of two)
+ *
+ * @return int 0 on success
+ */
+int hs_init_ring(hs_ring *r, size_t min_size);
+
+/**
+ * Frees the ring buffer
+ *
+ * @param r Ring to free
+ */
+void hs_free_ring(hs_ring *r);
+
+/**
+ * Returns the number of bytes the producer can write without blocking
+ * (producer side only)
+ *
+ * @param r Ring
+ *
+ * @return size_t Available space
+ */
+size_t hs_ring_space(hs_ring *r);
+
+/**
+ * Copies the iovecs into the ring and publishes them as a single unit; the
+ * consumer will never see a partial write (producer side only)
+ *
+ * @param r Ring
+ * @param iov Data to copy
+ * @param iovcnt Number of entries in iov
+ *
+ * @return bool False if there is not enough space (nothing is written)
+ */
+bool hs_ring_push(hs_ring *r, const struct iovec *iov, int iovcnt);
+
+/**
+ * Returns the number of bytes available to the consumer (consumer side only)
+ *
+ * @param r Ring
+ *
+ * @return size_t Bytes pending
+ */
+size_t hs_ring_used(hs_ring *r);
+
+/**
+ * Copies data out of the ring without consuming it (consumer side only)
+ *
+ * @param r Ring
+ * @param offset Offset from the current tail
+ * @param dst Destination buffer
+ * @param len Number of bytes to copy
+ */
+void hs_ring_copy(const hs_ring *r, size_t offset, void *dst, size_t len);
+
+/**
+ * Maps a region of pending data to at most two iovecs (the region may wrap)
+ * (consumer side only)
+ *
+ * @param r Ring
+ * @param offset Offset from the current tail
+ * @param len Number of bytes in the region
+ * @param iov Array of at least two iovecs to populate
+ *
+ * @return int Number of iovecs used
+ */
+int hs_ring_map(const hs_ring *r, size_t offset, size_t len,
+                struct iovec *iov);
+
+/**
+ * Releases consumed bytes back to the producer (consumer side only)
+ *
+ * @param r Ring
+ * @param len Number of bytes consumed
+ */
+void hs_ring_consume(hs_ring *r, size_t len);
+
+#endif
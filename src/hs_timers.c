@@ -0,0 +1,150 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight plugin timer_event schedule implementation @file */
+
+#include "hs_timers.h"
+
+#include <stdlib.h>
+
+#include "hs_logger.h"
+
+static const char g_module[] = "timers";
+
+
+static void place(hs_timers *t, int idx, hs_timer timer)
+{
+  t->heap[idx] = timer;
+  t->pos[timer.slot] = idx;
+}
+
+
+static void sift_up(hs_timers *t, int idx)
+{
+  hs_timer timer = t->heap[idx];
+  while (idx > 0) {
+    int parent = (idx - 1) / 2;
+    if (t->heap[parent].expires <= timer.expires) break;
+    place(t, idx, t->heap[parent]);
+    idx = parent;
+  }
+  place(t, idx, timer);
+}
+
+
+static void sift_down(hs_timers *t, int idx)
+{
+  hs_timer timer = t->heap[idx];
+  for (;;) {
+    int child = idx * 2 + 1;
+    if (child >= t->cnt) break;
+    if (child + 1 < t->cnt
+        && t->heap[child + 1].expires < t->heap[child].expires) {
+      ++child;
+    }
+    if (timer.expires <= t->heap[child].expires) break;
+    place(t, idx, t->heap[child]);
+    idx = child;
+  }
+  place(t, idx, timer);
+}
+
+
+static void grow_pos(hs_timers *t, int slot)
+{
+  int cap = t->pos_cap ? t->pos_cap : 8;
+  while (cap <= slot) cap *= 2;
+  int *tmp = realloc(t->pos, sizeof(int) * cap);
+  if (!tmp) {
+    hs_log(NULL, g_module, 0, "timer positions realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = t->pos_cap; i < cap; ++i) {
+    tmp[i] = -1;
+  }
+  t->pos = tmp;
+  t->pos_cap = cap;
+}
+
+
+void hs_init_timers(hs_timers *t)
+{
+  t->heap = NULL;
+  t->cnt = 0;
+  t->cap = 0;
+  t->pos = NULL;
+  t->pos_cap = 0;
+}
+
+
+void hs_free_timers(hs_timers *t)
+{
+  free(t->heap);
+  free(t->pos);
+  hs_init_timers(t);
+}
+
+
+void hs_schedule_timer(hs_timers *t, int slot, time_t expires)
+{
+  if (slot >= t->pos_cap) grow_pos(t, slot);
+
+  int idx = t->pos[slot];
+  if (idx >= 0) {
+    time_t prev = t->heap[idx].expires;
+    t->heap[idx].expires = expires;
+    if (expires < prev) {
+      sift_up(t, idx);
+    } else {
+      sift_down(t, idx);
+    }
+    return;
+  }
+
+  if (t->cnt == t->cap) {
+    int cap = t->cap ? t->cap * 2 : 8;
+    hs_timer *tmp = realloc(t->heap, sizeof(hs_timer) * cap);
+    if (!tmp) {
+      hs_log(NULL, g_module, 0, "timer heap realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    t->heap = tmp;
+    t->cap = cap;
+  }
+  t->heap[t->cnt] = (hs_timer){ .expires = expires, .slot = slot };
+  sift_up(t, t->cnt++);
+}
+
+
+void hs_cancel_timer(hs_timers *t, int slot)
+{
+  if (slot >= t->pos_cap || t->pos[slot] < 0) return;
+
+  int idx = t->pos[slot];
+  t->pos[slot] = -1;
+  if (--t->cnt == idx) return;
+
+  time_t prev = t->heap[idx].expires;
+  place(t, idx, t->heap[t->cnt]);
+  if (t->heap[idx].expires < prev) {
+    sift_up(t, idx);
+  } else {
+    sift_down(t, idx);
+  }
+}
+
+
+int hs_due_timer(const hs_timers *t, time_t current_t)
+{
+  if (t->cnt == 0 || t->heap[0].expires > current_t) return -1;
+  return t->heap[0].slot;
+}
+
+
+time_t hs_next_timer(const hs_timers *t)
+{
+  return t->cnt ? t->heap[0].expires : 0;
+}
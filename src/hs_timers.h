@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Hindsight plugin timer_event schedule @file */
+
+#ifndef hs_timers_h_
+#define hs_timers_h_
+
+#include <time.h>
+
+typedef struct hs_timer
+{
+  time_t  expires;
+  int     slot;
+} hs_timer;
+
+// Per analysis thread min-heap of the plugin list slots by their next
+// timer_event so a message only has to look at the earliest one
+typedef struct hs_timers
+{
+  hs_timer  *heap;
+  int       cnt;
+  int       cap;
+  int       *pos;      // heap position indexed by the slot (-1 unscheduled)
+  int       pos_cap;
+} hs_timers;
+
+void hs_init_timers(hs_timers *t);
+
+void hs_free_timers(hs_timers *t);
+
+/**
+ * Schedules (or reschedules) the timer of a plugin list slot
+ *
+ * @param t Timers
+ * @param slot Plugin list slot
+ * @param expires Time the timer_event is due
+ */
+void hs_schedule_timer(hs_timers *t, int slot, time_t expires);
+
+/**
+ * Removes the timer of a plugin list slot (if any)
+ *
+ * @param t Timers
+ * @param slot Plugin list slot
+ */
+void hs_cancel_timer(hs_timers *t, int slot);
+
+/**
+ * Returns the slot of the earliest timer if it is due
+ *
+ * @param t Timers
+ * @param current_t Current time
+ *
+ * @return int Slot or -1 if no timer is due
+ */
+int hs_due_timer(const hs_timers *t, time_t current_t);
+
+/**
+ * Returns when the earliest timer is due
+ *
+ * @param t Timers
+ *
+ * @return time_t Expiration or 0 if nothing is scheduled
+ */
+time_t hs_next_timer(const hs_timers *t);
+
+#endif
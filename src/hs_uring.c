@@ -0,0 +1,213 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight io_uring queue I/O engine @file */
+
+#define _GNU_SOURCE
+
+#include "hs_uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WITH_IO_URING
+#include <liburing.h>
+#include <unistd.h>
+
+#include "hs_logger.h"
+
+static const char g_module[] = "uring";
+
+struct hs_uring
+{
+  struct io_uring ring;
+  char            *buf;
+  size_t          buf_size;
+  bool            has_file;
+  bool            busy;
+};
+
+
+hs_uring* hs_create_uring(size_t buf_size)
+{
+  hs_uring *u = calloc(1, sizeof(hs_uring));
+  if (!u) return NULL;
+
+  int ret = io_uring_queue_init(4, &u->ring, 0);
+  if (ret < 0) {
+    hs_log(NULL, g_module, 6, "io_uring unavailable: %s", strerror(-ret));
+    free(u);
+    return NULL;
+  }
+
+  if (buf_size) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (posix_memalign((void **)&u->buf, page > 0 ? page : 4096, buf_size)) {
+      io_uring_queue_exit(&u->ring);
+      free(u);
+      return NULL;
+    }
+    struct iovec iov = { .iov_base = u->buf, .iov_len = buf_size };
+    ret = io_uring_register_buffers(&u->ring, &iov, 1);
+    if (ret < 0) {
+      hs_log(NULL, g_module, 6, "buffer registration failed: %s",
+             strerror(-ret));
+      hs_destroy_uring(u);
+      return NULL;
+    }
+    u->buf_size = buf_size;
+  }
+  return u;
+}
+
+
+void hs_destroy_uring(hs_uring *u)
+{
+  if (!u) return;
+  if (u->busy) hs_uring_wait(u);
+  io_uring_queue_exit(&u->ring);
+  free(u->buf);
+  free(u);
+}
+
+
+int hs_uring_set_file(hs_uring *u, int fd)
+{
+  int ret;
+  if (u->has_file) {
+    ret = io_uring_register_files_update(&u->ring, 0, &fd, 1);
+    if (ret == 1) ret = 0;
+  } else {
+    ret = io_uring_register_files(&u->ring, &fd, 1);
+    if (!ret) u->has_file = true;
+  }
+  if (ret < 0) {
+    hs_log(NULL, g_module, 3, "file registration failed: %s", strerror(-ret));
+  }
+  return ret;
+}
+
+
+char* hs_uring_buffer(hs_uring *u, size_t *size)
+{
+  *size = u->buf_size;
+  return u->buf;
+}
+
+
+int hs_uring_writev(hs_uring *u, const struct iovec *iov, int iovcnt,
+                    off_t offset)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+  if (!sqe) return -EBUSY;
+  io_uring_prep_writev(sqe, 0, iov, iovcnt, offset);
+  io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+  int ret = io_uring_submit(&u->ring);
+  if (ret < 0) return ret;
+  u->busy = true;
+  return 0;
+}
+
+
+int hs_uring_read(hs_uring *u, off_t offset)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+  if (!sqe) return -EBUSY;
+  io_uring_prep_read_fixed(sqe, 0, u->buf, u->buf_size, offset, 0);
+  io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+  int ret = io_uring_submit(&u->ring);
+  if (ret < 0) return ret;
+  u->busy = true;
+  return 0;
+}
+
+
+ssize_t hs_uring_wait(hs_uring *u)
+{
+  struct io_uring_cqe *cqe;
+  int ret;
+  do {
+    ret = io_uring_wait_cqe(&u->ring, &cqe);
+  } while (ret == -EINTR);
+  u->busy = false;
+  if (ret < 0) return ret;
+
+  ssize_t res = cqe->res;
+  io_uring_cqe_seen(&u->ring, cqe);
+  return res;
+}
+
+
+bool hs_uring_busy(hs_uring *u)
+{
+  return u->busy;
+}
+
+#else
+
+hs_uring* hs_create_uring(size_t buf_size)
+{
+  (void)buf_size;
+  return NULL;
+}
+
+
+void hs_destroy_uring(hs_uring *u)
+{
+  (void)u;
+}
+
+
+int hs_uring_set_file(hs_uring *u, int fd)
+{
+  (void)u;
+  (void)fd;
+  return -ENOSYS;
+}
+
+
+char* hs_uring_buffer(hs_uring *u, size_t *size)
+{
+  (void)u;
+  *size = 0;
+  return NULL;
+}
+
+
+int hs_uring_writev(hs_uring *u, const struct iovec *iov, int iovcnt,
+                    off_t offset)
+{
+  (void)u;
+  (void)iov;
+  (void)iovcnt;
+  (void)offset;
+  return -ENOSYS;
+}
+
+
+int hs_uring_read(hs_uring *u, off_t offset)
+{
+  (void)u;
+  (void)offset;
+  return -ENOSYS;
+}
+
+
+ssize_t hs_uring_wait(hs_uring *u)
+{
+  (void)u;
+  return -ENOSYS;
+}
+
+
+bool hs_uring_busy(hs_uring *u)
+{
+  (void)u;
+  return false;
+}
+
+#endif
@@ -0,0 +1,100 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Hindsight io_uring queue I/O engine @file */
+
+#ifndef hs_uring_h_
+#define hs_uring_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef struct hs_uring hs_uring;
+
+/**
+ * Creates an io_uring instance with a single fixed file slot and an optional
+ * registered buffer; only one operation is outstanding at a time
+ *
+ * @param buf_size Size of the registered read buffer (0 for none)
+ *
+ * @return hs_uring* NULL if io_uring support was not compiled in or the kernel
+ *         does not provide it (the caller falls back to the stdio/syscall
+ *         path)
+ */
+hs_uring* hs_create_uring(size_t buf_size);
+
+/**
+ * Waits for any outstanding operation and releases the ring
+ *
+ * @param u Ring to destroy (can be NULL)
+ */
+void hs_destroy_uring(hs_uring *u);
+
+/**
+ * Points the fixed file slot at a new descriptor, any outstanding operation
+ * must have been waited on
+ *
+ * @param u Ring
+ * @param fd File descriptor
+ *
+ * @return int 0 on success
+ */
+int hs_uring_set_file(hs_uring *u, int fd);
+
+/**
+ * Returns the registered read buffer
+ *
+ * @param u Ring
+ * @param size Returns the size of the buffer
+ *
+ * @return char* Registered buffer
+ */
+char* hs_uring_buffer(hs_uring *u, size_t *size);
+
+/**
+ * Queues a gathered write to the fixed file
+ *
+ * @param u Ring
+ * @param iov Data to write (must remain valid until hs_uring_wait returns)
+ * @param iovcnt Number of entries in iov
+ * @param offset File offset
+ *
+ * @return int 0 on success
+ */
+int hs_uring_writev(hs_uring *u, const struct iovec *iov, int iovcnt,
+                    off_t offset);
+
+/**
+ * Queues a read from the fixed file into the registered buffer
+ *
+ * @param u Ring
+ * @param offset File offset
+ *
+ * @return int 0 on success
+ */
+int hs_uring_read(hs_uring *u, off_t offset);
+
+/**
+ * Waits for the outstanding operation to complete
+ *
+ * @param u Ring
+ *
+ * @return ssize_t Bytes transferred or -errno
+ */
+ssize_t hs_uring_wait(hs_uring *u);
+
+/**
+ * Returns true if an operation is outstanding
+ *
+ * @param u Ring
+ *
+ * @return bool
+ */
+bool hs_uring_busy(hs_uring *u);
+
+#endif
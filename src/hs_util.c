@@ -8,6 +8,7 @@
 
 #include "hs_util.h"
 
+#include <ctype.h>
 #include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,6 +39,18 @@ int hs_get_fqfn(const char *path,
 }
 
 
+int hs_get_shard_dir(int shard, int shards, char *subdir, size_t subdir_len)
+{
+  int rv;
+  if (shards > 1) {
+    rv = snprintf(subdir, subdir_len, "%s/%d", hs_input_dir, shard);
+  } else {
+    rv = snprintf(subdir, subdir_len, "%s", hs_input_dir);
+  }
+  return (rv < 0 || rv > (int)subdir_len - 1);
+}
+
+
 bool hs_find_lua(const hs_config *cfg,
                  const hs_sandbox_config *sbc,
                  const char *ptype,
@@ -90,6 +103,19 @@ bool hs_has_ext(const char *fn, const char *ext)
 }
 
 
+bool hs_extract_id(const char *fn, unsigned long long *id)
+{
+  size_t l = strlen(fn);
+  size_t i = 0;
+  for (; i < l && isdigit(fn[i]); ++i);
+  if (i > 0 && i + 4 == l && strncmp(fn + i, ".log", 4) == 0) {
+    *id = strtoull(fn, NULL, 10);
+    return true;
+  }
+  return false;
+}
+
+
 unsigned hs_disk_free_ob(const char *path, unsigned ob_size)
 {
   struct statfs buf;
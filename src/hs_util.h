@@ -35,6 +35,16 @@ bool hs_file_exists(const char *fn);
  */
 bool hs_has_ext(const char *fn, const char *ext);
 
+/**
+ * Extracts the id from a queue file name (<id>.log)
+ *
+ * @param fn filename
+ * @param id Populated with the id when the name matches
+ *
+ * @return bool True if fn is a queue file name
+ */
+bool hs_extract_id(const char *fn, unsigned long long *id);
+
 /**
  * Attempts to locate the Lua file in the run_path and then the install_path.
  * Returns true if the file was found and the fully qualified filename was added
@@ -69,6 +79,19 @@ int hs_get_fqfn(const char *path,
                 char *fqfn,
                 size_t fqfn_len);
 
+/**
+ * Constructs the queue directory name of an input queue shard; a single shard
+ * uses the unsharded layout (input) otherwise it is input/<shard>
+ *
+ * @param shard Shard index
+ * @param shards Number of input queue shards
+ * @param subdir Buffer to construct the string in
+ * @param subdir_len Length of the buffer
+ *
+ * @return int 0 if string was successfully constructed
+ */
+int hs_get_shard_dir(int shard, int shards, char *subdir, size_t subdir_len);
+
 /**
  * Escapes a string being written to a Lua file
  *
@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight queue reader wakeup implementation @file */
+
+#define _GNU_SOURCE
+
+#include "hs_waiter.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+void hs_init_waiter(hs_waiter *w)
+{
+  w->seq = 0;
+  w->sleeping = 0;
+}
+
+
+int hs_waiter_seq(hs_waiter *w)
+{
+  return __atomic_load_n(&w->seq, __ATOMIC_SEQ_CST);
+}
+
+
+void hs_wait(hs_waiter *w, int seq, time_t deadline)
+{
+  struct timespec ts = { .tv_sec = deadline, .tv_nsec = 0 };
+  __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+  // the kernel compares seq before sleeping, a notification that raced with
+  // the poll returns EAGAIN immediately; the absolute timeout (bitset wait)
+  // keeps the timer events aligned to the second
+  while (__atomic_load_n(&w->seq, __ATOMIC_SEQ_CST) == seq) {
+    long rv = syscall(SYS_futex, &w->seq,
+                      FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG
+                      | FUTEX_CLOCK_REALTIME, seq, &ts, NULL,
+                      FUTEX_BITSET_MATCH_ANY);
+    if (rv == -1 && errno == EINTR) continue;
+    break; // woken, timed out or seq already changed
+  }
+  __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+
+void hs_notify_waiter(hs_waiter *w)
+{
+  __atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)) {
+    syscall(SYS_futex, &w->seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX,
+            NULL, NULL, 0);
+  }
+}
@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Hindsight queue reader wakeup (futex) @file */
+
+#ifndef hs_waiter_h_
+#define hs_waiter_h_
+
+#include <time.h>
+
+// One per reader thread, registered with every queue it reads. The queue
+// writers bump seq after new data becomes visible; the reader captures seq
+// before polling its inputs and only sleeps if it has not changed since.
+typedef struct hs_waiter
+{
+  int seq;      // futex word
+  int sleeping; // the reader is (about to be) blocked in the futex
+} hs_waiter;
+
+/**
+ * Initializes the waiter
+ *
+ * @param w Waiter to initialize
+ */
+void hs_init_waiter(hs_waiter *w);
+
+/**
+ * Returns the current notification sequence, to be captured before the reader
+ * polls its inputs
+ *
+ * @param w Reader's waiter
+ *
+ * @return int
+ */
+int hs_waiter_seq(hs_waiter *w);
+
+/**
+ * Blocks until the waiter is notified after seq was captured or the wall clock
+ * reaches the deadline
+ *
+ * @param w Reader's waiter
+ * @param seq Value returned by hs_waiter_seq
+ * @param deadline Absolute CLOCK_REALTIME second to wake up at (timer events)
+ */
+void hs_wait(hs_waiter *w, int seq, time_t deadline);
+
+/**
+ * Wakes the reader (new queue data or a stop request)
+ *
+ * @param w Reader's waiter
+ */
+void hs_notify_waiter(hs_waiter *w);
+
+#endif
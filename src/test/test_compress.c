@@ -0,0 +1,326 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight compressed queue unit tests @file */
+
+#include "test.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../hs_input.h"
+#include "../hs_logger.h"
+#include "../hs_output.h"
+
+#define QUEUE_PATH "compress_queue"
+#define QUEUE_SUBDIR "input"
+#define QUEUE_FILE QUEUE_PATH "/" QUEUE_SUBDIR "/0.log"
+#define MAX_MSGS 64
+#define MAX_BLOCKS 8
+#define PAYLOAD_SIZE 4096
+
+typedef struct queue_message
+{
+  size_t    offset; // position in the uncompressed message stream
+  long long timestamp;
+} queue_message;
+
+static queue_message msgs[MAX_MSGS];
+static int msgs_cnt;
+static size_t stream_end;
+static int blocks_cnt;
+static int block_first[MAX_BLOCKS]; // first message of each block
+
+static char output_path[] = QUEUE_PATH;
+static hs_config cfg;
+static hs_queue_config qcfg;
+
+
+static int output_varint(unsigned char *buf, unsigned long long v)
+{
+  int n = 0;
+  do {
+    buf[n] = v & 0x7f;
+    v >>= 7;
+    if (v) buf[n] |= 0x80;
+    ++n;
+  } while (v);
+  return n;
+}
+
+
+/**
+ * Builds a message with the required Uuid and Timestamp fields and a payload
+ * that is either repetitive or random (incompressible, stored as is)
+ */
+static size_t make_message(unsigned char *pb, long long ts, int seq,
+                           bool random)
+{
+  size_t pblen = 0;
+  pb[pblen++] = 0x0a; // Uuid
+  pb[pblen++] = 16;
+  memset(pb + pblen, 0, 16);
+  memcpy(pb + pblen, &seq, sizeof(seq));
+  pblen += 16;
+  pb[pblen++] = 0x10; // Timestamp
+  pblen += output_varint(pb + pblen, (unsigned long long)ts);
+
+  size_t len = random ? PAYLOAD_SIZE : 200;
+  pb[pblen++] = 0x32; // Payload
+  pblen += output_varint(pb + pblen, len);
+  for (size_t i = 0; i < len; ++i) {
+    pb[pblen++] = random ? (unsigned char)rand() : 'a' + i % 4;
+  }
+  return pblen;
+}
+
+
+static void remove_queue()
+{
+  unlink(QUEUE_FILE);
+  rmdir(QUEUE_PATH "/" QUEUE_SUBDIR);
+  rmdir(QUEUE_PATH);
+}
+
+
+static void init_queue(char codec)
+{
+  remove_queue();
+  msgs_cnt = 0;
+  stream_end = 0;
+  blocks_cnt = 0;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.output_path = output_path;
+  cfg.output_size = 64 * 1024 * 1024;
+  cfg.max_message_size = 64 * 1024;
+  memset(&qcfg, 0, sizeof(qcfg));
+  qcfg.sync = 'n';
+  qcfg.compression = codec;
+}
+
+
+/**
+ * Writes a block of cnt messages through the output, everything pushed to the
+ * ring before the flush is compressed together
+ */
+static char* write_block(hs_output *output, hs_ring *r, int cnt, bool random)
+{
+  unsigned char pb[PAYLOAD_SIZE + 64];
+  mu_assert(blocks_cnt < MAX_BLOCKS, "too many blocks");
+  block_first[blocks_cnt++] = msgs_cnt;
+  for (int i = 0; i < cnt; ++i) {
+    mu_assert(msgs_cnt < MAX_MSGS, "too many messages");
+    long long ts = 1000 + msgs_cnt;
+    size_t len = make_message(pb, ts, msgs_cnt, random);
+    msgs[msgs_cnt].offset = stream_end;
+    msgs[msgs_cnt].timestamp = ts;
+    stream_end += hs_output_message(output, r, (const char *)pb, len);
+    ++msgs_cnt;
+  }
+  pthread_mutex_lock(&output->lock);
+  hs_flush_output(output);
+  pthread_mutex_unlock(&output->lock);
+  return NULL;
+}
+
+
+/**
+ * Appends the blocks described by kinds ('c' compressible, 'r' random) to the
+ * queue
+ */
+static char* write_queue(const char *kinds)
+{
+  hs_output output;
+  hs_ring r;
+  hs_init_output(&output, &cfg, &qcfg, QUEUE_SUBDIR);
+  mu_assert(output.cp.offset == stream_end, "resumed at: %zu expected: %zu",
+            output.cp.offset, stream_end);
+  mu_assert(hs_init_ring(&r, HS_OUTPUT_RING_SIZE) == 0, "hs_init_ring failed");
+  hs_add_output_ring(&output, &r);
+
+  char *ret = NULL;
+  for (const char *k = kinds; *k && !ret; ++k) {
+    ret = write_block(&output, &r, *k == 'r' ? 3 : 8, *k == 'r');
+  }
+
+  hs_remove_output_ring(&output, &r);
+  hs_free_ring(&r);
+  hs_free_output(&output);
+  return ret;
+}
+
+
+static off_t file_size()
+{
+  struct stat st;
+  return stat(QUEUE_FILE, &st) ? -1 : st.st_size;
+}
+
+
+/**
+ * Lists the codecs of the complete blocks in the queue file
+ *
+ * @return off_t File length covered by the complete blocks
+ */
+static off_t read_codecs(char *codecs, size_t len)
+{
+  off_t size = file_size();
+  FILE *fh = fopen(QUEUE_FILE, "rb");
+  off_t pos = 0;
+  size_t cnt = 0;
+  hs_block_header h;
+  while (fh && cnt < len - 1 && pos + (off_t)sizeof(h) <= size
+         && fseek(fh, pos, SEEK_SET) == 0 && fread(&h, sizeof(h), 1, fh) == 1
+         && h.magic == HS_BLOCK_MAGIC
+         && pos + (off_t)sizeof(h) + h.len <= size) {
+    codecs[cnt++] = (char)h.codec;
+    pos += sizeof(h) + h.len;
+  }
+  codecs[cnt] = 0;
+  if (fh) fclose(fh);
+  return pos;
+}
+
+
+static size_t message_offset(int i)
+{
+  return i < msgs_cnt ? msgs[i].offset : stream_end;
+}
+
+
+/**
+ * Reads the queue from the checkpoint of message first expecting every
+ * message from there on, each one followed by the checkpoint of the next
+ */
+static char* read_queue(int first)
+{
+  hs_input hsi;
+  hs_init_input(&hsi, cfg.max_message_size, QUEUE_PATH, QUEUE_SUBDIR, "test",
+                false);
+  hsi.cp.offset = message_offset(first);
+
+  int n = first;
+  long long ts = 0;
+  hs_checkpoint cp = { 0, 0 };
+  bool ok = true;
+  for (int i = 0; i < 10000 && ok; ++i) {
+    hs_input_status s = hs_poll_input(&hsi, &cfg, NULL, 1);
+    if (s == HS_INPUT_IDLE) break;
+    if (s != HS_INPUT_MESSAGE) continue;
+
+    ts = hsi.msg.timestamp;
+    hs_consume_input(&hsi, &cp);
+    ok = n < msgs_cnt && ts == msgs[n].timestamp && cp.id == 0
+        && cp.offset == message_offset(n + 1);
+    if (ok) ++n;
+  }
+  hs_free_input(&hsi);
+  mu_assert(ok, "from %d message %d received: %lld checkpoint: %llu:%zu "
+            "expected: %lld checkpoint: 0:%zu", first, n, ts, cp.id,
+            cp.offset, n < msgs_cnt ? msgs[n].timestamp : -1,
+            message_offset(n + 1));
+  mu_assert(n == msgs_cnt, "from %d received: %d messages expected: %d", first,
+            n - first, msgs_cnt - first);
+  return NULL;
+}
+
+
+/**
+ * Reads the queue from the checkpoint of every message, most of them are in
+ * the middle of a block
+ */
+static char* read_all()
+{
+  for (int i = 0; i <= msgs_cnt; ++i) {
+    char *ret = read_queue(i);
+    if (ret) return ret;
+  }
+  return NULL;
+}
+
+
+static char* test_codec(char codec)
+{
+  init_queue(codec);
+  char *ret = write_queue("crc");
+  if (ret) return ret;
+
+  char codecs[MAX_BLOCKS + 1];
+  char expected[] = { codec, 'n', codec, 0 };
+  read_codecs(codecs, sizeof(codecs));
+  mu_assert(strcmp(codecs, expected) == 0, "%c blocks received: %s", codec,
+            codecs);
+  ret = read_all();
+  if (ret) return ret;
+
+  // tear the last block, the readers stop before it
+  off_t size = file_size();
+  mu_assert(truncate(QUEUE_FILE, size - 10) == 0, "truncate failed");
+  int torn = block_first[--blocks_cnt];
+  msgs_cnt = torn;
+  stream_end = msgs[torn].offset;
+  ret = read_queue(0);
+  if (ret) return ret;
+  ret = read_queue(torn - 1);
+  if (ret) return ret;
+
+  // the writer discards the partial block and resumes after the last
+  // complete one
+  ret = write_queue("c");
+  if (ret) return ret;
+  off_t complete = read_codecs(codecs, sizeof(codecs));
+  mu_assert(strcmp(codecs, expected) == 0, "%c blocks after the recovery: %s",
+            codec, codecs);
+  mu_assert(complete == file_size(), "trailing partial block");
+  return read_all();
+}
+
+
+static char* test_lz4_blocks()
+{
+  if (!hs_codec_available('l')) return NULL;
+  return test_codec('l');
+}
+
+
+static char* test_zstd_blocks()
+{
+  if (!hs_codec_available('z')) return NULL;
+  return test_codec('z');
+}
+
+
+static char* all_tests()
+{
+  mu_run_test(test_lz4_blocks);
+  mu_run_test(test_zstd_blocks);
+  return NULL;
+}
+
+
+int main()
+{
+  hs_init_log(7);
+  srand(1);
+  char *result = all_tests();
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", mu_tests_run);
+  remove_queue();
+  hs_free_log();
+
+  return result != 0;
+}
@@ -49,6 +49,33 @@ static char* test_load_default_config()
             cfg.ipd.instruction_limit);
   mu_assert(cfg.ipd.preserve_data == false, "received %d",
             cfg.ipd.preserve_data);
+  mu_assert(cfg.ipd.backpressure_weight == 1, "received %u",
+            cfg.ipd.backpressure_weight);
+  mu_assert(cfg.iqc.group_commit_bytes == 0, "received %u",
+            cfg.iqc.group_commit_bytes);
+  mu_assert(cfg.iqc.group_commit_usec == 1000, "received %u",
+            cfg.iqc.group_commit_usec);
+  mu_assert(cfg.iqc.preallocate == false, "received %d", cfg.iqc.preallocate);
+  mu_assert(cfg.iqc.sync == 'n', "received %c", cfg.iqc.sync);
+  mu_assert(cfg.iqc.sync_interval_ms == 1000, "received %u",
+            cfg.iqc.sync_interval_ms);
+  mu_assert(cfg.iqc.compression == 'n', "received %c", cfg.iqc.compression);
+  mu_assert(cfg.iqc.mmap_readers == false, "received %d",
+            cfg.iqc.mmap_readers);
+  mu_assert(cfg.iqc.index_interval == 0, "received %u",
+            cfg.iqc.index_interval);
+  mu_assert(cfg.input_shards == 1, "received %d", cfg.input_shards);
+  mu_assert(cfg.analysis_prefetch == 0, "received %u", cfg.analysis_prefetch);
+  mu_assert(cfg.analysis_shared_reader == false, "received %d",
+            cfg.analysis_shared_reader);
+  mu_assert(cfg.analysis_dispatch == true, "received %d",
+            cfg.analysis_dispatch);
+  mu_assert(cfg.analysis_rebalance == 0, "received %u",
+            cfg.analysis_rebalance);
+  mu_assert(cfg.clock_resolution == 100, "received %u", cfg.clock_resolution);
+  mu_assert(cfg.input_read_order == 't', "received %c", cfg.input_read_order);
+  mu_assert(cfg.aqc.group_commit_bytes == 0, "received %u",
+            cfg.aqc.group_commit_bytes);
   hs_free_config(&cfg);
   return NULL;
 }
@@ -84,6 +111,41 @@ static char* test_load_config()
             cfg.ipd.instruction_limit);
   mu_assert(cfg.ipd.preserve_data == true, "received %d",
             cfg.ipd.preserve_data);
+  mu_assert(cfg.ipd.backpressure_weight == 4, "received %u",
+            cfg.ipd.backpressure_weight);
+  mu_assert(cfg.opd.backpressure_weight == 1, "received %u",
+            cfg.opd.backpressure_weight);
+  mu_assert(cfg.iqc.group_commit_bytes == 1024 * 256, "received %u",
+            cfg.iqc.group_commit_bytes);
+  mu_assert(cfg.iqc.group_commit_usec == 500, "received %u",
+            cfg.iqc.group_commit_usec);
+  mu_assert(cfg.iqc.preallocate == true, "received %d", cfg.iqc.preallocate);
+  mu_assert(cfg.iqc.sync == 'i', "received %c", cfg.iqc.sync);
+  mu_assert(cfg.iqc.sync_interval_ms == 250, "received %u",
+            cfg.iqc.sync_interval_ms);
+  mu_assert(cfg.iqc.compression == 'z', "received %c", cfg.iqc.compression);
+  mu_assert(cfg.iqc.mmap_readers == true, "received %d",
+            cfg.iqc.mmap_readers);
+  mu_assert(cfg.aqc.mmap_readers == false, "received %d",
+            cfg.aqc.mmap_readers);
+  mu_assert(cfg.iqc.index_interval == 1024 * 1024, "received %u",
+            cfg.iqc.index_interval);
+  mu_assert(cfg.aqc.index_interval == 0, "received %u",
+            cfg.aqc.index_interval);
+  mu_assert(cfg.aqc.sync == 'n', "received %c", cfg.aqc.sync);
+  mu_assert(cfg.input_shards == 4, "received %d", cfg.input_shards);
+  mu_assert(cfg.analysis_prefetch == 64, "received %u", cfg.analysis_prefetch);
+  mu_assert(cfg.analysis_shared_reader == true, "received %d",
+            cfg.analysis_shared_reader);
+  mu_assert(cfg.analysis_dispatch == false, "received %d",
+            cfg.analysis_dispatch);
+  mu_assert(cfg.analysis_rebalance == 40, "received %u",
+            cfg.analysis_rebalance);
+  mu_assert(cfg.clock_resolution == 10, "received %u", cfg.clock_resolution);
+  mu_assert(cfg.input_read_order == 'r', "received %c", cfg.input_read_order);
+  mu_assert(cfg.aqc.preallocate == false, "received %d", cfg.aqc.preallocate);
+  mu_assert(cfg.aqc.group_commit_bytes == 0, "received %u",
+            cfg.aqc.group_commit_bytes);
   hs_free_config(&cfg);
   return NULL;
 }
@@ -145,6 +207,10 @@ static char* test_sandbox_analysis_config()
             cfg.message_matcher);
   mu_assert(cfg.thread == 1, "received %d", cfg.thread);
   mu_assert(cfg.async_buffer_size == 0, "received %d", cfg.async_buffer_size);
+  mu_assert(cfg.parallelism == 2, "received %u", cfg.parallelism);
+  mu_assert(strcmp(cfg.partition_key, "Fields[client_id]") == 0,
+            "received %s", cfg.partition_key);
+  mu_assert(cfg.partition_merge == true, "received %d", cfg.partition_merge);
 
   hs_free_sandbox_config(&cfg);
   return NULL;
@@ -162,6 +228,7 @@ static char* test_sandbox_output_config()
   mu_assert(cfg.thread == UINT_MAX, "received %d", cfg.thread);
   mu_assert(cfg.rm_cp_terminate == true, "received %d", cfg.rm_cp_terminate);
   mu_assert(cfg.read_queue == 'i', "received %c", cfg.read_queue);
+  mu_assert(cfg.start_time == -7200, "received %lld", cfg.start_time);
 
   hs_free_sandbox_config(&cfg);
   return NULL;
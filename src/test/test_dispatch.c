@@ -0,0 +1,231 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight matcher dispatch key unit tests @file */
+
+#include "test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hs_dispatch.h"
+#include "../hs_logger.h"
+
+/**
+ * Parses a matcher and renders its keys as "T:a L:b" ("" when it is residual)
+ */
+static void parse_keys(const char *matcher, char *s, size_t len)
+{
+  hs_dispatch_keys keys;
+  hs_parse_dispatch_keys(&keys, matcher);
+  s[0] = 0;
+  size_t pos = 0;
+  for (int i = 0; i < keys.cnt && pos < len; ++i) {
+    int ret = snprintf(s + pos, len - pos, "%s%c:%s", i ? " " : "",
+                       keys.items[i].field, keys.items[i].value);
+    if (ret < 0) break;
+    pos += ret;
+  }
+  hs_free_dispatch_keys(&keys);
+}
+
+
+static char* test_single_terms()
+{
+  struct {
+    const char *matcher;
+    const char *keys;
+  } tests[] = {
+    { "Type == 'a'", "T:a" },
+    { "Logger == \"b\"", "L:b" },
+    { "Hostname=='c'", "H:c" },
+    { "  Type  ==  'a'  ", "T:a" },
+    { "Type == ''", "T:" },
+    { "TRUE", "" },
+    { "FALSE", "" },
+    { "Type =~ /a/", "" },
+    { "Type == 'a\\'b'", "" },
+    { "Type == NIL", "" },
+    { "Type == 'a' junk", "" },
+  };
+
+  char s[1024];
+  for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); ++i) {
+    parse_keys(tests[i].matcher, s, sizeof(s));
+    mu_assert(strcmp(s, tests[i].keys) == 0, "%s received: '%s'",
+              tests[i].matcher, s);
+  }
+  return NULL;
+}
+
+
+static char* test_conjunctions_disjunctions()
+{
+  struct {
+    const char *matcher;
+    const char *keys;
+  } tests[] = {
+    { "Type == 'a' && Logger == 'b'", "T:a" },
+    { "Severity < 4 && Logger == 'b'", "L:b" },
+    { "Type == 'a' && Severity < 4", "T:a" },
+    { "Type == 'a' || Logger == 'b'", "T:a L:b" },
+    { "Type == 'a' || Type == 'b' || Hostname == 'c'", "T:a T:b H:c" },
+    { "Type == 'a' || Severity < 4", "" },
+    { "Severity < 4 || Type == 'a'", "" },
+    { "Type == 'a' && Logger == 'b' || Hostname == 'c'", "T:a H:c" },
+    { "Type == 'a' || Logger == 'b' && Hostname == 'c'", "T:a L:b" },
+    { "Type=='a'&&Logger=='b'", "T:a" },
+  };
+
+  char s[1024];
+  for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); ++i) {
+    parse_keys(tests[i].matcher, s, sizeof(s));
+    mu_assert(strcmp(s, tests[i].keys) == 0, "%s received: '%s'",
+              tests[i].matcher, s);
+  }
+  return NULL;
+}
+
+
+static char* test_nested_parentheses()
+{
+  struct {
+    const char *matcher;
+    const char *keys;
+  } tests[] = {
+    { "(Type == 'a')", "T:a" },
+    { "((Type == 'a'))", "T:a" },
+    { "(Type == 'a' || Type == 'b') && Logger == 'c'", "L:c" },
+    { "Logger == 'c' && (Type == 'a' || Type == 'b')", "L:c" },
+    { "(Type == 'a' || Type == 'b') && Severity < 4", "T:a T:b" },
+    { "((Type == 'a' || (Logger == 'b')) && TRUE) || Hostname == 'c'",
+      "T:a L:b H:c" },
+    { "(Type == 'a' || Severity < 4) && Logger == 'b'", "L:b" },
+    { "(Type == 'a' || Severity < 4) || Logger == 'b'", "" },
+    { "(Type == 'a'", "" },
+    { "Type == 'a')", "" },
+  };
+
+  char s[1024];
+  for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); ++i) {
+    parse_keys(tests[i].matcher, s, sizeof(s));
+    mu_assert(strcmp(s, tests[i].keys) == 0, "%s received: '%s'",
+              tests[i].matcher, s);
+  }
+  return NULL;
+}
+
+
+static char* test_negated_terms()
+{
+  struct {
+    const char *matcher;
+    const char *keys;
+  } tests[] = {
+    { "Type != 'a'", "" },
+    { "Type !~ /a/", "" },
+    { "Logger != 'a' || Logger == 'b'", "" },
+    { "Type == 'a' || Hostname != 'b'", "" },
+    { "(Type != 'a' || Type != 'b') && Logger != 'c'", "" },
+    { "Type != 'a' && Logger == 'b'", "L:b" },
+  };
+
+  char s[1024];
+  for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); ++i) {
+    parse_keys(tests[i].matcher, s, sizeof(s));
+    mu_assert(strcmp(s, tests[i].keys) == 0, "%s received: '%s'",
+              tests[i].matcher, s);
+  }
+  return NULL;
+}
+
+
+static char* test_max_keys()
+{
+  char matcher[2048];
+  char expected[1024];
+  size_t mpos = 0, epos = 0;
+  for (int i = 0; i <= HS_DISPATCH_MAX_KEYS; ++i) {
+    if (i == HS_DISPATCH_MAX_KEYS) {
+      char s[1024];
+      parse_keys(matcher, s, sizeof(s));
+      mu_assert(strcmp(s, expected) == 0, "%d terms received: '%s'", i, s);
+    }
+    mpos += snprintf(matcher + mpos, sizeof(matcher) - mpos, "%sType == '%d'",
+                     i ? " || " : "", i);
+    epos += snprintf(expected + epos, sizeof(expected) - epos, "%sT:%d",
+                     i ? " " : "", i);
+  }
+
+  char s[1024];
+  parse_keys(matcher, s, sizeof(s));
+  mu_assert(strcmp(s, "") == 0, "%d terms received: '%s'",
+            HS_DISPATCH_MAX_KEYS + 1, s);
+
+  // the oversized disjunction is residual but the conjunction is still indexed
+  char conjunction[sizeof(matcher) + 32];
+  snprintf(conjunction, sizeof(conjunction), "(%s) && Logger == 'l'", matcher);
+  parse_keys(conjunction, s, sizeof(s));
+  mu_assert(strcmp(s, "L:l") == 0, "received: '%s'", s);
+  return NULL;
+}
+
+
+static char* test_non_header_fields()
+{
+  struct {
+    const char *matcher;
+    const char *keys;
+  } tests[] = {
+    { "Payload == 'a'", "" },
+    { "EnvVersion == '1'", "" },
+    { "Uuid == 'a'", "" },
+    { "Severity == 7", "" },
+    { "Pid == 1", "" },
+    { "Fields[Type] == 'a'", "" },
+    { "Fields[foo bar] == 'a' && Hostname == 'h'", "H:h" },
+    { "Fields[foo][0][0] == 'a' || Type == 'b'", "" },
+    { "Types == 'a'", "" },
+    { "type == 'a'", "" },
+  };
+
+  char s[1024];
+  for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); ++i) {
+    parse_keys(tests[i].matcher, s, sizeof(s));
+    mu_assert(strcmp(s, tests[i].keys) == 0, "%s received: '%s'",
+              tests[i].matcher, s);
+  }
+  return NULL;
+}
+
+
+static char* all_tests()
+{
+  mu_run_test(test_single_terms);
+  mu_run_test(test_conjunctions_disjunctions);
+  mu_run_test(test_nested_parentheses);
+  mu_run_test(test_negated_terms);
+  mu_run_test(test_max_keys);
+  mu_run_test(test_non_header_fields);
+  return NULL;
+}
+
+
+int main()
+{
+  hs_init_log(7);
+  char *result = all_tests();
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", mu_tests_run);
+  hs_free_log();
+
+  return result != 0;
+}
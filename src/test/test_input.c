@@ -0,0 +1,331 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Hindsight queue seek unit tests @file */
+
+#include "test.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../hs_input.h"
+#include "../hs_logger.h"
+#include "../hs_output.h"
+
+#define QUEUE_PATH "seek_queue"
+#define QUEUE_SUBDIR "input"
+#define QUEUE_FILES 5
+#define MAX_MSGS 64
+
+typedef struct queue_message
+{
+  unsigned long long  id;
+  size_t              offset;
+  long long           timestamp;
+} queue_message;
+
+// Per file message timestamps, out of order within a file and overlapping the
+// previous file but with a non decreasing maximum per file
+static const long long timestamps[QUEUE_FILES][10] = {
+  { 100, 300, 200, 250, 400, 350, 120, 0 },
+  { 380, 390, 500, 450, 420, 600, 410, 0 },
+  { 610, 700, 650, 800, 620, 0 },
+  { 810, 830, 820, 870, 0 },
+  { 860, 900, 850, 1000, 950, 0 },
+};
+
+// index of each file: 'c' complete (written by the test), 'n' none, 'p' partial
+// (a crashed writer, no terminating entry), 'e' empty (a failed write); all
+// but the complete one are rebuilt by the seek
+static const char indexes[QUEUE_FILES] = { 'c', 'n', 'p', 'e', 'n' };
+
+static queue_message msgs[MAX_MSGS];
+static int msgs_cnt;
+static size_t file_size[QUEUE_FILES];
+
+
+static void get_fqfn(unsigned long long id, const char *ext, char *fqfn,
+                     size_t len)
+{
+  snprintf(fqfn, len, "%s/%s/%llu%s", QUEUE_PATH, QUEUE_SUBDIR, id, ext);
+}
+
+
+static int output_varint(unsigned char *buf, unsigned long long v)
+{
+  int n = 0;
+  do {
+    buf[n] = v & 0x7f;
+    v >>= 7;
+    if (v) buf[n] |= 0x80;
+    ++n;
+  } while (v);
+  return n;
+}
+
+
+/**
+ * Writes a framed message with the required Uuid and Timestamp fields
+ */
+static size_t write_message(FILE *fh, long long ts, int seq)
+{
+  unsigned char pb[32];
+  int pblen = 0;
+  pb[pblen++] = 0x0a; // Uuid
+  pb[pblen++] = 16;
+  memset(pb + pblen, 0, 16);
+  memcpy(pb + pblen, &seq, sizeof(seq));
+  pblen += 16;
+  pb[pblen++] = 0x10; // Timestamp
+  pblen += output_varint(pb + pblen, (unsigned long long)ts);
+
+  unsigned char hdr[8];
+  int hlen = 0;
+  hdr[hlen++] = 0x1e;
+  hdr[hlen++] = 0;
+  hdr[hlen++] = 0x08; // message length
+  hlen += output_varint(hdr + hlen, pblen);
+  hdr[1] = hlen - 2;
+  hdr[hlen++] = 0x1f;
+
+  fwrite(hdr, hlen, 1, fh);
+  fwrite(pb, pblen, 1, fh);
+  return hlen + pblen;
+}
+
+
+static void remove_queue()
+{
+  char fqfn[HS_MAX_PATH];
+  for (unsigned long long id = 0; id < QUEUE_FILES; ++id) {
+    get_fqfn(id, ".log", fqfn, sizeof(fqfn));
+    unlink(fqfn);
+    get_fqfn(id, ".idx", fqfn, sizeof(fqfn));
+    unlink(fqfn);
+  }
+  rmdir(QUEUE_PATH "/" QUEUE_SUBDIR);
+  rmdir(QUEUE_PATH);
+}
+
+
+static bool index_exists(unsigned long long id)
+{
+  char fqfn[HS_MAX_PATH];
+  get_fqfn(id, ".idx", fqfn, sizeof(fqfn));
+  return access(fqfn, F_OK) == 0;
+}
+
+
+static char* create_queue()
+{
+  remove_queue();
+  mu_assert(mkdir(QUEUE_PATH, 0700) == 0, "mkdir failed");
+  mu_assert(mkdir(QUEUE_PATH "/" QUEUE_SUBDIR, 0700) == 0, "mkdir failed");
+
+  msgs_cnt = 0;
+  for (unsigned long long id = 0; id < QUEUE_FILES; ++id) {
+    char fqfn[HS_MAX_PATH];
+    get_fqfn(id, ".log", fqfn, sizeof(fqfn));
+    FILE *fh = fopen(fqfn, "wb");
+    mu_assert(fh, "fopen failed: %s", fqfn);
+
+    // an entry after every message, the most precise index the writer makes
+    hs_index_entry e[12];
+    int cnt = 0;
+    int64_t max = INT64_MIN;
+    size_t offset = 0;
+    for (int i = 0; timestamps[id][i]; ++i) {
+      mu_assert(msgs_cnt < MAX_MSGS, "too many messages");
+      msgs[msgs_cnt].id = id;
+      msgs[msgs_cnt].offset = offset;
+      msgs[msgs_cnt].timestamp = timestamps[id][i];
+      offset += write_message(fh, timestamps[id][i], msgs_cnt);
+      ++msgs_cnt;
+      if (timestamps[id][i] > max) max = timestamps[id][i];
+      e[cnt].timestamp = max;
+      e[cnt].offset = offset;
+      ++cnt;
+    }
+    fclose(fh);
+    file_size[id] = offset;
+
+    if (indexes[id] == 'n') continue;
+    if (indexes[id] == 'c') {
+      e[cnt].timestamp = max;
+      e[cnt].offset = UINT64_MAX;
+      ++cnt;
+    } else {
+      cnt = indexes[id] == 'p' ? cnt / 2 : 0;
+    }
+    get_fqfn(id, ".idx", fqfn, sizeof(fqfn));
+    fh = fopen(fqfn, "wb");
+    mu_assert(fh, "fopen failed: %s", fqfn);
+    mu_assert(fwrite(e, sizeof(hs_index_entry), cnt, fh) == (size_t)cnt,
+              "index write failed");
+    fclose(fh);
+  }
+  return NULL;
+}
+
+
+/**
+ * The position of the first message that is not older than ns (the end of the
+ * queue if there is none)
+ */
+static hs_checkpoint linear_scan(long long ns)
+{
+  for (int i = 0; i < msgs_cnt; ++i) {
+    if (msgs[i].timestamp >= ns) {
+      hs_checkpoint cp = { msgs[i].id, msgs[i].offset };
+      return cp;
+    }
+  }
+  hs_checkpoint cp = { QUEUE_FILES - 1, file_size[QUEUE_FILES - 1] };
+  return cp;
+}
+
+
+static bool cp_before(const hs_checkpoint *a, const hs_checkpoint *b)
+{
+  return a->id < b->id || (a->id == b->id && a->offset < b->offset);
+}
+
+
+static bool indexed(unsigned long long id, size_t offset,
+                    unsigned index_interval)
+{
+  if (offset == 0 || indexes[id] == 'c') return true;
+  // rebuilt with an entry after every message or only at the end (the last
+  // file is not complete, it has no end entry)
+  return index_interval == 1
+      || (offset == file_size[id] && id < QUEUE_FILES - 1);
+}
+
+
+/**
+ * The last indexed message boundary at or before the first message that is
+ * not older than ns
+ */
+static hs_checkpoint indexed_scan(long long ns, unsigned index_interval)
+{
+  hs_checkpoint cp = linear_scan(ns);
+  if (indexed(cp.id, cp.offset, index_interval)) return cp;
+  for (int i = msgs_cnt - 1; i >= 0; --i) {
+    if (msgs[i].id != cp.id || msgs[i].offset > cp.offset) continue;
+    if (indexed(cp.id, msgs[i].offset, index_interval)) {
+      cp.offset = msgs[i].offset;
+      break;
+    }
+  }
+  return cp;
+}
+
+
+static char* seek_all(unsigned index_interval)
+{
+  for (long long ns = 0; ns <= 1100; ns += 5) {
+    hs_input hsi;
+    hs_init_input(&hsi, 1024 * 64, QUEUE_PATH, QUEUE_SUBDIR, "test", false);
+    bool ok = hs_seek_input(&hsi, ns, index_interval);
+    hs_checkpoint pos = hsi.cp;
+    hs_free_input(&hsi);
+    mu_assert(ok, "seek %lld failed", ns);
+
+    hs_checkpoint first = linear_scan(ns);
+    mu_assert(!cp_before(&first, &pos), "seek %lld skipped: %llu:%zu", ns,
+              first.id, first.offset);
+    hs_checkpoint expected = indexed_scan(ns, index_interval);
+    mu_assert(pos.id == expected.id && pos.offset == expected.offset,
+              "seek %lld received: %llu:%zu expected: %llu:%zu", ns, pos.id,
+              pos.offset, expected.id, expected.offset);
+  }
+  return NULL;
+}
+
+
+static char* test_seek_rebuilt_indexes()
+{
+  char *ret = create_queue();
+  if (ret) return ret;
+  ret = seek_all(1);
+  if (ret) return ret;
+  // complete files save their rebuilt index, the last one is still growing
+  mu_assert(index_exists(1), "1.idx was not saved");
+  mu_assert(!index_exists(4), "4.idx was saved");
+  return NULL;
+}
+
+
+static char* test_seek_saved_indexes()
+{
+  mu_assert(index_exists(1), "1.idx is missing");
+  return seek_all(1);
+}
+
+
+static char* test_seek_unindexed_queue()
+{
+  char *ret = create_queue();
+  if (ret) return ret;
+  // indexing disabled, complete files still save their rebuilt index so the
+  // second seek reads it instead of scanning the file again
+  ret = seek_all(0);
+  if (ret) return ret;
+  mu_assert(index_exists(1), "1.idx was not saved");
+  mu_assert(!index_exists(4), "4.idx was saved");
+  return seek_all(0);
+}
+
+
+static char* test_seek_empty_queue()
+{
+  remove_queue();
+  mu_assert(mkdir(QUEUE_PATH, 0700) == 0, "mkdir failed");
+  mu_assert(mkdir(QUEUE_PATH "/" QUEUE_SUBDIR, 0700) == 0, "mkdir failed");
+
+  hs_input hsi;
+  hs_init_input(&hsi, 1024 * 64, QUEUE_PATH, QUEUE_SUBDIR, "test", false);
+  hsi.cp.id = 7;
+  hsi.cp.offset = 11;
+  bool ok = hs_seek_input(&hsi, 100, 0);
+  mu_assert(!ok, "seek succeeded");
+  mu_assert(hsi.cp.id == 7 && hsi.cp.offset == 11, "received: %llu:%zu",
+            hsi.cp.id, hsi.cp.offset);
+  hs_free_input(&hsi);
+  return NULL;
+}
+
+
+static char* all_tests()
+{
+  mu_run_test(test_seek_rebuilt_indexes);
+  mu_run_test(test_seek_saved_indexes);
+  mu_run_test(test_seek_unindexed_queue);
+  mu_run_test(test_seek_empty_queue);
+  return NULL;
+}
+
+
+int main()
+{
+  hs_init_log(7);
+  char *result = all_tests();
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", mu_tests_run);
+  remove_queue();
+  hs_free_log();
+
+  return result != 0;
+}